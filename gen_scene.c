@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+// gen_scene writes a synthetic scene file for benchmarking raycast.  The
+// scenes are made of a camera, a number of spheres laid out in one of a few
+// patterns, some planes and some lights.  The same seed always produces the
+// same scene.
+
+typedef enum {
+  UNIFORM,
+  CLUSTERED,
+  OVERLAPPING
+} Layout;
+
+uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+// next_random() returns a uniformly distributed number in [0, 1) using
+// xorshift64*.
+
+double next_random (void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return ((rng_state * 0x2545f4914f6cdd1dull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double uniform (double lo, double hi) {
+  return lo + (hi - lo) * next_random();
+}
+
+// gaussian() returns a normally distributed number by the Box-Muller method.
+
+double gaussian (double mean, double sigma) {
+  double u = next_random();
+  double v = next_random();
+  if (u < 1e-300) {
+    u = 1e-300;
+  }
+  return mean + sigma * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+void usage (void) {
+  fprintf(stderr, "Usage: gen_scene [--spheres N] [--planes N] [--lights N]\n"
+                  "                 [--layout uniform|clustered|overlapping] [--seed S] output.json\n");
+}
+
+int main (int argc, char** argv) {
+  long spheres = 1000;
+  int planes = 1;
+  int lights = 1;
+  Layout layout = UNIFORM;
+  char* output_name = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 < argc && strcmp(argv[i], "--spheres") == 0) {
+      spheres = atol(argv[++i]);
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--planes") == 0) {
+      planes = atoi(argv[++i]);
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--lights") == 0) {
+      lights = atoi(argv[++i]);
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--seed") == 0) {
+      rng_state ^= strtoull(argv[++i], NULL, 10) * 0xbf58476d1ce4e5b9ull;
+      if (rng_state == 0) {
+        rng_state = 1;
+      }
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--layout") == 0) {
+      i += 1;
+      if (strcmp(argv[i], "uniform") == 0) {
+        layout = UNIFORM;
+      }
+      else if (strcmp(argv[i], "clustered") == 0) {
+        layout = CLUSTERED;
+      }
+      else if (strcmp(argv[i], "overlapping") == 0) {
+        layout = OVERLAPPING;
+      }
+      else {
+        fprintf(stderr, "Error: Unknown layout \"%s\".\n", argv[i]);
+        return -1;
+      }
+    }
+    else if (output_name == NULL && argv[i][0] != '-') {
+      output_name = argv[i];
+    }
+    else {
+      usage();
+      return -1;
+    }
+  }
+
+  if (output_name == NULL || spheres < 0 || planes < 0 || lights < 0) {
+    usage();
+    return -1;
+  }
+
+  FILE* output = fopen(output_name, "w");
+  if (output == NULL) {
+    fprintf(stderr, "Error: Unable to open output file \"%s\".\n", output_name);
+    return -1;
+  }
+
+  fprintf(output, "[\n");
+  fprintf(output, "{\"type\": \"camera\", \"width\": 1, \"height\": 1}");
+
+  // The spheres fill a box in front of the camera whose side grows with the
+  // cube root of their number, so the density of the scene, and roughly the
+  // number of spheres each ray passes, stays about the same at every size.
+  // raycast rejects radii below 1, so the spacing between spheres is large
+  // enough that the smallest radius below still comes out at 1.
+  double spacing = 20;
+  double side = spacing * cbrt((double)(spheres > 0 ? spheres : 1));
+  double near = 2 + side / 2;
+  int clusters = (int)sqrt((double)spheres / 100) + 1;
+  double cluster_center[64][3];
+
+  if (clusters > 64) {
+    clusters = 64;
+  }
+  for (int c = 0; c < clusters; c++) {
+    cluster_center[c][0] = uniform(-side / 2, side / 2);
+    cluster_center[c][1] = uniform(-side / 2, side / 2);
+    cluster_center[c][2] = near + uniform(0, side);
+  }
+
+  for (long i = 0; i < spheres; i++) {
+    double x, y, z, radius;
+
+    if (layout == UNIFORM) {
+      x = uniform(-side / 2, side / 2);
+      y = uniform(-side / 2, side / 2);
+      z = near + uniform(0, side);
+      radius = uniform(0.1, 0.4) * spacing;
+    }
+    else if (layout == CLUSTERED) {
+      double* center = cluster_center[(int)(next_random() * clusters)];
+      double sigma = side / (4 * cbrt((double)clusters));
+      x = gaussian(center[0], sigma);
+      y = gaussian(center[1], sigma);
+      z = gaussian(center[2], sigma);
+      if (z < 2) {
+        z = 2 + next_random();
+      }
+      radius = uniform(0.05, 0.2) * spacing;
+    }
+    else {
+      // Large spheres packed into a small region, so most of them overlap
+      // and their bounding boxes cannot be separated cleanly.
+      x = uniform(-side / 8, side / 8);
+      y = uniform(-side / 8, side / 8);
+      z = near + uniform(0, side / 4);
+      radius = uniform(1, 2) * spacing;
+    }
+
+    fprintf(output, ",\n{\"type\": \"sphere\", \"diffuse_color\": [%.3f, %.3f, %.3f], "
+            "\"specular_color\": [0.5, 0.5, 0.5], \"position\": [%.4f, %.4f, %.4f], "
+            "\"radius\": %.4f}",
+            uniform(0.2, 1), uniform(0.2, 1), uniform(0.2, 1),
+            x, y, z, radius);
+  }
+
+  for (int i = 0; i < planes; i++) {
+    double normal[3] = {uniform(-0.2, 0.2), 1, uniform(-0.2, 0.2)};
+    fprintf(output, ",\n{\"type\": \"plane\", \"diffuse_color\": [%.3f, %.3f, %.3f], "
+            "\"position\": [0, %.4f, 0], \"normal\": [%.4f, %.4f, %.4f]}",
+            uniform(0.2, 1), uniform(0.2, 1), uniform(0.2, 1),
+            -side / 2 - 2 - i * side / 4, normal[0], normal[1], normal[2]);
+  }
+
+  for (int i = 0; i < lights; i++) {
+    fprintf(output, ",\n{\"type\": \"light\", \"color\": [%.3f, %.3f, %.3f], "
+            "\"position\": [%.4f, %.4f, %.4f], \"radial-a0\": 1, \"radial-a1\": 0, "
+            "\"radial-a2\": 0}",
+            uniform(0.5, 1), uniform(0.5, 1), uniform(0.5, 1),
+            uniform(-side, side), side + uniform(0, side), uniform(0, near));
+  }
+
+  fprintf(output, "\n]\n");
+  fclose(output);
+  return 0;
+}
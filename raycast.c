@@ -1,11 +1,53 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <setjmp.h>
 #include <math.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <zlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#ifdef RAYCAST_OPENCL
+#define CL_TARGET_OPENCL_VERSION 120
+#include <CL/cl.h>
+#endif
+
+typedef enum {
+  CAMERA,
+  SPHERE,
+  PLANE,
+  LIGHT
+} ObjectType;
 
 typedef struct {
-  char *type;
+  ObjectType type;
   double color[3];
   double position[3];
   bool colorGiven;
@@ -20,14 +62,18 @@ typedef struct {
     struct {
       double normal[3];
       bool normalGiven;
-      double diffuseColor;
-      double specularColor;
+      double diffuseColor[3];
+      double specularColor[3];
+      bool diffuseGiven;
+      bool specularGiven;
     } plane;
     struct {
       double radius;
       bool radiusGiven;
-      double diffuseColor;
-      double specularColor;
+      double diffuseColor[3];
+      double specularColor[3];
+      bool diffuseGiven;
+      bool specularGiven;
     } sphere;
     struct {
       double radial_a0;
@@ -37,17 +83,249 @@ typedef struct {
       bool theta_given;
       double angular_a0;
       double direction[3];
+      bool direction_given;
     } light;
   };
 } Object; 
 
-int line = 1;
+// The line being parsed, for error messages.  Each thread parsing part of
+// a scene file keeps its own.
+
+__thread int line = 1;
+
+// While part of a scene file is parsed speculatively on a worker thread,
+// parse_abort is set, and a parse error jumps back to the worker instead
+// of being reported.  The file is then parsed again in order, so the error
+// reported is the first one in the file, as if it had been parsed on one
+// thread.
+
+__thread jmp_buf* parse_abort;
+
+// While a scene file is checked with --validate, validation is set, and
+// errors are printed and counted instead of ending the program.  Errors
+// that leave the parser lost in the file jump back to resync, which goes on
+// from the next object; the others only mark the object invalid, and the
+// parse simply goes on.  Cameras are counted as soon as their type is read,
+// so a camera with errors in it does not also count as missing.
+
+typedef struct {
+  char* filename;
+  int errors;
+  int cameras;
+  jmp_buf resync;
+} Validation;
+
+Validation* validation;
+
+// report_error() prints an error about the scene file and exits, or counts
+// it when validating.  Validation errors are printed as "file:line: message",
+// without the "Error: " prefix or the newline of format, and without the
+// "on line N" or "on line number N" the message ends in, as the prefix
+// already gives the line.
+
+void report_error (const char* format, va_list args) {
+  char message[512];
+
+  if (parse_abort != NULL) {
+    return;
+  }
+  if (validation == NULL) {
+    vfprintf(stderr, format, args);
+    exit(1);
+  }
+
+  vsnprintf(message, sizeof(message), format, args);
+  char* text = message;
+  if (strncmp(text, "Error: ", 7) == 0) {
+    text += 7;
+  }
+  text[strcspn(text, "\n")] = 0;
+
+  char* suffix = NULL;
+  for (char* at = strstr(text, " on line "); at != NULL; at = strstr(at + 1, " on line ")) {
+    suffix = at;
+  }
+  if (suffix != NULL) {
+    char* number = suffix + 9;
+    if (strncmp(number, "number ", 7) == 0) {
+      number += 7;
+    }
+    if (isdigit((unsigned char)*number) && strspn(number, "0123456789") == strlen(number) - 1 &&
+        number[strlen(number) - 1] == '.') {
+      if (suffix > text && suffix[-1] == ',') {
+        suffix -= 1;
+      }
+      strcpy(suffix, ".");
+    }
+  }
+  fprintf(stderr, "%s:%d: %s\n", validation->filename, line, text);
+  validation->errors += 1;
+}
+
+// parse_error() reports an error that the parser cannot go on from, and
+// gives up on the object, or on a speculative parse.
+
+void parse_error (const char* format, ...) {
+  va_list args;
+
+  va_start(args, format);
+  report_error(format, args);
+  va_end(args);
+  if (parse_abort != NULL) {
+    longjmp(*parse_abort, 1);
+  }
+  longjmp(validation->resync, 1);
+}
+
+// scene_error() reports a value or object that breaks the rules of the
+// scene format but still parses, so a validation can go on with the rest
+// of the object.
+
+void scene_error (const char* format, ...) {
+  va_list args;
+
+  va_start(args, format);
+  report_error(format, args);
+  va_end(args);
+  if (parse_abort != NULL) {
+    longjmp(*parse_abort, 1);
+  }
+}
+
+// The scene file is read into memory in one go and tokenized straight from
+// the buffer.  The buffer is NUL terminated so the tokenizer can look one
+// character past the end without checking.  A file opened for streaming is
+// instead read through a window of JSON_STREAM_CHUNK bytes that
+// refill_json() slides forward between objects, so no single object may be
+// longer than half the window.
+
+#define JSON_STREAM_CHUNK (1 << 20)
+
+typedef struct {
+  char* data;
+  char* pos;
+  char* end;
+  int fd;
+} JsonFile;
+
+// open_json() reads the whole of filename into memory.
+
+JsonFile* open_json (char* filename) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    exit(1);
+  }
+
+  JsonFile* json = malloc(sizeof(JsonFile));
+  json->data = malloc(st.st_size + 1);
+  if (json->data == NULL) {
+    fprintf(stderr, "Error: Could not allocate memory for file \"%s\"\n", filename);
+    exit(1);
+  }
+
+  size_t length = 0;
+  while (length < (size_t)st.st_size) {
+    ssize_t got = read(fd, json->data + length, st.st_size - length);
+    if (got < 0) {
+      fprintf(stderr, "Error: Error reading file.\n");
+      exit(1);
+    }
+    if (got == 0) {
+      break;
+    }
+    length += got;
+  }
+  close(fd);
+
+  json->data[length] = 0;
+  json->pos = json->data;
+  json->end = json->data + length;
+  json->fd = -1;
+  return json;
+}
+
+// refill_json() moves the unread part of a streamed file to the front of its
+// window and fills the rest of the window from the file.  It does nothing
+// while more than half the window is still unread.
+
+void refill_json (JsonFile* json) {
+  size_t left = json->end - json->pos;
+
+  if (json->fd < 0 || left > JSON_STREAM_CHUNK / 2) {
+    return;
+  }
+
+  memmove(json->data, json->pos, left);
+  while (left < JSON_STREAM_CHUNK) {
+    ssize_t got = read(json->fd, json->data + left, JSON_STREAM_CHUNK - left);
+    if (got < 0) {
+      fprintf(stderr, "Error: Error reading file.\n");
+      exit(1);
+    }
+    if (got == 0) {
+      close(json->fd);
+      json->fd = -1;
+      break;
+    }
+    left += got;
+  }
+
+  json->data[left] = 0;
+  json->pos = json->data;
+  json->end = json->data + left;
+}
+
+// open_json_stream() opens filename for reading through a sliding window.
+
+JsonFile* open_json_stream (char* filename) {
+  JsonFile* json = malloc(sizeof(JsonFile));
+
+  json->fd = open(filename, O_RDONLY);
+  json->data = malloc(JSON_STREAM_CHUNK + 1);
+  if (json->fd < 0) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    exit(1);
+  }
+  if (json->data == NULL) {
+    fprintf(stderr, "Error: Could not allocate memory for file \"%s\"\n", filename);
+    exit(1);
+  }
+
+  json->pos = json->end = json->data;
+  refill_json(json);
+  return json;
+}
 
-// next_c() wraps the getc() function and provides error checking and line
+void close_json (JsonFile* json) {
+  if (json->fd >= 0) {
+    close(json->fd);
+  }
+  free(json->data);
+  free(json);
+}
+
+// peek_c() returns the next character without consuming it, or EOF at the
+// end of the file.
+
+int peek_c (JsonFile* json) {
+  if (json->pos >= json->end) {
+    return EOF;
+  }
+  return (unsigned char)*json->pos;
+}
+
+// next_c() consumes the next character and provides error checking and line
 // number maintenance
 
-int next_c (FILE* json) {
-  int c = fgetc(json);
+int next_c (JsonFile* json) {
+  if (json->pos >= json->end) {
+    parse_error("Error: Unexpected end of file on line number %d.\n", line);
+  }
+
+  int c = (unsigned char)*json->pos++;
 
 #ifdef DEBUG
   printf("next_c: '%c'\n", c);
@@ -56,10 +334,6 @@ int next_c (FILE* json) {
   if (c == '\n') {
     line += 1;
   }
-  if (c == EOF) {
-    fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", line);
-    exit(1);
-  }
   return c;
 }
 
@@ -67,89 +341,175 @@ int next_c (FILE* json) {
 // expect_c() checks that the next character is d.  If it is not it emits
 // an error.
 
-void expect_c (FILE* json, int d) {
+void expect_c (JsonFile* json, int d) {
   int c = next_c(json);
 
   if (c == d) {
     return;
   }
 
-  fprintf(stderr, "Error: Expected '%c' on line %d.\n", d, line);
-  exit(1);    
+  parse_error("Error: Expected '%c' on line %d.\n", d, line);
 }
 
 // skip_ws() skips white space in the file.
 
-void skip_ws (FILE* json) {
-  int c = next_c(json);
+void skip_ws (JsonFile* json) {
+  char* pos = json->pos;
 
-  while (isspace(c)) {
-    c = next_c(json);
+  while (pos < json->end && isspace((unsigned char)*pos)) {
+    if (*pos == '\n') {
+      line += 1;
+    }
+    pos++;
   }
 
-  ungetc(c, json);
+  json->pos = pos;
+  if (pos >= json->end) {
+    parse_error("Error: Unexpected end of file on line number %d.\n", line);
+  }
 }
 
 
-// next_string() gets the next string from the file handle and emits an error
-// if a string can not be obtained.
+// next_string() gets the next string from the file and emits an error if a
+// string can not be obtained.  The string is terminated in place in the file
+// buffer, so the returned pointer is only valid until close_json().
 
-char* next_string (FILE* json) {
+char* next_string (JsonFile* json) {
 
-  char buffer[129];
   int c = next_c(json);
 
   if (c != '"') {
-    fprintf(stderr, "Error: Expected string on line %d.\n", line);
-    exit(1);
+    parse_error("Error: Expected string on line %d.\n", line);
   }  
 
+  char* start = json->pos;
   c = next_c(json);
   int i = 0;
 
   while (c != '"') {
     if (i >= 128) {
-      fprintf(stderr, "Error: Strings longer than 128 characters in length are not supported.\n");
-      exit(1);      
+      parse_error("Error: Strings longer than 128 characters in length are not supported.\n");
     }
     if (c == '\\') {
-      fprintf(stderr, "Error: Strings with escape codes are not supported.\n");
-      exit(1);      
+      parse_error("Error: Strings with escape codes are not supported.\n");
     }
     if (c < 32 || c > 126) {
-      fprintf(stderr, "Error: Strings may contain only ascii characters.\n");
-      exit(1);
+      parse_error("Error: Strings may contain only ascii characters.\n");
     }
-    buffer[i] = c;
     i += 1;
     c = next_c(json);
   }
 
-  buffer[i] = 0;
-  return strdup(buffer);
+  json->pos[-1] = 0;
+  return start;
 }
 
-double next_number (FILE* json) {
+// Powers of ten that are exactly representable as doubles.
 
-  double value;
- 
-  fscanf(json, "%lf", &value);
+static const double exact_powers_of_ten[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
-  if (feof(json)) {
-    fprintf(stderr, "Error: Unexpected end of file.\n");
-    exit(1);
+// next_number() parses a JSON number.  Numbers with at most 19 significant
+// digits and a small exponent, which is every number a scene file normally
+// contains, are converted with a single multiply or divide by an exact power
+// of ten.  Anything else is handed to strtod().
+
+double next_number (JsonFile* json) {
+
+  char* start = json->pos;
+  char* p = start;
+  bool negative = false;
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+
+  if (*p == '-') {
+    negative = true;
+    p++;
   }
-  if (ferror(json)) {
-    fprintf(stderr, "Error: Error reading file.\n");
-    exit(1);
+  else if (*p == '+') {
+    p++;
+  }
+
+  if (!isdigit((unsigned char)*p) && !(*p == '.' && isdigit((unsigned char)p[1]))) {
+    parse_error("Error: Expected number on line %d.\n", line);
+  }
+
+  while (isdigit((unsigned char)*p)) {
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (*p - '0');
+      if (mantissa != 0) {
+        digits += 1;
+      }
+    }
+    else {
+      exponent += 1;
+    }
+    p++;
+  }
+
+  if (*p == '.') {
+    p++;
+    while (isdigit((unsigned char)*p)) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (*p - '0');
+        if (mantissa != 0) {
+          digits += 1;
+        }
+        exponent -= 1;
+      }
+      p++;
+    }
+  }
+
+  if (*p == 'e' || *p == 'E') {
+    char* e = p + 1;
+    bool negative_exponent = false;
+    int value = 0;
+
+    if (*e == '-' || *e == '+') {
+      negative_exponent = *e == '-';
+      e++;
+    }
+    if (!isdigit((unsigned char)*e)) {
+      parse_error("Error: Invalid number on line %d.\n", line);
+    }
+    while (isdigit((unsigned char)*e)) {
+      if (value < 100000) {
+        value = value * 10 + (*e - '0');
+      }
+      e++;
+    }
+    exponent += negative_exponent ? -value : value;
+    p = e;
+  }
+
+  if (p > json->end) {
+    parse_error("Error: Unexpected end of file.\n");
+  }
+  json->pos = p;
+
+  double value;
+  if (digits <= 15 && exponent >= -22 && exponent <= 22) {
+    value = (double)mantissa;
+    if (exponent < 0) {
+      value /= exact_powers_of_ten[-exponent];
+    }
+    else {
+      value *= exact_powers_of_ten[exponent];
+    }
+    return negative ? -value : value;
   }
 
-  return value;
+  return strtod(start, NULL);
 }
 
-double* next_vector (FILE* json) {
+// next_vector() parses a vector of three numbers into v.
+
+void next_vector (JsonFile* json, double* v) {
 
-  double* v = malloc(3*sizeof(double));
   expect_c(json, '[');
   skip_ws(json);
 
@@ -166,7 +526,6 @@ double* next_vector (FILE* json) {
   v[2] = next_number(json);
   skip_ws(json);
   expect_c(json, ']');
-  return v;
 }
 
 double sqr(double v) {
@@ -182,16 +541,44 @@ void normalize(double* v) {
 
 
 
-Object* read_scene (char* filename) {
+// An Arena is a growable array of fixed-size items that is only ever
+// appended to.  Its capacity doubles whenever it fills up, so pushing n items
+// costs O(log n) allocations and nothing is ever freed item by item.
 
-  int c;
-  FILE* json = fopen(filename, "r");
+typedef struct {
+  void* data;
+  size_t item_size;
+  size_t count;
+  size_t capacity;
+} Arena;
+
+void arena_init (Arena* arena, size_t item_size) {
+  arena->data = NULL;
+  arena->item_size = item_size;
+  arena->count = 0;
+  arena->capacity = 0;
+}
 
-  if (json == NULL) {
-    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
-    exit(1);
+// arena_push() returns a pointer to a new, uninitialized item at the end of
+// the arena.  Pointers returned earlier are invalidated when the arena grows.
+
+void* arena_push (Arena* arena) {
+  if (arena->count == arena->capacity) {
+    size_t capacity = arena->capacity ? arena->capacity * 2 : 64;
+    void* data = realloc(arena->data, capacity * arena->item_size);
+    if (data == NULL) {
+      fprintf(stderr, "Error: Out of memory after %zu objects.\n", arena->count);
+      exit(1);
+    }
+    arena->data = data;
+    arena->capacity = capacity;
   }
-  
+  return (char*)arena->data + arena->item_size * arena->count++;
+}
+
+// start_list() reads the start of a scene file up to its first object.
+
+void start_list (JsonFile* json) {
   skip_ws(json);
   
   // Find the beginning of the list
@@ -200,28 +587,35 @@ Object* read_scene (char* filename) {
   skip_ws(json);
 
   // Find the objects
-  c = fgetc(json);
-  if (c == ']') {
+  if (peek_c(json) == ']') {
     fprintf(stderr, "Error: This is the worst scene file EVER.\n");
-    fclose(json);
+    close_json(json);
     exit(1);
   }
+}
+
+// parse_objects() parses the objects of a scene file's list, from the one
+// at json->pos on, and hands each one to sink, in file order.  The object
+// passed to sink is only valid during the call.  It returns true at the end
+// of the list, or false once it has reached stop, if stop is not NULL.
+
+typedef void (*ObjectSink) (Object* object, void* context);
+
+bool parse_objects (JsonFile* json, char* stop, ObjectSink sink, void* context) {
+
+  int c;
 
   Object cam;
   cam.camera.height = -1;
   cam.camera.width = -1;
 
-  Object* objectArray = malloc(sizeof(Object) * 1000);
-
-  int i = 0;
-
   while (1) {
-    c = fgetc(json);
-    if (c == ']') {
-      
-      fclose(json);
-      exit(0);
+    skip_ws(json);
+    if (stop != NULL && json->pos >= stop) {
+      return false;
     }
+    refill_json(json);
+    c = next_c(json);
 
     //Parse the object
     if (c == '{') {
@@ -229,8 +623,7 @@ Object* read_scene (char* filename) {
       char* key = next_string(json);
 
       if (strcmp(key, "type") != 0) {
-	fprintf(stderr, "Error: Expected \"type\" key on line number %d.\n", line);
-	exit(1);
+	parse_error("Error: Expected \"type\" key on line number %d.\n", line);
       }
 
       skip_ws(json);
@@ -238,9 +631,14 @@ Object* read_scene (char* filename) {
       skip_ws(json);
 
       char* value = next_string(json);
+      skip_ws(json);
 
       //If the object is a camera store it in the camera struct
       if (strcmp(value, "camera") == 0) {
+        if (validation != NULL) {
+          validation->cameras += 1;
+        }
+        cam.type = CAMERA;
         cam.camera.heightGiven = false;
         cam.camera.widthGiven = false;
 
@@ -260,14 +658,12 @@ Object* read_scene (char* filename) {
      
             if (strcmp(key, "width") == 0) {
               if (cam.camera.widthGiven) {
-                fprintf(stderr, "Error: Camera width has already been set.\n");
-                exit(1);
+                scene_error("Error: Camera width has already been set.\n");
               }
 
               double keyValue = next_number(json);
               if (keyValue < 1) {
-		fprintf(stderr, "Error: Camera width, %lf, is invalid.\n", keyValue);
-                exit(1);
+		scene_error("Error: Camera width, %lf, is invalid.\n", keyValue);
               }
               
               cam.camera.widthGiven = true;
@@ -277,36 +673,34 @@ Object* read_scene (char* filename) {
             else if (strcmp(key, "height") == 0) {
 
               if (cam.camera.heightGiven) {
-                fprintf(stderr, "Error: Camera height has already been set.\n");
-                exit(1);
+                scene_error("Error: Camera height has already been set.\n");
               }
 
               double keyValue = next_number(json);
 
               if (keyValue < 1) {
-                fprintf(stderr, "Error: Camera height, %lf, is invalid.\n", keyValue);
-                exit(1);
+                scene_error("Error: Camera height, %lf, is invalid.\n", keyValue);
               }
               cam.camera.heightGiven = true;
               cam.camera.height = keyValue;
 
             }
+            else {
+              parse_error("Error: Unknown property, \"%s\", on line %d.\n",
+                          key, line);
+            }
           }
           else {
-            fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n",
-                    key, line);
-            exit(1);
-            //char* value = next_string(json);
+            parse_error("Error: Unexpected character '%c' on line %d.\n", c, line);
           }
    
           skip_ws(json);
         }
 
         if ((!cam.camera.heightGiven) || (!cam.camera.widthGiven)) {
-          fprintf(stderr, "Error: Camera height or width not given.\n");
-          exit(1); 
+          scene_error("Error: Camera height or width not given.\n");
         }
-        objectArray[i] = cam;
+        sink(&cam, context);
       }
       
 
@@ -314,10 +708,12 @@ Object* read_scene (char* filename) {
       else if (strcmp(value, "sphere") == 0) {
 
         Object aSphere;
-        aSphere.type = value;
+        aSphere.type = SPHERE;
         aSphere.colorGiven = false;
         aSphere.positionGiven = false;
         aSphere.sphere.radiusGiven = false;
+        aSphere.sphere.diffuseGiven = false;
+        aSphere.sphere.specularGiven = false;
 
         while (1) {
 
@@ -339,36 +735,59 @@ Object* read_scene (char* filename) {
             if (strcmp(key, "color") == 0) {
 
               if (aSphere.colorGiven) {
-                fprintf(stderr, "Error: Sphere color has already been set.\n");
-                exit(1);
+                scene_error("Error: Sphere color has already been set.\n");
               }
 
-              double *keyValue = next_vector(json);
+              double* keyValue = aSphere.color;
+              next_vector(json, keyValue);
 
               if ((keyValue[0] < 0) || (keyValue[0] > 255) || (keyValue[1] < 0) || (keyValue[1] > 255) 
                    || (keyValue[2] < 0) || (keyValue[2] > 255)) {
-                fprintf(stderr, "Error: Sphere color is invalid.\n");
-                exit(1);
+                scene_error("Error: Sphere color is invalid.\n");
               }
               aSphere.colorGiven = true;
+            }
 
-              aSphere.color[0] = keyValue[0];
+            else if (strcmp(key, "diffuse_color") == 0) {
 
-              aSphere.color[1] = keyValue[1];
-              aSphere.color[2] = keyValue[2];
+              if (aSphere.sphere.diffuseGiven) {
+                scene_error("Error: Sphere diffuse color has already been set.\n");
+              }
+
+              double* keyValue = aSphere.sphere.diffuseColor;
+              next_vector(json, keyValue);
+
+              if ((keyValue[0] < 0) || (keyValue[0] > 255) || (keyValue[1] < 0) || (keyValue[1] > 255)
+                   || (keyValue[2] < 0) || (keyValue[2] > 255)) {
+                scene_error("Error: Sphere diffuse color is invalid.\n");
+              }
+              aSphere.sphere.diffuseGiven = true;
+            }
+
+            else if (strcmp(key, "specular_color") == 0) {
 
+              if (aSphere.sphere.specularGiven) {
+                scene_error("Error: Sphere specular color has already been set.\n");
+              }
+
+              double* keyValue = aSphere.sphere.specularColor;
+              next_vector(json, keyValue);
+
+              if ((keyValue[0] < 0) || (keyValue[0] > 255) || (keyValue[1] < 0) || (keyValue[1] > 255)
+                   || (keyValue[2] < 0) || (keyValue[2] > 255)) {
+                scene_error("Error: Sphere specular color is invalid.\n");
+              }
+              aSphere.sphere.specularGiven = true;
             }
 
             else if (strcmp(key, "radius") == 0) {
 
               if (aSphere.sphere.radiusGiven) {
-                fprintf(stderr, "Error: Sphere radius has already been set.\n");
-                exit(1);
+                scene_error("Error: Sphere radius has already been set.\n");
               }
               double keyValue = next_number(json);
               if (keyValue < 1) {
-                fprintf(stderr, "Error: Radius, %lf, is invalid.\n", keyValue);
-                exit(1);
+                scene_error("Error: Radius, %lf, is invalid.\n", keyValue);
               }
               aSphere.sphere.radiusGiven = true;
               aSphere.sphere.radius = keyValue;
@@ -377,38 +796,40 @@ Object* read_scene (char* filename) {
             else if (strcmp(key, "position") == 0) {
 
               if (aSphere.positionGiven) {
-                fprintf(stderr, "Error: Sphere position has already been set.\n");
-                exit(1);
+                scene_error("Error: Sphere position has already been set.\n");
               }
-              double *keyValue = next_vector(json);
+              double* keyValue = aSphere.position;
+              next_vector(json, keyValue);
 
               aSphere.positionGiven = true;
-              aSphere.position[0] = keyValue[0];
-              aSphere.position[1] = keyValue[1];
-              aSphere.position[2] = keyValue[2];
 
             }
           else {
-            fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n",
-                    key, line);
-            //char* value = next_string(json);
+            parse_error("Error: Unknown property, \"%s\", on line %d.\n",
+                        key, line);
+          }
+          }
+          else {
+            parse_error("Error: Unexpected character '%c' on line %d.\n", c, line);
           }
           skip_ws(json);
         }
+        bool aSphereColored = aSphere.colorGiven || aSphere.sphere.diffuseGiven;
+        if (!aSphere.positionGiven || !aSphereColored || !aSphere.sphere.radiusGiven) {
+          scene_error("Error: Position %d, color %d, and radius %d must be given.\n", aSphere.positionGiven, aSphereColored, aSphere.sphere.radiusGiven);
         }
-        if (!aSphere.positionGiven || !aSphere.colorGiven || !aSphere.sphere.radiusGiven) {
-          fprintf(stderr, "Error: Position %d, color %d, and radius %d must be given.\n", aSphere.positionGiven, aSphere.colorGiven, aSphere.sphere.radiusGiven);
-          exit(1);
-        }
-        objectArray[i] = aSphere;
+        sink(&aSphere, context);
       }
       //If the object is a plane store it in the plane struct
       else if (strcmp(value, "plane") == 0) {
 
         Object aPlane;
-        aPlane.type = value;
+        aPlane.type = PLANE;
         aPlane.colorGiven = false;
         aPlane.positionGiven = false;
+        aPlane.plane.normalGiven = false;
+        aPlane.plane.diffuseGiven = false;
+        aPlane.plane.specularGiven = false;
 
         while (1) {
 
@@ -429,237 +850,7453 @@ Object* read_scene (char* filename) {
 
             if (strcmp(key, "color") == 0) {
               if (aPlane.colorGiven) {
-                fprintf(stderr, "Error: Plane color has already been set.\n");
-                exit(1);
+                scene_error("Error: Plane color has already been set.\n");
+              }
+
+              double* keyValue = aPlane.color;
+              next_vector(json, keyValue);
+
+              if ((keyValue[0] < 0) || (keyValue[0] > 255) || (keyValue[1] < 0) || (keyValue[1] > 255)
+                   || (keyValue[2] < 0) || (keyValue[2] > 255)) {
+                scene_error("Error: Plane color is invalid.\n");
+              }
+
+              aPlane.colorGiven = true;
+            }
+
+            else if (strcmp(key, "diffuse_color") == 0) {
+
+              if (aPlane.plane.diffuseGiven) {
+                scene_error("Error: Plane diffuse color has already been set.\n");
               }
 
-              double *keyValue = next_vector(json);
+              double* keyValue = aPlane.plane.diffuseColor;
+              next_vector(json, keyValue);
 
               if ((keyValue[0] < 0) || (keyValue[0] > 255) || (keyValue[1] < 0) || (keyValue[1] > 255)
                    || (keyValue[2] < 0) || (keyValue[2] > 255)) {
-                fprintf(stderr, "Error: Light color is invalid.\n");
-                exit(1);
+                scene_error("Error: Plane diffuse color is invalid.\n");
+              }
+              aPlane.plane.diffuseGiven = true;
+            }
+
+            else if (strcmp(key, "specular_color") == 0) {
+
+              if (aPlane.plane.specularGiven) {
+                scene_error("Error: Plane specular color has already been set.\n");
               }
 
+              double* keyValue = aPlane.plane.specularColor;
+              next_vector(json, keyValue);
+
+              if ((keyValue[0] < 0) || (keyValue[0] > 255) || (keyValue[1] < 0) || (keyValue[1] > 255)
+                   || (keyValue[2] < 0) || (keyValue[2] > 255)) {
+                scene_error("Error: Plane specular color is invalid.\n");
+              }
+              aPlane.plane.specularGiven = true;
             }
 
-            else if (strcmp(key, "") == 0) {
+            else if (strcmp(key, "normal") == 0) {
 
               if (aPlane.plane.normalGiven) {
-                fprintf(stderr, "Error: Plane radius has already been set.\n");
-                exit(1);
+                scene_error("Error: Plane normal has already been set.\n");
 
               }
-              double *keyValue = next_vector(json);
+              double* keyValue = aPlane.plane.normal;
+              next_vector(json, keyValue);
 
               aPlane.plane.normalGiven = true;
-              aPlane.plane.normal[0] = keyValue[0];
-              aPlane.plane.normal[1] = keyValue[1];
-              aPlane.plane.normal[2] = keyValue[2];
             }
 
             else if (strcmp(key, "position") == 0) {
 
               if (aPlane.positionGiven) {
-                fprintf(stderr, "Error: Plane position has already been set.\n");
-                exit(1);
+                scene_error("Error: Plane position has already been set.\n");
               }
-              double *keyValue = next_vector(json);
+              double* keyValue = aPlane.position;
+              next_vector(json, keyValue);
 
               aPlane.positionGiven = true;
-              aPlane.position[0] = keyValue[0];
-              aPlane.position[1] = keyValue[1];
-              aPlane.position[2] = keyValue[2];
 
             }
           else {
-            fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n",
-                    key, line);
-            //char* value = next_string(json);
+            parse_error("Error: Unknown property, \"%s\", on line %d.\n",
+                        key, line);
+          }
+          }
+          else {
+            parse_error("Error: Unexpected character '%c' on line %d.\n", c, line);
           }
           skip_ws(json);
         }
+        bool aPlaneColored = aPlane.colorGiven || aPlane.plane.diffuseGiven;
+        if (!aPlane.positionGiven || !aPlaneColored || !aPlane.plane.normalGiven) {
+          scene_error("Error: Position, color, and normal must be given.\n");
         }
-        if (!aPlane.positionGiven || !aPlane.colorGiven || !aPlane.plane.normalGiven) {
-          fprintf(stderr, "Error: Position, color, and normal must be given.\n");
-          exit(1);
-        }
-        objectArray[i] = aPlane;
+        sink(&aPlane, context);
       }
-          //If the object is a plane store it in the plane struct
+      //If the object is a light store it in the light struct
       else if (strcmp(value, "light") == 0) {
 
-          Object aPlane;
-          aPlane.type = value;
-          aPlane.colorGiven = false;
-          aPlane.positionGiven = false;
+        Object aLight;
+        aLight.type = LIGHT;
+        aLight.colorGiven = false;
+        aLight.positionGiven = false;
+        aLight.light.radial_a0 = 1;
+        aLight.light.radial_a1 = 0;
+        aLight.light.radial_a2 = 0;
+        aLight.light.angular_a0 = 0;
+        aLight.light.theta = 0;
+        aLight.light.theta_given = false;
+        aLight.light.direction_given = false;
+        bool radialGiven[3] = {false, false, false};
+        bool angularGiven = false;
+
+        while (1) {
+
+          c = next_c(json);
+          if (c == '}') {
+
+           // stop parsing this object
+            break;
+          }
+          else if (c == ',') {
+            // read another field
+
+            skip_ws(json);
+            char* key = next_string(json);
+            skip_ws(json);
+            expect_c(json, ':');
+            skip_ws(json);
 
-          while (1) {
+            if (strcmp(key, "color") == 0) {
+              if (aLight.colorGiven) {
+                scene_error("Error: Light color has already been set.\n");
+              }
 
-              c = next_c(json);
-              if (c == '}') {
+              double* keyValue = aLight.color;
+              next_vector(json, keyValue);
 
-                  // stop parsing this object
-                  break;
+              if ((keyValue[0] < 0) || (keyValue[0] > 255) || (keyValue[1] < 0) || (keyValue[1] > 255)
+                   || (keyValue[2] < 0) || (keyValue[2] > 255)) {
+                scene_error("Error: Light color is invalid.\n");
               }
-              else if (c == ',') {
-                  // read another field
+              aLight.colorGiven = true;
+            }
 
-                  skip_ws(json);
-                  char* key = next_string(json);
-                  skip_ws(json);
-                  expect_c(json, ':');
-                  skip_ws(json);
+            else if (strcmp(key, "position") == 0) {
 
-                  if (strcmp(key, "color") == 0) {
-                      if (aPlane.colorGiven) {
-                          fprintf(stderr, "Error: Plane color has already been set.\n");
-                          exit(1);
-                      }
+              if (aLight.positionGiven) {
+                scene_error("Error: Light position has already been set.\n");
+              }
+              next_vector(json, aLight.position);
+              aLight.positionGiven = true;
+            }
 
-                      double *keyValue = next_vector(json);
+            else if (strcmp(key, "direction") == 0) {
 
-                      if ((keyValue[0] < 0) || (keyValue[0] > 255) || (keyValue[1] < 0) || (keyValue[1] > 255)
-                          || (keyValue[2] < 0) || (keyValue[2] > 255)) {
-                          fprintf(stderr, "Error: Plane color is invalid.\n");
-                          exit(1);
-                      }
+              if (aLight.light.direction_given) {
+                scene_error("Error: Light direction has already been set.\n");
+              }
+              next_vector(json, aLight.light.direction);
+              aLight.light.direction_given = true;
+            }
 
-                      aPlane.colorGiven = true;
-                      aPlane.color[0] = keyValue[0];
-                      aPlane.color[1] = keyValue[1];
-                      aPlane.color[2] = keyValue[2];
-                  }
+            else if (strcmp(key, "radial-a0") == 0 || strcmp(key, "radial-a1") == 0 ||
+                     strcmp(key, "radial-a2") == 0 || strcmp(key, "radial_a0") == 0 ||
+                     strcmp(key, "radial_a1") == 0 || strcmp(key, "radial_a2") == 0) {
 
-                  else if (strcmp(key, "normal") == 0) {
+              int k = key[8] - '0';
+              if (radialGiven[k]) {
+                scene_error("Error: Light %s has already been set.\n", key);
+              }
 
-                      if (aPlane.plane.normalGiven) {
-                          fprintf(stderr, "Error: Plane radius has already been set.\n");
-                          exit(1);
+              double keyValue = next_number(json);
+              if (keyValue < 0) {
+                scene_error("Error: Light %s, %lf, is invalid.\n", key, keyValue);
+              }
+              radialGiven[k] = true;
+              if (k == 0) {
+                aLight.light.radial_a0 = keyValue;
+              }
+              else if (k == 1) {
+                aLight.light.radial_a1 = keyValue;
+              }
+              else {
+                aLight.light.radial_a2 = keyValue;
+              }
+            }
 
-                      }
-                      double *keyValue = next_vector(json);
+            else if (strcmp(key, "angular-a0") == 0 || strcmp(key, "angular_a0") == 0) {
 
-                      aPlane.plane.normalGiven = true;
-                      aPlane.plane.normal[0] = keyValue[0];
-                      aPlane.plane.normal[1] = keyValue[1];
-                      aPlane.plane.normal[2] = keyValue[2];
-                  }
+              if (angularGiven) {
+                scene_error("Error: Light angular-a0 has already been set.\n");
+              }
 
-                  else if (strcmp(key, "position") == 0) {
+              double keyValue = next_number(json);
+              if (keyValue < 0) {
+                scene_error("Error: Light angular-a0, %lf, is invalid.\n", keyValue);
+              }
+              angularGiven = true;
+              aLight.light.angular_a0 = keyValue;
+            }
 
-                      if (aPlane.positionGiven) {
-                          fprintf(stderr, "Error: Plane position has already been set.\n");
-                          exit(1);
-                      }
-                      double *keyValue = next_vector(json);
+            else if (strcmp(key, "theta") == 0) {
 
-                      aPlane.positionGiven = true;
-                      aPlane.position[0] = keyValue[0];
-                      aPlane.position[1] = keyValue[1];
-                      aPlane.position[2] = keyValue[2];
+              if (aLight.light.theta_given) {
+                scene_error("Error: Light theta has already been set.\n");
+              }
 
-                  }
-                  else {
-                      fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n",
-                              key, line);
-                      //char* value = next_string(json);
-                  }
-                  skip_ws(json);
+              double keyValue = next_number(json);
+              if (keyValue < 0 || keyValue > 180) {
+                scene_error("Error: Light theta, %lf, is invalid.\n", keyValue);
               }
+              aLight.light.theta_given = true;
+              aLight.light.theta = keyValue;
+            }
+
+            else {
+              parse_error("Error: Unknown property, \"%s\", on line %d.\n",
+                          key, line);
+            }
+          }
+          else {
+            parse_error("Error: Unexpected character '%c' on line %d.\n", c, line);
           }
+          skip_ws(json);
+        }
+        if (!aLight.colorGiven || !aLight.positionGiven) {
+          scene_error("Error: Light color and position must be given.\n");
+        }
+        if (aLight.light.theta > 0 && !aLight.light.direction_given) {
+          scene_error("Error: Spot lights must be given a direction.\n");
+        }
+        sink(&aLight, context);
       }
       else {
-        fprintf(stderr, "Error: Unknown type, \"%s\", on line number %d.\n", value, line);
-        exit(1);
+        parse_error("Error: Unknown type, \"%s\", on line number %d.\n", value, line);
       }      
 
-      skip_ws(json);
-      
     }
-   
-   i = i + 1;
-  }
-}
+    else {
+      parse_error("Error: Expected '{' on line %d.\n", line);
+    }
 
-double plane_intersection(double *origin, double *direction, double *position, double *normal) {
+    skip_ws(json);
+    c = next_c(json);
+    if (c == ']') {
+      return true;
+    }
+    if (c != ',') {
+      parse_error("Error: Expected ',' or ']' on line %d.\n", line);
+    }
+  }
+}
+
+// parse_scene() parses a scene file and hands each object it describes to
+// sink, in file order.
+
+void parse_scene (JsonFile* json, ObjectSink sink, void* context) {
+  start_list(json);
+  parse_objects(json, NULL, sink, context);
+}
+
+// skip_to_object() moves a streamed scene file on to the start of the next
+// object after a parse error, for a validation to go on from there.  It
+// returns false if the file ends first.  Objects never contain braces, so
+// the next '{' is taken to start one, unless the error was in a string
+// that happens to contain one.
+
+bool skip_to_object (JsonFile* json) {
+  while (true) {
+    refill_json(json);
+    if (json->pos >= json->end) {
+      return false;
+    }
+    if (*json->pos == '{') {
+      return true;
+    }
+    next_c(json);
+  }
+}
+
+void push_object (Object* object, void* context) {
+  *(Object*)arena_push(context) = *object;
+}
+
+// Scene files of at least two PARSE_CHUNK_BYTES are parsed on several
+// threads.  A quick scan over the file finds where its top-level objects
+// start, and splits it there into one chunk per thread.  Each chunk is
+// handed to its thread as soon as the scan has found where it ends, and
+// the thread parses it, with the usual checks, into an arena of its own.
+// The arenas are then joined in file order.  The scan only needs to tell
+// strings from structure and count lines, which is far less work than
+// parsing, so the threads are soon all busy.
+
+#define PARSE_CHUNK_BYTES (4 << 20)
+
+typedef struct {
+  JsonFile json;
+  char* stop;
+  int line;
+  Arena objects;
+  bool failed;
+  pthread_t thread;
+} ParseChunk;
+
+// parse_chunk() is the thread function that parses one chunk.  A chunk
+// failed if it had a parse error or did not end where the scan said the
+// next one starts.
+
+void* parse_chunk (void* arg) {
+  ParseChunk* chunk = arg;
+  jmp_buf on_error;
+
+  line = chunk->line;
+  chunk->failed = true;
+  if (setjmp(on_error) == 0) {
+    parse_abort = &on_error;
+    bool ended = parse_objects(&chunk->json, chunk->stop, push_object, &chunk->objects);
+    chunk->failed = chunk->stop == NULL ? !ended : ended || chunk->json.pos != chunk->stop;
+  }
+  parse_abort = NULL;
+  return NULL;
+}
+
+// start_chunk() starts parsing the chunk of json from start up to stop, or
+// to the end of the list if stop is NULL, on its own thread.  start is on
+// line start_line.
+
+void start_chunk (ParseChunk* chunk, JsonFile* json, char* start, int start_line, char* stop) {
+  chunk->json = *json;
+  chunk->json.pos = start;
+  chunk->stop = stop;
+  chunk->line = start_line;
+  arena_init(&chunk->objects, sizeof(Object));
+  if (pthread_create(&chunk->thread, NULL, parse_chunk, chunk) != 0) {
+    fprintf(stderr, "Error: Unable to create parser thread.\n");
+    exit(1);
+  }
+}
+
+// parse_parallel() parses json into objects in up to num_chunks chunks.
+// It returns false if any chunk failed, leaving objects empty.
+
+bool parse_parallel (JsonFile* json, int num_chunks, Arena* objects) {
+  ParseChunk chunks[num_chunks];
+  int started = 0;
+
+  start_list(json);
+
+  // Bytes that matter to the scan: quotes, brackets and newlines.
+  static bool structural[256];
+  structural['"'] = structural['\n'] = true;
+  structural['{'] = structural['}'] = structural['['] = structural[']'] = true;
+
+  char* start = json->pos;
+  int start_line = line;
+  int scan_line = line;
+  size_t target = (json->end - start) / num_chunks;
+  char* split = start + target;
+  bool in_string = false;
+  int depth = 0;
+
+  for (char* p = start; p < json->end; p++) {
+    int c = (unsigned char)*p;
+
+    if (!structural[c]) {
+      continue;
+    }
+    if (c == '\n') {
+      scan_line += 1;
+    }
+    else if (c == '"') {
+      in_string = !in_string;
+    }
+    else if (in_string) {
+      continue;
+    }
+    else if (c == '{' || c == '[') {
+      if (c == '{' && depth == 0 && p >= split && started < num_chunks - 1) {
+        start_chunk(&chunks[started++], json, start, start_line, p);
+        start = p;
+        start_line = scan_line;
+        split = p + target;
+      }
+      depth += 1;
+    }
+    else if (depth-- == 0) {
+      break;
+    }
+  }
+  start_chunk(&chunks[started++], json, start, start_line, NULL);
+
+  bool failed = false;
+  size_t count = 0;
+  for (int i = 0; i < started; i++) {
+    pthread_join(chunks[i].thread, NULL);
+    failed |= chunks[i].failed;
+    count += chunks[i].objects.count;
+  }
+
+  arena_init(objects, sizeof(Object));
+  if (!failed) {
+    objects->data = malloc(sizeof(Object) * count);
+    if (objects->data == NULL) {
+      fprintf(stderr, "Error: Out of memory after %zu objects.\n", count);
+      exit(1);
+    }
+    for (int i = 0; i < started; i++) {
+      memcpy((Object*)objects->data + objects->count, chunks[i].objects.data,
+             sizeof(Object) * chunks[i].objects.count);
+      objects->count += chunks[i].objects.count;
+    }
+    objects->capacity = count;
+  }
+  for (int i = 0; i < started; i++) {
+    free(chunks[i].objects.data);
+  }
+  return !failed;
+}
+
+// read_scene() parses the scene file, on up to num_threads threads, and
+// returns the array of objects it describes.  The number of objects is
+// stored in count.
+
+Object* read_scene (char* filename, int* count, int num_threads) {
+  JsonFile* json = open_json(filename);
+  size_t chunks = (json->end - json->data) / PARSE_CHUNK_BYTES;
+  int first_line = line;
+  Arena objects;
+
+  if (chunks > (size_t)num_threads) {
+    chunks = num_threads;
+  }
+
+  // A file that fails to parse in parallel is parsed again from the start
+  // on this thread, which stops at its first error, or might even succeed
+  // had the scan split it wrongly.  Strings are terminated in place while
+  // parsing, so it needs to be read in again first.
+  if (chunks < 2 || !parse_parallel(json, chunks, &objects)) {
+    if (chunks >= 2) {
+      close_json(json);
+      json = open_json(filename);
+      line = first_line;
+    }
+    arena_init(&objects, sizeof(Object));
+    parse_scene(json, push_object, &objects);
+  }
+  close_json(json);
+
+  *count = objects.count;
+  return objects.data;
+}
+
+// A Light is a point light, or a spot light if spot is set.  direction is
+// normalized and cos_theta is the cosine of the spot light's half angle.
+
+typedef struct {
+  double position[3];
+  double direction[3];
+  double color[3];
+  double radial[3];
+  double angular_a0;
+  double cos_theta;
+  bool spot;
+} Light;
+
+// A Scene is the compiled, render-ready form of the object list.  Spheres
+// and planes are split into structure-of-arrays form, so the intersection
+// loops stream through contiguous arrays of just the values they need and
+// never look at an object's type.  Colors are only read for the object a ray
+// finally hits, so they are kept together per object.  The sphere and plane
+// colors are the diffuse colors; a "color" property is used as the diffuse
+// color when no "diffuse_color" is given.
+
+typedef struct {
+  double view_width;
+  double view_height;
+
+  int num_spheres;
+  double* sphere_cx;
+  double* sphere_cy;
+  double* sphere_cz;
+  double* sphere_r2;
+  double* sphere_color;
+  double* sphere_specular;
+
+  // Planes are stored as dot(normal, x) = d.
+  int num_planes;
+  double* plane_nx;
+  double* plane_ny;
+  double* plane_nz;
+  double* plane_d;
+  double* plane_color;
+  double* plane_specular;
+
+  int num_lights;
+  Light* lights;
+
+  // The spheres are indexed by a BVH built by build_bvh().  Each leaf owns a
+  // run of SIMD_PAD sphere slots, so the sphere arrays hold sphere_slots
+  // entries, some of them padding.  sphere_index gives the position in the
+  // scene file of the sphere in each slot, or -1 for padding.
+  struct BVHNode* bvh;
+  int bvh_nodes;
+  int sphere_slots;
+  int* sphere_index;
+
+  // Values that only depend on the ray origin, filled in by bake_scene() for
+  // the camera position: the offset from each sphere's center to the origin
+  // and |origin - center|^2 - r^2, and for each plane d - dot(normal, origin).
+  double baked_origin[3];
+  double* sphere_ox;
+  double* sphere_oy;
+  double* sphere_oz;
+  double* sphere_c;
+  double* plane_num;
+  bool planes_normalized;
+
+  // A scene loaded by load_compiled_scene() points into a private mapping
+  // of the file instead of owning its arrays.
+  void* mapping;
+  size_t mapping_size;
+
+  // A scene streamed in under a memory budget keeps its spheres in bricks
+  // on disk instead of in the arrays above, which are then empty.
+  struct BrickStore* bricks;
+} Scene;
+
+// The sphere and plane arrays are padded to a multiple of SIMD_PAD entries
+// with primitives that can never be hit, so the SIMD kernels never need a
+// scalar tail loop.
+
+#define SIMD_PAD 4
+
+int pad_count (int n) {
+  return (n + SIMD_PAD - 1) / SIMD_PAD * SIMD_PAD;
+}
+
+// alloc_doubles() allocates a cache-line aligned array of n doubles.
+
+double* alloc_doubles (size_t n) {
+  double* v = aligned_alloc(64, ((n * sizeof(double) + 63) / 64) * 64 + 64);
+  if (v == NULL) {
+    fprintf(stderr, "Error: Out of memory while compiling the scene.\n");
+    exit(1);
+  }
+  return v;
+}
+
+// compile_scene() builds a Scene from the objects returned by read_scene().
+
+void compile_scene (Object* objects, int count, Scene* scene) {
+  int num_spheres = 0;
+  int num_planes = 0;
+  int num_lights = 0;
+
+  scene->view_width = -1;
+  scene->view_height = -1;
+
+  for (int i = 0; i < count; i++) {
+    if (objects[i].type == SPHERE) {
+      num_spheres += 1;
+    }
+    else if (objects[i].type == PLANE) {
+      num_planes += 1;
+    }
+    else if (objects[i].type == LIGHT) {
+      num_lights += 1;
+    }
+    else if (objects[i].type == CAMERA) {
+      scene->view_width = objects[i].camera.width;
+      scene->view_height = objects[i].camera.height;
+    }
+  }
+
+  if (scene->view_width < 0) {
+    fprintf(stderr, "Error: The scene does not contain a camera.\n");
+    exit(1);
+  }
+
+  scene->bvh = NULL;
+  scene->bvh_nodes = 0;
+  scene->sphere_index = NULL;
+  scene->sphere_ox = scene->sphere_oy = scene->sphere_oz = scene->sphere_c = NULL;
+  scene->plane_num = NULL;
+  scene->planes_normalized = false;
+  scene->mapping = NULL;
+  scene->bricks = NULL;
+  scene->sphere_slots = pad_count(num_spheres);
+
+  scene->num_spheres = num_spheres;
+  scene->sphere_cx = alloc_doubles(pad_count(num_spheres));
+  scene->sphere_cy = alloc_doubles(pad_count(num_spheres));
+  scene->sphere_cz = alloc_doubles(pad_count(num_spheres));
+  scene->sphere_r2 = alloc_doubles(pad_count(num_spheres));
+  scene->sphere_color = alloc_doubles(num_spheres * 3);
+  scene->sphere_specular = alloc_doubles(num_spheres * 3);
+
+  scene->num_planes = num_planes;
+  scene->plane_nx = alloc_doubles(pad_count(num_planes));
+  scene->plane_ny = alloc_doubles(pad_count(num_planes));
+  scene->plane_nz = alloc_doubles(pad_count(num_planes));
+  scene->plane_d = alloc_doubles(pad_count(num_planes));
+  scene->plane_color = alloc_doubles(num_planes * 3);
+  scene->plane_specular = alloc_doubles(num_planes * 3);
+
+  scene->num_lights = num_lights;
+  scene->lights = calloc(num_lights + 1, sizeof(Light));
+
+  // A sphere with a negative squared radius is never hit, and neither is a
+  // plane with a zero normal and a negative offset.
+  for (int i = num_spheres; i < pad_count(num_spheres); i++) {
+    scene->sphere_cx[i] = scene->sphere_cy[i] = scene->sphere_cz[i] = 0;
+    scene->sphere_r2[i] = -1;
+  }
+  for (int i = num_planes; i < pad_count(num_planes); i++) {
+    scene->plane_nx[i] = scene->plane_ny[i] = scene->plane_nz[i] = 0;
+    scene->plane_d[i] = -1;
+  }
+
+  int s = 0;
+  int p = 0;
+  int l = 0;
+  for (int i = 0; i < count; i++) {
+    Object* object = &objects[i];
+
+    if (object->type == SPHERE) {
+      scene->sphere_cx[s] = object->position[0];
+      scene->sphere_cy[s] = object->position[1];
+      scene->sphere_cz[s] = object->position[2];
+      scene->sphere_r2[s] = sqr(object->sphere.radius);
+      double* diffuse = object->sphere.diffuseGiven ? object->sphere.diffuseColor : object->color;
+      memcpy(&scene->sphere_color[s * 3], diffuse, sizeof(double) * 3);
+      for (int k = 0; k < 3; k++) {
+        scene->sphere_specular[s * 3 + k] = object->sphere.specularGiven ? object->sphere.specularColor[k] : 0;
+      }
+      s += 1;
+    }
+    else if (object->type == PLANE) {
+      double* n = object->plane.normal;
+      scene->plane_nx[p] = n[0];
+      scene->plane_ny[p] = n[1];
+      scene->plane_nz[p] = n[2];
+      scene->plane_d[p] = n[0] * object->position[0] + n[1] * object->position[1] +
+                          n[2] * object->position[2];
+      double* diffuse = object->plane.diffuseGiven ? object->plane.diffuseColor : object->color;
+      memcpy(&scene->plane_color[p * 3], diffuse, sizeof(double) * 3);
+      for (int k = 0; k < 3; k++) {
+        scene->plane_specular[p * 3 + k] = object->plane.specularGiven ? object->plane.specularColor[k] : 0;
+      }
+      p += 1;
+    }
+    else if (object->type == LIGHT) {
+      Light* light = &scene->lights[l];
+      memcpy(light->position, object->position, sizeof(double) * 3);
+      memcpy(light->color, object->color, sizeof(double) * 3);
+      light->radial[0] = object->light.radial_a0;
+      light->radial[1] = object->light.radial_a1;
+      light->radial[2] = object->light.radial_a2;
+      light->angular_a0 = object->light.angular_a0;
+      light->spot = object->light.theta > 0;
+      light->cos_theta = cos(object->light.theta * M_PI / 180);
+      if (object->light.direction_given) {
+        memcpy(light->direction, object->light.direction, sizeof(double) * 3);
+        normalize(light->direction);
+      }
+      l += 1;
+    }
+  }
+}
+
+void free_scene (Scene* scene) {
+  if (scene->mapping != NULL) {
+    munmap(scene->mapping, scene->mapping_size);
+    return;
+  }
+
+  free(scene->sphere_cx);
+  free(scene->sphere_cy);
+  free(scene->sphere_cz);
+  free(scene->sphere_r2);
+  free(scene->sphere_color);
+  free(scene->sphere_specular);
+  free(scene->plane_nx);
+  free(scene->plane_ny);
+  free(scene->plane_nz);
+  free(scene->plane_d);
+  free(scene->plane_color);
+  free(scene->plane_specular);
+  free(scene->lights);
+  free(scene->bvh);
+  free(scene->sphere_index);
+  free(scene->sphere_ox);
+  free(scene->sphere_oy);
+  free(scene->sphere_oz);
+  free(scene->sphere_c);
+  free(scene->plane_num);
+}
+
+// A BVH is a binary tree of axis-aligned boxes over the spheres, flattened
+// into an array.  The two children of an interior node are stored next to
+// each other, so one node points at both and they share a cache line pair.
+// Leaves hold at most SIMD_PAD spheres, exactly one SIMD packet.
+
+typedef struct BVHNode {
+  double min[3];
+  double max[3];
+  int first;    // interior: left child, right child is first + 1; leaf: first sphere slot
+  int count;    // leaf: number of sphere slots; interior: 0
+  int pad[2];
+} BVHNode;
+
+// BuildItem holds what the builder needs to know about one sphere.
+
+typedef struct {
+  double min[3];
+  double max[3];
+  double center[3];
+  int index;
+} BuildItem;
+
+// The builder allocates nodes from a shared counter, so with several build
+// threads the order nodes end up in depends on timing.  While building, a
+// leaf's first and count refer to the items array, whose order depends only
+// on the splits.  layout_bvh() then rewrites the tree in a fixed depth-first
+// order and assigns the sphere slots, so the final BVH is the same however
+// many threads built it.
+
+typedef struct {
+  Scene* scene;
+  BuildItem* items;
+  BVHNode* nodes;
+  int next_node;
+  int spare_threads;
+} BVHBuilder;
+
+// Subtrees with fewer items than this are always built by the thread that
+// created them.
+
+#define BVH_TASK_SIZE 4096
+
+#define BVH_BINS 12
+
+void grow_box (double* min, double* max, double* box_min, double* box_max) {
+  for (int k = 0; k < 3; k++) {
+    if (box_min[k] < min[k]) {
+      min[k] = box_min[k];
+    }
+    if (box_max[k] > max[k]) {
+      max[k] = box_max[k];
+    }
+  }
+}
+
+double box_area (double* min, double* max) {
+  double dx = max[0] - min[0];
+  double dy = max[1] - min[1];
+  double dz = max[2] - min[2];
+
+  if (dx < 0) {
+    return 0;
+  }
+  return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+// partition_items() picks a split for items[start, end) with the surface area
+// heuristic, evaluated over BVH_BINS bins of centroids along the widest axis,
+// and reorders the items so the left side comes first.  It returns the index
+// of the first item on the right side.
+
+int partition_items (BuildItem* items, int start, int end) {
+  double cmin[3] = {INFINITY, INFINITY, INFINITY};
+  double cmax[3] = {-INFINITY, -INFINITY, -INFINITY};
+
+  for (int i = start; i < end; i++) {
+    grow_box(cmin, cmax, items[i].center, items[i].center);
+  }
+
+  int axis = 0;
+  for (int k = 1; k < 3; k++) {
+    if (cmax[k] - cmin[k] > cmax[axis] - cmin[axis]) {
+      axis = k;
+    }
+  }
+
+  double extent = cmax[axis] - cmin[axis];
+  int mid = start + (end - start) / 2;
+
+  // All the centers coincide, so any split is as good as any other.
+  if (extent <= 0) {
+    return mid;
+  }
+
+  int bin_count[BVH_BINS] = {0};
+  double bin_min[BVH_BINS][3], bin_max[BVH_BINS][3];
+  double scale = BVH_BINS / extent;
+
+  for (int b = 0; b < BVH_BINS; b++) {
+    for (int k = 0; k < 3; k++) {
+      bin_min[b][k] = INFINITY;
+      bin_max[b][k] = -INFINITY;
+    }
+  }
+
+  for (int i = start; i < end; i++) {
+    int b = (int)((items[i].center[axis] - cmin[axis]) * scale);
+    if (b >= BVH_BINS) {
+      b = BVH_BINS - 1;
+    }
+    bin_count[b] += 1;
+    grow_box(bin_min[b], bin_max[b], items[i].min, items[i].max);
+  }
+
+  // Sweep from the right to get the area and count of every right side, then
+  // from the left to evaluate each split.
+  double right_area[BVH_BINS];
+  int right_count[BVH_BINS];
+  double min[3] = {INFINITY, INFINITY, INFINITY};
+  double max[3] = {-INFINITY, -INFINITY, -INFINITY};
+  int count = 0;
+
+  for (int b = BVH_BINS - 1; b > 0; b--) {
+    grow_box(min, max, bin_min[b], bin_max[b]);
+    count += bin_count[b];
+    right_area[b] = box_area(min, max);
+    right_count[b] = count;
+  }
+
+  double best_cost = INFINITY;
+  int best_split = -1;
+
+  for (int k = 0; k < 3; k++) {
+    min[k] = INFINITY;
+    max[k] = -INFINITY;
+  }
+  count = 0;
+
+  for (int b = 1; b < BVH_BINS; b++) {
+    grow_box(min, max, bin_min[b - 1], bin_max[b - 1]);
+    count += bin_count[b - 1];
+    double cost = count * box_area(min, max) + right_count[b] * right_area[b];
+    if (count > 0 && right_count[b] > 0 && cost < best_cost) {
+      best_cost = cost;
+      best_split = b;
+    }
+  }
+
+  if (best_split < 0) {
+    return mid;
+  }
+
+  // Partition in place around the chosen bin boundary.
+  int left = start;
+  int right = end - 1;
+  while (left <= right) {
+    int b = (int)((items[left].center[axis] - cmin[axis]) * scale);
+    if (b >= BVH_BINS) {
+      b = BVH_BINS - 1;
+    }
+    if (b < best_split) {
+      left += 1;
+    }
+    else {
+      BuildItem swap = items[left];
+      items[left] = items[right];
+      items[right] = swap;
+      right -= 1;
+    }
+  }
+
+  if (left == start || left == end) {
+    return mid;
+  }
+  return left;
+}
+
+// Below this depth splits are made at the median rather than by SAH, which
+// bounds the depth of the tree, and so the traversal stack, at
+// BVH_MEDIAN_DEPTH + log2(number of spheres).
+
+#define BVH_MEDIAN_DEPTH 90
+
+// Traversal keeps at most one node per level of the tree on its stack.
+
+#define BVH_STACK_SIZE 128
+
+typedef struct {
+  BVHBuilder* builder;
+  int node_index;
+  int start;
+  int end;
+  int depth;
+} BuildTask;
+
+void build_node (BVHBuilder* builder, int node_index, int start, int end, int depth);
+
+void* build_task (void* arg) {
+  BuildTask* task = arg;
+  build_node(task->builder, task->node_index, task->start, task->end, task->depth);
+  return NULL;
+}
+
+// build_node() fills in node for items[start, end) and recursively builds
+// its children.  Large left subtrees are handed to a new thread while the
+// calling thread builds the right one, as long as the thread budget allows.
+
+void build_node (BVHBuilder* builder, int node_index, int start, int end, int depth) {
+  BVHNode* node = &builder->nodes[node_index];
+
+  for (int k = 0; k < 3; k++) {
+    node->min[k] = INFINITY;
+    node->max[k] = -INFINITY;
+  }
+  for (int i = start; i < end; i++) {
+    grow_box(node->min, node->max, builder->items[i].min, builder->items[i].max);
+  }
+
+  if (end - start <= SIMD_PAD) {
+    node->first = start;
+    node->count = end - start;
+    return;
+  }
+
+  int split = start + (end - start) / 2;
+  if (depth < BVH_MEDIAN_DEPTH) {
+    split = partition_items(builder->items, start, end);
+  }
+
+  int left = __atomic_fetch_add(&builder->next_node, 2, __ATOMIC_RELAXED);
+
+  node->first = left;
+  node->count = 0;
+
+  BuildTask task = {builder, left, start, split, depth + 1};
+  pthread_t thread;
+  bool spawned = false;
+
+  if (split - start >= BVH_TASK_SIZE &&
+      __atomic_sub_fetch(&builder->spare_threads, 1, __ATOMIC_RELAXED) >= 0) {
+    spawned = pthread_create(&thread, NULL, build_task, &task) == 0;
+    if (!spawned) {
+      __atomic_add_fetch(&builder->spare_threads, 1, __ATOMIC_RELAXED);
+    }
+  }
+  else if (split - start >= BVH_TASK_SIZE) {
+    __atomic_add_fetch(&builder->spare_threads, 1, __ATOMIC_RELAXED);
+  }
+
+  if (!spawned) {
+    build_task(&task);
+  }
+  build_node(builder, left + 1, split, end, depth + 1);
+
+  if (spawned) {
+    pthread_join(thread, NULL);
+    __atomic_add_fetch(&builder->spare_threads, 1, __ATOMIC_RELAXED);
+  }
+}
+
+// layout_bvh() copies the subtree at old_index into nodes[new_index] in
+// depth-first order, giving each leaf the next SIMD_PAD sphere slots.
+
+void layout_bvh (BVHBuilder* builder, BVHNode* nodes, int old_index, int new_index,
+                 int* next_node, int* next_slot, int* slot_of) {
+  BVHNode* node = &builder->nodes[old_index];
+
+  nodes[new_index] = *node;
+
+  if (node->count > 0) {
+    int slot = *next_slot;
+    *next_slot += SIMD_PAD;
+
+    nodes[new_index].first = slot;
+    nodes[new_index].count = SIMD_PAD;
+    for (int i = 0; i < SIMD_PAD; i++) {
+      slot_of[slot + i] = i < node->count ? builder->items[node->first + i].index : -1;
+    }
+    return;
+  }
+
+  int left = *next_node;
+  *next_node += 2;
+
+  nodes[new_index].first = left;
+  layout_bvh(builder, nodes, node->first, left, next_node, next_slot, slot_of);
+  layout_bvh(builder, nodes, node->first + 1, left + 1, next_node, next_slot, slot_of);
+}
+
+// permute_doubles() replaces *array with a copy reordered by slot_of.  Slots
+// with no sphere get the value padding.
+
+void permute_doubles (double** array, int* slot_of, int slots, int stride, double padding) {
+  double* permuted = alloc_doubles((size_t)slots * stride);
+
+  for (int i = 0; i < slots; i++) {
+    for (int k = 0; k < stride; k++) {
+      permuted[i * stride + k] = slot_of[i] >= 0 ? (*array)[slot_of[i] * stride + k] : padding;
+    }
+  }
+
+  free(*array);
+  *array = permuted;
+}
+
+// build_bvh() builds the BVH over the scene's spheres on up to num_threads
+// threads and reorders the sphere arrays so every leaf's spheres are
+// contiguous.  Planes are unbounded and stay in their own list, which is
+// always tested.
+
+void build_bvh (Scene* scene, int num_threads) {
+  int n = scene->num_spheres;
+
+  if (n == 0) {
+    return;
+  }
+
+  BVHBuilder builder;
+  builder.scene = scene;
+  builder.items = malloc(sizeof(BuildItem) * n);
+  // A tree over n items with at least one item per leaf has at most 2n - 1
+  // nodes, and there are at most n leaves of SIMD_PAD slots each.
+  builder.nodes = calloc(2 * n, sizeof(BVHNode));
+  builder.next_node = 1;
+  builder.spare_threads = num_threads - 1;
+
+  BVHNode* nodes = aligned_alloc(64, sizeof(BVHNode) * 2 * n);
+  int* slot_of = malloc(sizeof(int) * SIMD_PAD * n);
+
+  if (builder.items == NULL || builder.nodes == NULL || nodes == NULL || slot_of == NULL) {
+    fprintf(stderr, "Error: Out of memory while building the BVH.\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < n; i++) {
+    BuildItem* item = &builder.items[i];
+    double r = sqrt(scene->sphere_r2[i]);
+    item->center[0] = scene->sphere_cx[i];
+    item->center[1] = scene->sphere_cy[i];
+    item->center[2] = scene->sphere_cz[i];
+    for (int k = 0; k < 3; k++) {
+      item->min[k] = item->center[k] - r;
+      item->max[k] = item->center[k] + r;
+    }
+    item->index = i;
+  }
+
+  build_node(&builder, 0, 0, n, 0);
+
+  int num_nodes = 1;
+  int slots = 0;
+  layout_bvh(&builder, nodes, 0, 0, &num_nodes, &slots, slot_of);
+
+  permute_doubles(&scene->sphere_cx, slot_of, slots, 1, 0);
+  permute_doubles(&scene->sphere_cy, slot_of, slots, 1, 0);
+  permute_doubles(&scene->sphere_cz, slot_of, slots, 1, 0);
+  permute_doubles(&scene->sphere_r2, slot_of, slots, 1, -1);
+  permute_doubles(&scene->sphere_color, slot_of, slots, 3, 0);
+  permute_doubles(&scene->sphere_specular, slot_of, slots, 3, 0);
+
+  scene->bvh = nodes;
+  scene->bvh_nodes = num_nodes;
+  scene->sphere_slots = slots;
+  scene->sphere_index = slot_of;
+
+  free(builder.items);
+  free(builder.nodes);
+}
+
+// refit_bvh() recomputes the boxes of the scene's BVH after its spheres
+// have moved, keeping the shape of the tree.  Children always come after
+// their parent in the node array, so a single backward pass sees every
+// child before its parent.
+
+void refit_bvh (Scene* scene) {
+  for (int i = scene->bvh_nodes - 1; i >= 0; i--) {
+    BVHNode* node = &scene->bvh[i];
+
+    for (int k = 0; k < 3; k++) {
+      node->min[k] = INFINITY;
+      node->max[k] = -INFINITY;
+    }
+
+    if (node->count == 0) {
+      BVHNode* children = &scene->bvh[node->first];
+      grow_box(node->min, node->max, children[0].min, children[0].max);
+      grow_box(node->min, node->max, children[1].min, children[1].max);
+      continue;
+    }
+
+    for (int s = node->first; s < node->first + node->count; s++) {
+      if (scene->sphere_r2[s] < 0) {
+        continue;
+      }
+      double r = sqrt(scene->sphere_r2[s]);
+      double center[3] = {scene->sphere_cx[s], scene->sphere_cy[s], scene->sphere_cz[s]};
+      double min[3], max[3];
+      for (int k = 0; k < 3; k++) {
+        min[k] = center[k] - r;
+        max[k] = center[k] + r;
+      }
+      grow_box(node->min, node->max, min, max);
+    }
+  }
+}
+
+// bvh_cost() estimates the cost of the scene's BVH by the surface area
+// heuristic: the expected number of nodes visited plus spheres tested by a
+// ray that enters the root box.  Refitting keeps the tree correct but lets
+// this grow as the spheres drift away from where the tree was built.
+
+double bvh_cost (Scene* scene) {
+  if (scene->bvh_nodes == 0) {
+    return 0;
+  }
+
+  double root = box_area(scene->bvh[0].min, scene->bvh[0].max);
+  double cost = 0;
+
+  for (int i = 0; i < scene->bvh_nodes; i++) {
+    BVHNode* node = &scene->bvh[i];
+    cost += box_area(node->min, node->max) * (1 + node->count);
+  }
+  return root > 0 ? cost / root : scene->bvh_nodes;
+}
+
+// rebuild_bvh() puts the spheres back in scene file order and builds a new
+// BVH over them, exactly as build_bvh() would for a freshly loaded scene.
+// The baked arrays are dropped, since the number of slots may change, so
+// bake_scene() has to be called again.
+
+void rebuild_bvh (Scene* scene, int num_threads) {
+  int n = scene->num_spheres;
+  int* slot = malloc(sizeof(int) * (n > 0 ? n : 1));
+
+  if (slot == NULL) {
+    fprintf(stderr, "Error: Out of memory while rebuilding the BVH.\n");
+    exit(1);
+  }
+  for (int s = 0; s < scene->sphere_slots; s++) {
+    if (scene->sphere_index != NULL && scene->sphere_index[s] >= 0) {
+      slot[scene->sphere_index[s]] = s;
+    }
+  }
+
+  if (scene->bvh != NULL) {
+    permute_doubles(&scene->sphere_cx, slot, n, 1, 0);
+    permute_doubles(&scene->sphere_cy, slot, n, 1, 0);
+    permute_doubles(&scene->sphere_cz, slot, n, 1, 0);
+    permute_doubles(&scene->sphere_r2, slot, n, 1, 0);
+    permute_doubles(&scene->sphere_color, slot, n, 3, 0);
+    permute_doubles(&scene->sphere_specular, slot, n, 3, 0);
+  }
+  free(slot);
+
+  free(scene->bvh);
+  free(scene->sphere_index);
+  free(scene->sphere_ox);
+  free(scene->sphere_oy);
+  free(scene->sphere_oz);
+  free(scene->sphere_c);
+  free(scene->plane_num);
+  scene->bvh = NULL;
+  scene->bvh_nodes = 0;
+  scene->sphere_index = NULL;
+  scene->sphere_ox = scene->sphere_oy = scene->sphere_oz = scene->sphere_c = NULL;
+  scene->plane_num = NULL;
+
+  build_bvh(scene, num_threads);
+}
+
+// bake_scene() precomputes everything the primary ray kernels need that is
+// the same for every ray from origin.  It normalizes the plane normals the
+// first time it is called and must be called again whenever the camera
+// moves.  Until it has been called, only the general kernels can be used.
+
+void bake_scene (Scene* scene, double* origin) {
+  if (!scene->planes_normalized) {
+    for (int i = 0; i < scene->num_planes; i++) {
+      double len = sqrt(sqr(scene->plane_nx[i]) + sqr(scene->plane_ny[i]) + sqr(scene->plane_nz[i]));
+      scene->plane_nx[i] /= len;
+      scene->plane_ny[i] /= len;
+      scene->plane_nz[i] /= len;
+      scene->plane_d[i] /= len;
+    }
+    scene->planes_normalized = true;
+  }
+
+  if (scene->plane_num == NULL) {
+    scene->sphere_ox = alloc_doubles(scene->sphere_slots);
+    scene->sphere_oy = alloc_doubles(scene->sphere_slots);
+    scene->sphere_oz = alloc_doubles(scene->sphere_slots);
+    scene->sphere_c = alloc_doubles(scene->sphere_slots);
+    scene->plane_num = alloc_doubles(scene->num_planes);
+  }
+
+  memcpy(scene->baked_origin, origin, sizeof(double) * 3);
+
+  for (int i = 0; i < scene->sphere_slots; i++) {
+    scene->sphere_ox[i] = origin[0] - scene->sphere_cx[i];
+    scene->sphere_oy[i] = origin[1] - scene->sphere_cy[i];
+    scene->sphere_oz[i] = origin[2] - scene->sphere_cz[i];
+    scene->sphere_c[i] = sqr(scene->sphere_ox[i]) + sqr(scene->sphere_oy[i]) +
+                         sqr(scene->sphere_oz[i]) - scene->sphere_r2[i];
+  }
+  for (int i = 0; i < scene->num_planes; i++) {
+    scene->plane_num[i] = scene->plane_d[i] - (scene->plane_nx[i] * origin[0] +
+                          scene->plane_ny[i] * origin[1] + scene->plane_nz[i] * origin[2]);
+  }
+}
+
+// A compiled scene (.rscn) file is a Scene after compile_scene(),
+// build_bvh() and bake_scene(), written out so it can be mapped back in and
+// rendered without parsing or building anything.  The file starts with a
+// RscnHeader, followed by the scene's arrays in the order scene_sections()
+// lists them, each starting on a cache line.  The arrays are stored in the
+// native byte order and layout, so the header records enough to refuse a
+// file written by an incompatible build.
+
+#define RSCN_MAGIC "RSCN"
+#define RSCN_VERSION 1
+#define RSCN_ALIGN 64
+#define RSCN_SECTIONS 19
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t light_size;
+  uint32_t node_size;
+  int32_t num_spheres;
+  int32_t sphere_slots;
+  int32_t num_planes;
+  int32_t num_lights;
+  int32_t bvh_nodes;
+  double view_width;
+  double view_height;
+  double baked_origin[3];
+  uint64_t offsets[RSCN_SECTIONS];
+  uint64_t file_size;
+} RscnHeader;
+
+typedef struct {
+  void** pointer;
+  size_t size;
+} SceneSection;
+
+// scene_sections() lists every array of a baked scene along with its size
+// in bytes.
+
+void scene_sections (Scene* scene, SceneSection* sections) {
+  size_t slots = (size_t)scene->sphere_slots * sizeof(double);
+  size_t planes = (size_t)pad_count(scene->num_planes) * sizeof(double);
+  size_t colors = (size_t)scene->num_planes * 3 * sizeof(double);
+  int n = 0;
+
+  sections[n++] = (SceneSection){(void**)&scene->sphere_cx, slots};
+  sections[n++] = (SceneSection){(void**)&scene->sphere_cy, slots};
+  sections[n++] = (SceneSection){(void**)&scene->sphere_cz, slots};
+  sections[n++] = (SceneSection){(void**)&scene->sphere_r2, slots};
+  sections[n++] = (SceneSection){(void**)&scene->sphere_color, slots * 3};
+  sections[n++] = (SceneSection){(void**)&scene->sphere_specular, slots * 3};
+  sections[n++] = (SceneSection){(void**)&scene->plane_nx, planes};
+  sections[n++] = (SceneSection){(void**)&scene->plane_ny, planes};
+  sections[n++] = (SceneSection){(void**)&scene->plane_nz, planes};
+  sections[n++] = (SceneSection){(void**)&scene->plane_d, planes};
+  sections[n++] = (SceneSection){(void**)&scene->plane_color, colors};
+  sections[n++] = (SceneSection){(void**)&scene->plane_specular, colors};
+  sections[n++] = (SceneSection){(void**)&scene->lights, (size_t)scene->num_lights * sizeof(Light)};
+  sections[n++] = (SceneSection){(void**)&scene->bvh, (size_t)scene->bvh_nodes * sizeof(BVHNode)};
+  sections[n++] = (SceneSection){(void**)&scene->sphere_ox, slots};
+  sections[n++] = (SceneSection){(void**)&scene->sphere_oy, slots};
+  sections[n++] = (SceneSection){(void**)&scene->sphere_oz, slots};
+  sections[n++] = (SceneSection){(void**)&scene->sphere_c, slots};
+  sections[n++] = (SceneSection){(void**)&scene->plane_num, (size_t)scene->num_planes * sizeof(double)};
+}
+
+// write_compiled_scene() writes a baked scene to filename as a .rscn file.
+
+void write_compiled_scene (char* filename, Scene* scene) {
+  SceneSection sections[RSCN_SECTIONS];
+  RscnHeader header;
+  static const char zeros[RSCN_ALIGN];
+
+  scene_sections(scene, sections);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RSCN_MAGIC, 4);
+  header.version = RSCN_VERSION;
+  header.byte_order = 0x01020304;
+  header.light_size = sizeof(Light);
+  header.node_size = sizeof(BVHNode);
+  header.num_spheres = scene->num_spheres;
+  header.sphere_slots = scene->sphere_slots;
+  header.num_planes = scene->num_planes;
+  header.num_lights = scene->num_lights;
+  header.bvh_nodes = scene->bvh_nodes;
+  header.view_width = scene->view_width;
+  header.view_height = scene->view_height;
+  memcpy(header.baked_origin, scene->baked_origin, sizeof(double) * 3);
+
+  uint64_t offset = sizeof(header);
+  for (int i = 0; i < RSCN_SECTIONS; i++) {
+    offset = (offset + RSCN_ALIGN - 1) / RSCN_ALIGN * RSCN_ALIGN;
+    header.offsets[i] = offset;
+    offset += sections[i].size;
+  }
+  header.file_size = offset;
+
+  FILE* output = fopen(filename, "wb");
+  if (output == NULL) {
+    fprintf(stderr, "Error: Unable to open output file \"%s\".\n", filename);
+    exit(1);
+  }
+
+  bool ok = fwrite(&header, sizeof(header), 1, output) == 1;
+  uint64_t written = sizeof(header);
+  for (int i = 0; i < RSCN_SECTIONS && ok; i++) {
+    ok = fwrite(zeros, 1, header.offsets[i] - written, output) == header.offsets[i] - written;
+    if (ok && sections[i].size > 0) {
+      ok = fwrite(*sections[i].pointer, sections[i].size, 1, output) == 1;
+    }
+    written = header.offsets[i] + sections[i].size;
+  }
+
+  if (fclose(output) != 0 || !ok) {
+    fprintf(stderr, "Error: Unable to write compiled scene \"%s\".\n", filename);
+    exit(1);
+  }
+}
+
+// is_compiled_scene() reports whether filename starts with the .rscn magic.
+
+bool is_compiled_scene (char* filename) {
+  char magic[4];
+  FILE* input = fopen(filename, "rb");
+
+  if (input == NULL) {
+    return false;
+  }
+  bool compiled = fread(magic, 4, 1, input) == 1 && memcmp(magic, RSCN_MAGIC, 4) == 0;
+  fclose(input);
+  return compiled;
+}
+
+// check_bvh() checks that every node of a loaded BVH stays inside the
+// scene: leaves cover whole SIMD packets of sphere slots, interior nodes
+// point at children further on in the array, and no path from the root is
+// deeper than the traversal stack.
+
+bool check_bvh (Scene* scene) {
+  int* depth = calloc(scene->bvh_nodes, sizeof(int));
+  bool valid = depth != NULL;
+
+  if (scene->bvh_nodes > 0 && valid) {
+    depth[0] = 1;
+  }
+  for (int i = 0; i < scene->bvh_nodes && valid; i++) {
+    BVHNode* node = &scene->bvh[i];
+
+    if (node->count > 0) {
+      valid = node->count <= SIMD_PAD && node->first >= 0 && node->first % SIMD_PAD == 0 &&
+              node->first <= scene->sphere_slots - SIMD_PAD;
+    }
+    else {
+      valid = node->count == 0 && node->first > i && node->first < scene->bvh_nodes - 1 &&
+              depth[i] < BVH_STACK_SIZE - 1;
+      if (valid) {
+        depth[node->first] = depth[node->first + 1] = depth[i] + 1;
+      }
+    }
+  }
+  free(depth);
+  return valid;
+}
+
+// check_compiled_scene() checks the header of a mapped .rscn file of size
+// bytes and points scene at the arrays in it.  It prints an error and
+// returns false if the file is not a compiled scene this build can use.
+
+bool check_compiled_scene (char* filename, uint8_t* base, size_t size, Scene* scene) {
+  RscnHeader* header = (RscnHeader*)base;
+
+  if (memcmp(header->magic, RSCN_MAGIC, 4) != 0 || header->version != RSCN_VERSION) {
+    fprintf(stderr, "Error: \"%s\" is not a version %d compiled scene.\n", filename, RSCN_VERSION);
+    return false;
+  }
+  if (header->byte_order != 0x01020304 || header->light_size != sizeof(Light) ||
+      header->node_size != sizeof(BVHNode)) {
+    fprintf(stderr, "Error: \"%s\" was compiled on an incompatible machine.\n", filename);
+    return false;
+  }
+  if (header->file_size != (uint64_t)size || header->num_spheres < 0 ||
+      header->sphere_slots < header->num_spheres || header->num_planes < 0 ||
+      header->num_lights < 0 || header->bvh_nodes < 0) {
+    fprintf(stderr, "Error: Compiled scene \"%s\" is corrupt.\n", filename);
+    return false;
+  }
+
+  memset(scene, 0, sizeof(*scene));
+  scene->view_width = header->view_width;
+  scene->view_height = header->view_height;
+  scene->num_spheres = header->num_spheres;
+  scene->sphere_slots = header->sphere_slots;
+  scene->num_planes = header->num_planes;
+  scene->num_lights = header->num_lights;
+  scene->bvh_nodes = header->bvh_nodes;
+  memcpy(scene->baked_origin, header->baked_origin, sizeof(double) * 3);
+  scene->planes_normalized = true;
+  scene->mapping = base;
+  scene->mapping_size = size;
+
+  SceneSection sections[RSCN_SECTIONS];
+  scene_sections(scene, sections);
+  for (int i = 0; i < RSCN_SECTIONS; i++) {
+    uint64_t offset = header->offsets[i];
+    if (offset % RSCN_ALIGN != 0 || offset > header->file_size ||
+        sections[i].size > header->file_size - offset) {
+      fprintf(stderr, "Error: Compiled scene \"%s\" is corrupt.\n", filename);
+      return false;
+    }
+    *sections[i].pointer = base + offset;
+  }
+  if (scene->bvh_nodes == 0) {
+    scene->bvh = NULL;
+  }
+  if (!check_bvh(scene)) {
+    fprintf(stderr, "Error: Compiled scene \"%s\" has a corrupt BVH.\n", filename);
+    return false;
+  }
+  return true;
+}
+
+// load_compiled_scene() maps a .rscn file and points scene at the arrays in
+// it.  The mapping is private and writable, so baking the scene again for
+// another camera copies only the pages it touches and never changes the
+// file.  It prints an error and returns false if the file cannot be used.
+
+bool load_compiled_scene (char* filename, Scene* scene) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Error: Unable to open compiled scene \"%s\".\n", filename);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  if ((size_t)st.st_size < sizeof(RscnHeader)) {
+    fprintf(stderr, "Error: \"%s\" is too short to be a compiled scene.\n", filename);
+    close(fd);
+    return false;
+  }
+
+  uint8_t* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Error: Unable to map compiled scene \"%s\".\n", filename);
+    return false;
+  }
+  if (!check_compiled_scene(filename, base, st.st_size, scene)) {
+    munmap(base, st.st_size);
+    return false;
+  }
+  return true;
+}
+
+// The intersection kernels below come in scalar, SSE2, AVX2 and NEON
+// flavours.  They all perform the same IEEE operations in the same order, so
+// whichever one select_kernels() picks the image is identical.  Ties between
+// primitives at the same distance go to the one with the lowest index.
+
+// plane_intersection_scalar() returns the distance to the closest plane a ray
+// hits, or INFINITY if it misses them all.  The index of the plane is stored
+// in hit.
+
+double plane_intersection_scalar (Scene* scene, double *origin, double *direction, int* hit) {
+  double best_t = INFINITY;
+
+  for (int i = 0; i < scene->num_planes; i++) {
+    double a = scene->plane_nx[i] * direction[0] + scene->plane_ny[i] * direction[1] +
+               scene->plane_nz[i] * direction[2];
+    double d = scene->plane_d[i] - (scene->plane_nx[i] * origin[0] +
+               scene->plane_ny[i] * origin[1] + scene->plane_nz[i] * origin[2]);
+
+    double t = d/a;
+
+    if (t > 0 && t < best_t) {
+      best_t = t;
+      *hit = i;
+    }
+  }
+
+  return best_t;
+}
+
+// sphere_intersection_scalar() tests a ray against the sphere slots
+// [first, last).  It returns the distance to the closest one that is nearer
+// than best_t, storing its index in hit, or best_t if there is none.  It
+// uses the half-b form of the quadratic with b = dot(d, o - c).  Every
+// direction must be normalized, so a = |d|^2 is 1 and the roots are simply
+// -b +- sqrt(b^2 - c).
+
+double sphere_intersection_scalar (Scene* scene, double *origin, double *direction,
+                                   int first, int last, double best_t, int* hit) {
+  for (int i = first; i < last; i++) {
+    double ox = origin[0] - scene->sphere_cx[i];
+    double oy = origin[1] - scene->sphere_cy[i];
+    double oz = origin[2] - scene->sphere_cz[i];
+
+    double b = direction[0]*ox + direction[1]*oy + direction[2]*oz;
+    double c = sqr(ox) + sqr(oy) + sqr(oz) - scene->sphere_r2[i];
+
+    double det = sqr(b) - c;
+
+    if (det < 0) {
+      continue;
+    }
+
+    det = sqrt(det);
+
+    double t = -b - det;
+    if (t <= 0) {
+      t = -b + det;
+    }
+
+    if (t > 0 && t < best_t) {
+      best_t = t;
+      *hit = i;
+    }
+  }
+
+  return best_t;
+}
+
+// sphere_primary_scalar() is sphere_intersection_scalar() for rays from the
+// baked origin.  With the origin offsets and c precomputed, each sphere costs
+// three multiplies and three adds before the discriminant test.
+
+double sphere_primary_scalar (Scene* scene, double *direction, int first, int last,
+                              double best_t, int* hit) {
+  for (int i = first; i < last; i++) {
+    double b = direction[0]*scene->sphere_ox[i] + direction[1]*scene->sphere_oy[i] +
+               direction[2]*scene->sphere_oz[i];
+    double det = sqr(b) - scene->sphere_c[i];
+
+    if (det < 0) {
+      continue;
+    }
+
+    det = sqrt(det);
+
+    double t = -b - det;
+    if (t <= 0) {
+      t = -b + det;
+    }
+
+    if (t > 0 && t < best_t) {
+      best_t = t;
+      *hit = i;
+    }
+  }
+
+  return best_t;
+}
+
+// plane_primary() is plane_intersection() for rays from the baked origin.
+// Scenes have few planes, so there is no SIMD version.
+
+double plane_primary (Scene* scene, double *direction, int* hit) {
+  double best_t = INFINITY;
+
+  for (int i = 0; i < scene->num_planes; i++) {
+    double a = scene->plane_nx[i] * direction[0] + scene->plane_ny[i] * direction[1] +
+               scene->plane_nz[i] * direction[2];
+    double t = scene->plane_num[i] / a;
+
+    if (t > 0 && t < best_t) {
+      best_t = t;
+      *hit = i;
+    }
+  }
+
+  return best_t;
+}
+
+// pick_closest() reduces per-lane closest hits to a single one, preferring
+// the lowest index on ties.
+
+double pick_closest (double* t, double* index, int lanes, int* hit) {
+  double best_t = INFINITY;
+  double best_index = -1;
+
+  for (int i = 0; i < lanes; i++) {
+    if (t[i] < best_t || (t[i] == best_t && t[i] < INFINITY && index[i] < best_index)) {
+      best_t = t[i];
+      best_index = index[i];
+    }
+  }
+  if (best_index >= 0) {
+    *hit = (int)best_index;
+  }
+  return best_t;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// The x86 kernels are compiled without FMA so they round exactly like the
+// scalar ones.
+
+__attribute__((target("sse2")))
+double plane_intersection_sse2 (Scene* scene, double *origin, double *direction, int* hit) {
+  __m128d dx = _mm_set1_pd(direction[0]), dy = _mm_set1_pd(direction[1]), dz = _mm_set1_pd(direction[2]);
+  __m128d ox = _mm_set1_pd(origin[0]), oy = _mm_set1_pd(origin[1]), oz = _mm_set1_pd(origin[2]);
+  __m128d zero = _mm_setzero_pd();
+  __m128d best_t = _mm_set1_pd(INFINITY);
+  __m128d best_index = _mm_set1_pd(-1);
+  __m128d index = _mm_set_pd(1, 0);
+  __m128d step = _mm_set1_pd(2);
+
+  for (int i = 0; i < scene->num_planes; i += 2) {
+    __m128d nx = _mm_load_pd(&scene->plane_nx[i]);
+    __m128d ny = _mm_load_pd(&scene->plane_ny[i]);
+    __m128d nz = _mm_load_pd(&scene->plane_nz[i]);
+    __m128d a = _mm_add_pd(_mm_add_pd(_mm_mul_pd(nx, dx), _mm_mul_pd(ny, dy)), _mm_mul_pd(nz, dz));
+    __m128d no = _mm_add_pd(_mm_add_pd(_mm_mul_pd(nx, ox), _mm_mul_pd(ny, oy)), _mm_mul_pd(nz, oz));
+    __m128d t = _mm_div_pd(_mm_sub_pd(_mm_load_pd(&scene->plane_d[i]), no), a);
+
+    __m128d closer = _mm_and_pd(_mm_cmpgt_pd(t, zero), _mm_cmplt_pd(t, best_t));
+    best_t = _mm_or_pd(_mm_and_pd(closer, t), _mm_andnot_pd(closer, best_t));
+    best_index = _mm_or_pd(_mm_and_pd(closer, index), _mm_andnot_pd(closer, best_index));
+    index = _mm_add_pd(index, step);
+  }
+
+  double t[2], lane_index[2];
+  _mm_storeu_pd(t, best_t);
+  _mm_storeu_pd(lane_index, best_index);
+  return pick_closest(t, lane_index, 2, hit);
+}
+
+__attribute__((target("sse2")))
+double sphere_intersection_sse2 (Scene* scene, double *origin, double *direction,
+                                 int first, int last, double best_t, int* hit) {
+  __m128d dx = _mm_set1_pd(direction[0]), dy = _mm_set1_pd(direction[1]), dz = _mm_set1_pd(direction[2]);
+  __m128d ox = _mm_set1_pd(origin[0]), oy = _mm_set1_pd(origin[1]), oz = _mm_set1_pd(origin[2]);
+  __m128d zero = _mm_setzero_pd();
+  __m128d closest = _mm_set1_pd(best_t);
+  __m128d best_index = _mm_set1_pd(-1);
+  __m128d index = _mm_set_pd(first + 1, first);
+  __m128d step = _mm_set1_pd(2);
+
+  for (int i = first; i < last; i += 2) {
+    __m128d px = _mm_sub_pd(ox, _mm_load_pd(&scene->sphere_cx[i]));
+    __m128d py = _mm_sub_pd(oy, _mm_load_pd(&scene->sphere_cy[i]));
+    __m128d pz = _mm_sub_pd(oz, _mm_load_pd(&scene->sphere_cz[i]));
+    __m128d b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, px), _mm_mul_pd(dy, py)), _mm_mul_pd(dz, pz));
+    __m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(px, px), _mm_mul_pd(py, py)),
+                                      _mm_mul_pd(pz, pz)),
+                           _mm_load_pd(&scene->sphere_r2[i]));
+    __m128d det = _mm_sub_pd(_mm_mul_pd(b, b), c);
+    __m128d valid = _mm_cmpge_pd(det, zero);
+
+    // Most rays miss most spheres; skip the square root and the rest when
+    // none of the lanes has a real root.
+    if (_mm_movemask_pd(valid) == 0) {
+      index = _mm_add_pd(index, step);
+      continue;
+    }
+
+    __m128d root = _mm_sqrt_pd(_mm_max_pd(det, zero));
+    __m128d nb = _mm_sub_pd(zero, b);
+    __m128d t0 = _mm_sub_pd(nb, root);
+    __m128d t1 = _mm_add_pd(nb, root);
+    __m128d use_t0 = _mm_cmpgt_pd(t0, zero);
+    __m128d t = _mm_or_pd(_mm_and_pd(use_t0, t0), _mm_andnot_pd(use_t0, t1));
+
+    __m128d closer = _mm_and_pd(valid, _mm_and_pd(_mm_cmpgt_pd(t, zero), _mm_cmplt_pd(t, closest)));
+    closest = _mm_or_pd(_mm_and_pd(closer, t), _mm_andnot_pd(closer, closest));
+    best_index = _mm_or_pd(_mm_and_pd(closer, index), _mm_andnot_pd(closer, best_index));
+    index = _mm_add_pd(index, step);
+  }
+
+  double t[2], lane_index[2];
+  _mm_storeu_pd(t, closest);
+  _mm_storeu_pd(lane_index, best_index);
+  return pick_closest(t, lane_index, 2, hit);
+}
+
+
+__attribute__((target("sse2")))
+double sphere_primary_sse2 (Scene* scene, double *direction, int first, int last,
+                            double best_t, int* hit) {
+  __m128d dx = _mm_set1_pd(direction[0]), dy = _mm_set1_pd(direction[1]), dz = _mm_set1_pd(direction[2]);
+  __m128d zero = _mm_setzero_pd();
+  __m128d closest = _mm_set1_pd(best_t);
+  __m128d best_index = _mm_set1_pd(-1);
+  __m128d index = _mm_set_pd(first + 1, first);
+  __m128d step = _mm_set1_pd(2);
+
+  for (int i = first; i < last; i += 2) {
+    __m128d b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, _mm_load_pd(&scene->sphere_ox[i])),
+                                      _mm_mul_pd(dy, _mm_load_pd(&scene->sphere_oy[i]))),
+                           _mm_mul_pd(dz, _mm_load_pd(&scene->sphere_oz[i])));
+    __m128d det = _mm_sub_pd(_mm_mul_pd(b, b), _mm_load_pd(&scene->sphere_c[i]));
+    __m128d valid = _mm_cmpge_pd(det, zero);
+
+    if (_mm_movemask_pd(valid) == 0) {
+      index = _mm_add_pd(index, step);
+      continue;
+    }
+
+    __m128d root = _mm_sqrt_pd(_mm_max_pd(det, zero));
+    __m128d nb = _mm_sub_pd(zero, b);
+    __m128d t0 = _mm_sub_pd(nb, root);
+    __m128d t1 = _mm_add_pd(nb, root);
+    __m128d use_t0 = _mm_cmpgt_pd(t0, zero);
+    __m128d t = _mm_or_pd(_mm_and_pd(use_t0, t0), _mm_andnot_pd(use_t0, t1));
+
+    __m128d closer = _mm_and_pd(valid, _mm_and_pd(_mm_cmpgt_pd(t, zero), _mm_cmplt_pd(t, closest)));
+    closest = _mm_or_pd(_mm_and_pd(closer, t), _mm_andnot_pd(closer, closest));
+    best_index = _mm_or_pd(_mm_and_pd(closer, index), _mm_andnot_pd(closer, best_index));
+    index = _mm_add_pd(index, step);
+  }
+
+  double t[2], lane_index[2];
+  _mm_storeu_pd(t, closest);
+  _mm_storeu_pd(lane_index, best_index);
+  return pick_closest(t, lane_index, 2, hit);
+}
+
+__attribute__((target("avx2")))
+double plane_intersection_avx2 (Scene* scene, double *origin, double *direction, int* hit) {
+  __m256d dx = _mm256_set1_pd(direction[0]), dy = _mm256_set1_pd(direction[1]), dz = _mm256_set1_pd(direction[2]);
+  __m256d ox = _mm256_set1_pd(origin[0]), oy = _mm256_set1_pd(origin[1]), oz = _mm256_set1_pd(origin[2]);
+  __m256d zero = _mm256_setzero_pd();
+  __m256d best_t = _mm256_set1_pd(INFINITY);
+  __m256d best_index = _mm256_set1_pd(-1);
+  __m256d index = _mm256_set_pd(3, 2, 1, 0);
+  __m256d step = _mm256_set1_pd(4);
+
+  for (int i = 0; i < scene->num_planes; i += 4) {
+    __m256d nx = _mm256_load_pd(&scene->plane_nx[i]);
+    __m256d ny = _mm256_load_pd(&scene->plane_ny[i]);
+    __m256d nz = _mm256_load_pd(&scene->plane_nz[i]);
+    __m256d a = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx, dx), _mm256_mul_pd(ny, dy)),
+                              _mm256_mul_pd(nz, dz));
+    __m256d no = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx, ox), _mm256_mul_pd(ny, oy)),
+                               _mm256_mul_pd(nz, oz));
+    __m256d t = _mm256_div_pd(_mm256_sub_pd(_mm256_load_pd(&scene->plane_d[i]), no), a);
+
+    __m256d closer = _mm256_and_pd(_mm256_cmp_pd(t, zero, _CMP_GT_OQ),
+                                   _mm256_cmp_pd(t, best_t, _CMP_LT_OQ));
+    best_t = _mm256_blendv_pd(best_t, t, closer);
+    best_index = _mm256_blendv_pd(best_index, index, closer);
+    index = _mm256_add_pd(index, step);
+  }
+
+  double t[4], lane_index[4];
+  _mm256_storeu_pd(t, best_t);
+  _mm256_storeu_pd(lane_index, best_index);
+  return pick_closest(t, lane_index, 4, hit);
+}
+
+__attribute__((target("avx2")))
+double sphere_intersection_avx2 (Scene* scene, double *origin, double *direction,
+                                 int first, int last, double best_t, int* hit) {
+  __m256d dx = _mm256_set1_pd(direction[0]), dy = _mm256_set1_pd(direction[1]), dz = _mm256_set1_pd(direction[2]);
+  __m256d ox = _mm256_set1_pd(origin[0]), oy = _mm256_set1_pd(origin[1]), oz = _mm256_set1_pd(origin[2]);
+  __m256d zero = _mm256_setzero_pd();
+  __m256d closest = _mm256_set1_pd(best_t);
+  __m256d best_index = _mm256_set1_pd(-1);
+  __m256d index = _mm256_set_pd(first + 3, first + 2, first + 1, first);
+  __m256d step = _mm256_set1_pd(4);
+
+  for (int i = first; i < last; i += 4) {
+    __m256d px = _mm256_sub_pd(ox, _mm256_load_pd(&scene->sphere_cx[i]));
+    __m256d py = _mm256_sub_pd(oy, _mm256_load_pd(&scene->sphere_cy[i]));
+    __m256d pz = _mm256_sub_pd(oz, _mm256_load_pd(&scene->sphere_cz[i]));
+    __m256d b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, px), _mm256_mul_pd(dy, py)),
+                              _mm256_mul_pd(dz, pz));
+    __m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(px, px), _mm256_mul_pd(py, py)),
+                                            _mm256_mul_pd(pz, pz)),
+                              _mm256_load_pd(&scene->sphere_r2[i]));
+    __m256d det = _mm256_sub_pd(_mm256_mul_pd(b, b), c);
+    __m256d valid = _mm256_cmp_pd(det, zero, _CMP_GE_OQ);
+
+    if (_mm256_movemask_pd(valid) == 0) {
+      index = _mm256_add_pd(index, step);
+      continue;
+    }
+
+    __m256d root = _mm256_sqrt_pd(_mm256_max_pd(det, zero));
+    __m256d nb = _mm256_sub_pd(zero, b);
+    __m256d t0 = _mm256_sub_pd(nb, root);
+    __m256d t1 = _mm256_add_pd(nb, root);
+    __m256d t = _mm256_blendv_pd(t1, t0, _mm256_cmp_pd(t0, zero, _CMP_GT_OQ));
+
+    __m256d closer = _mm256_and_pd(valid, _mm256_and_pd(_mm256_cmp_pd(t, zero, _CMP_GT_OQ),
+                                                        _mm256_cmp_pd(t, closest, _CMP_LT_OQ)));
+    closest = _mm256_blendv_pd(closest, t, closer);
+    best_index = _mm256_blendv_pd(best_index, index, closer);
+    index = _mm256_add_pd(index, step);
+  }
+
+  double t[4], lane_index[4];
+  _mm256_storeu_pd(t, closest);
+  _mm256_storeu_pd(lane_index, best_index);
+  return pick_closest(t, lane_index, 4, hit);
+}
+
+
+__attribute__((target("avx2")))
+double sphere_primary_avx2 (Scene* scene, double *direction, int first, int last,
+                            double best_t, int* hit) {
+  __m256d dx = _mm256_set1_pd(direction[0]), dy = _mm256_set1_pd(direction[1]), dz = _mm256_set1_pd(direction[2]);
+  __m256d zero = _mm256_setzero_pd();
+  __m256d closest = _mm256_set1_pd(best_t);
+  __m256d best_index = _mm256_set1_pd(-1);
+  __m256d index = _mm256_set_pd(first + 3, first + 2, first + 1, first);
+  __m256d step = _mm256_set1_pd(4);
+
+  for (int i = first; i < last; i += 4) {
+    __m256d b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, _mm256_load_pd(&scene->sphere_ox[i])),
+                                            _mm256_mul_pd(dy, _mm256_load_pd(&scene->sphere_oy[i]))),
+                              _mm256_mul_pd(dz, _mm256_load_pd(&scene->sphere_oz[i])));
+    __m256d det = _mm256_sub_pd(_mm256_mul_pd(b, b), _mm256_load_pd(&scene->sphere_c[i]));
+    __m256d valid = _mm256_cmp_pd(det, zero, _CMP_GE_OQ);
+
+    if (_mm256_movemask_pd(valid) == 0) {
+      index = _mm256_add_pd(index, step);
+      continue;
+    }
+
+    __m256d root = _mm256_sqrt_pd(_mm256_max_pd(det, zero));
+    __m256d nb = _mm256_sub_pd(zero, b);
+    __m256d t0 = _mm256_sub_pd(nb, root);
+    __m256d t1 = _mm256_add_pd(nb, root);
+    __m256d t = _mm256_blendv_pd(t1, t0, _mm256_cmp_pd(t0, zero, _CMP_GT_OQ));
+
+    __m256d closer = _mm256_and_pd(valid, _mm256_and_pd(_mm256_cmp_pd(t, zero, _CMP_GT_OQ),
+                                                        _mm256_cmp_pd(t, closest, _CMP_LT_OQ)));
+    closest = _mm256_blendv_pd(closest, t, closer);
+    best_index = _mm256_blendv_pd(best_index, index, closer);
+    index = _mm256_add_pd(index, step);
+  }
+
+  double t[4], lane_index[4];
+  _mm256_storeu_pd(t, closest);
+  _mm256_storeu_pd(lane_index, best_index);
+  return pick_closest(t, lane_index, 4, hit);
+}
+
+#endif
+
+#if defined(__aarch64__)
+
+double plane_intersection_neon (Scene* scene, double *origin, double *direction, int* hit) {
+  float64x2_t dx = vdupq_n_f64(direction[0]), dy = vdupq_n_f64(direction[1]), dz = vdupq_n_f64(direction[2]);
+  float64x2_t ox = vdupq_n_f64(origin[0]), oy = vdupq_n_f64(origin[1]), oz = vdupq_n_f64(origin[2]);
+  float64x2_t zero = vdupq_n_f64(0);
+  float64x2_t best_t = vdupq_n_f64(INFINITY);
+  float64x2_t best_index = vdupq_n_f64(-1);
+  float64x2_t index = {0, 1};
+  float64x2_t step = vdupq_n_f64(2);
+
+  for (int i = 0; i < scene->num_planes; i += 2) {
+    float64x2_t nx = vld1q_f64(&scene->plane_nx[i]);
+    float64x2_t ny = vld1q_f64(&scene->plane_ny[i]);
+    float64x2_t nz = vld1q_f64(&scene->plane_nz[i]);
+    float64x2_t a = vaddq_f64(vaddq_f64(vmulq_f64(nx, dx), vmulq_f64(ny, dy)), vmulq_f64(nz, dz));
+    float64x2_t no = vaddq_f64(vaddq_f64(vmulq_f64(nx, ox), vmulq_f64(ny, oy)), vmulq_f64(nz, oz));
+    float64x2_t t = vdivq_f64(vsubq_f64(vld1q_f64(&scene->plane_d[i]), no), a);
+
+    uint64x2_t closer = vandq_u64(vcgtq_f64(t, zero), vcltq_f64(t, best_t));
+    best_t = vbslq_f64(closer, t, best_t);
+    best_index = vbslq_f64(closer, index, best_index);
+    index = vaddq_f64(index, step);
+  }
+
+  double t[2], lane_index[2];
+  vst1q_f64(t, best_t);
+  vst1q_f64(lane_index, best_index);
+  return pick_closest(t, lane_index, 2, hit);
+}
+
+double sphere_intersection_neon (Scene* scene, double *origin, double *direction,
+                                 int first, int last, double best_t, int* hit) {
+  float64x2_t dx = vdupq_n_f64(direction[0]), dy = vdupq_n_f64(direction[1]), dz = vdupq_n_f64(direction[2]);
+  float64x2_t ox = vdupq_n_f64(origin[0]), oy = vdupq_n_f64(origin[1]), oz = vdupq_n_f64(origin[2]);
+  float64x2_t zero = vdupq_n_f64(0);
+  float64x2_t closest = vdupq_n_f64(best_t);
+  float64x2_t best_index = vdupq_n_f64(-1);
+  float64x2_t index = {first, first + 1};
+  float64x2_t step = vdupq_n_f64(2);
+
+  for (int i = first; i < last; i += 2) {
+    float64x2_t px = vsubq_f64(ox, vld1q_f64(&scene->sphere_cx[i]));
+    float64x2_t py = vsubq_f64(oy, vld1q_f64(&scene->sphere_cy[i]));
+    float64x2_t pz = vsubq_f64(oz, vld1q_f64(&scene->sphere_cz[i]));
+    float64x2_t b = vaddq_f64(vaddq_f64(vmulq_f64(dx, px), vmulq_f64(dy, py)), vmulq_f64(dz, pz));
+    float64x2_t c = vsubq_f64(vaddq_f64(vaddq_f64(vmulq_f64(px, px), vmulq_f64(py, py)),
+                                        vmulq_f64(pz, pz)),
+                              vld1q_f64(&scene->sphere_r2[i]));
+    float64x2_t det = vsubq_f64(vmulq_f64(b, b), c);
+    uint64x2_t valid = vcgeq_f64(det, zero);
+
+    if (vmaxvq_u32(vreinterpretq_u32_u64(valid)) == 0) {
+      index = vaddq_f64(index, step);
+      continue;
+    }
+
+    float64x2_t root = vsqrtq_f64(vmaxq_f64(det, zero));
+    float64x2_t nb = vnegq_f64(b);
+    float64x2_t t0 = vsubq_f64(nb, root);
+    float64x2_t t1 = vaddq_f64(nb, root);
+    float64x2_t t = vbslq_f64(vcgtq_f64(t0, zero), t0, t1);
+
+    uint64x2_t closer = vandq_u64(valid, vandq_u64(vcgtq_f64(t, zero), vcltq_f64(t, closest)));
+    closest = vbslq_f64(closer, t, closest);
+    best_index = vbslq_f64(closer, index, best_index);
+    index = vaddq_f64(index, step);
+  }
+
+  double t[2], lane_index[2];
+  vst1q_f64(t, closest);
+  vst1q_f64(lane_index, best_index);
+  return pick_closest(t, lane_index, 2, hit);
+}
+
+
+double sphere_primary_neon (Scene* scene, double *direction, int first, int last,
+                            double best_t, int* hit) {
+  float64x2_t dx = vdupq_n_f64(direction[0]), dy = vdupq_n_f64(direction[1]), dz = vdupq_n_f64(direction[2]);
+  float64x2_t zero = vdupq_n_f64(0);
+  float64x2_t closest = vdupq_n_f64(best_t);
+  float64x2_t best_index = vdupq_n_f64(-1);
+  float64x2_t index = {first, first + 1};
+  float64x2_t step = vdupq_n_f64(2);
+
+  for (int i = first; i < last; i += 2) {
+    float64x2_t b = vaddq_f64(vaddq_f64(vmulq_f64(dx, vld1q_f64(&scene->sphere_ox[i])),
+                                        vmulq_f64(dy, vld1q_f64(&scene->sphere_oy[i]))),
+                              vmulq_f64(dz, vld1q_f64(&scene->sphere_oz[i])));
+    float64x2_t det = vsubq_f64(vmulq_f64(b, b), vld1q_f64(&scene->sphere_c[i]));
+    uint64x2_t valid = vcgeq_f64(det, zero);
+
+    if (vmaxvq_u32(vreinterpretq_u32_u64(valid)) == 0) {
+      index = vaddq_f64(index, step);
+      continue;
+    }
+
+    float64x2_t root = vsqrtq_f64(vmaxq_f64(det, zero));
+    float64x2_t nb = vnegq_f64(b);
+    float64x2_t t0 = vsubq_f64(nb, root);
+    float64x2_t t1 = vaddq_f64(nb, root);
+    float64x2_t t = vbslq_f64(vcgtq_f64(t0, zero), t0, t1);
+
+    uint64x2_t closer = vandq_u64(valid, vandq_u64(vcgtq_f64(t, zero), vcltq_f64(t, closest)));
+    closest = vbslq_f64(closer, t, closest);
+    best_index = vbslq_f64(closer, index, best_index);
+    index = vaddq_f64(index, step);
+  }
+
+  double t[2], lane_index[2];
+  vst1q_f64(t, closest);
+  vst1q_f64(lane_index, best_index);
+  return pick_closest(t, lane_index, 2, hit);
+}
+
+#endif
+
+typedef double (*IntersectFunction) (Scene* scene, double *origin, double *direction, int* hit);
+typedef double (*SphereKernel) (Scene* scene, double *origin, double *direction,
+                                int first, int last, double best_t, int* hit);
+typedef double (*PrimaryKernel) (Scene* scene, double *direction, int first, int last,
+                                 double best_t, int* hit);
+
+SphereKernel sphere_kernel = sphere_intersection_scalar;
+PrimaryKernel sphere_primary_kernel = sphere_primary_scalar;
+IntersectFunction plane_intersection = plane_intersection_scalar;
+const char* kernel_name = "scalar";
+
+// select_kernels() picks the widest intersection kernels the CPU supports.
+// Setting the RAYCAST_KERNEL environment variable to "scalar", "sse2",
+// "avx2" or "neon" forces a particular one.
+
+void select_kernels (void) {
+  char* forced = getenv("RAYCAST_KERNEL");
+
+  if (forced != NULL && strcmp(forced, "scalar") == 0) {
+    return;
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && (forced == NULL || strcmp(forced, "avx2") == 0)) {
+    sphere_kernel = sphere_intersection_avx2;
+    sphere_primary_kernel = sphere_primary_avx2;
+    plane_intersection = plane_intersection_avx2;
+    kernel_name = "avx2";
+  }
+  else if (__builtin_cpu_supports("sse2") && (forced == NULL || strcmp(forced, "sse2") == 0)) {
+    sphere_kernel = sphere_intersection_sse2;
+    sphere_primary_kernel = sphere_primary_sse2;
+    plane_intersection = plane_intersection_sse2;
+    kernel_name = "sse2";
+  }
+#elif defined(__aarch64__)
+  if (forced == NULL || strcmp(forced, "neon") == 0) {
+    sphere_kernel = sphere_intersection_neon;
+    sphere_primary_kernel = sphere_primary_neon;
+    plane_intersection = plane_intersection_neon;
+    kernel_name = "neon";
+  }
+#endif
+}
+
+// hit_box() returns the distance at which a ray enters a BVH node's box, or
+// INFINITY if it misses the box or only reaches it beyond max_t.
+
+double hit_box (BVHNode* node, double* origin, double* inv_direction, double max_t) {
+  double t_near = 0;
+  double t_far = max_t;
+
+  for (int k = 0; k < 3; k++) {
+    double t0 = (node->min[k] - origin[k]) * inv_direction[k];
+    double t1 = (node->max[k] - origin[k]) * inv_direction[k];
+    if (t0 > t1) {
+      double swap = t0;
+      t0 = t1;
+      t1 = swap;
+    }
+    if (t0 > t_near) {
+      t_near = t0;
+    }
+    if (t1 < t_far) {
+      t_far = t1;
+    }
+  }
+
+  return t_near <= t_far ? t_near : INFINITY;
+}
+
+// Counters tally the work done by a render thread.  They are thread-local so
+// the traversal code can bump them without locks or extra arguments, and
+// render_worker() collects each thread's totals when it finishes.  Sphere
+// tests count every slot of each leaf tested, padding included, since that
+// is the work the kernels actually do.
+
+typedef struct {
+  long rays;
+  long shadow_rays;
+  long sphere_tests;
+  long plane_tests;
+  long nodes_visited;
+  long refined_pixels;
+  long extra_samples;
+} Counters;
+
+__thread Counters counters;
+
+// work_done() sums the tests the calling thread has done so far, the cost
+// measure of the heatmap.
+
+long work_done (void) {
+  return counters.sphere_tests + counters.plane_tests + counters.nodes_visited;
+}
+
+// closest_sphere() returns the distance to the closest sphere a ray hits, or
+// INFINITY if it misses them all, by walking the BVH front to back and
+// testing each leaf it reaches with kernel, or with primary if it is set.
+// The slot of the sphere is stored in hit.
+
+double closest_sphere (Scene* scene, double *origin, double *direction, SphereKernel kernel,
+                       PrimaryKernel primary, int* hit) {
+  double best_t = INFINITY;
+
+  if (scene->bvh == NULL) {
+    return best_t;
+  }
+
+  double inv_direction[3] = {1 / direction[0], 1 / direction[1], 1 / direction[2]};
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+
+  counters.nodes_visited += 1;
+  if (hit_box(&scene->bvh[0], origin, inv_direction, best_t) == INFINITY) {
+    return best_t;
+  }
+  stack[top++] = 0;
+
+  while (top > 0) {
+    BVHNode* node = &scene->bvh[stack[--top]];
+
+    if (node->count > 0) {
+      counters.sphere_tests += node->count;
+      if (primary != NULL) {
+        best_t = primary(scene, direction, node->first, node->first + node->count, best_t, hit);
+      }
+      else {
+        best_t = kernel(scene, origin, direction, node->first,
+                        node->first + node->count, best_t, hit);
+      }
+      continue;
+    }
+
+    // Visit the nearer child first so it can shrink best_t before the
+    // farther one is tested.
+    int left = node->first;
+    counters.nodes_visited += 2;
+    double t_left = hit_box(&scene->bvh[left], origin, inv_direction, best_t);
+    double t_right = hit_box(&scene->bvh[left + 1], origin, inv_direction, best_t);
+
+    if (t_left <= t_right) {
+      if (t_right < best_t) {
+        stack[top++] = left + 1;
+      }
+      if (t_left < best_t) {
+        stack[top++] = left;
+      }
+    }
+    else {
+      if (t_left < best_t) {
+        stack[top++] = left;
+      }
+      if (t_right < best_t) {
+        stack[top++] = left + 1;
+      }
+    }
+  }
+
+  return best_t;
+}
+
+// sphere_intersection() finds the closest sphere along any ray with a
+// normalized direction.
+
+double sphere_intersection (Scene* scene, double *origin, double *direction, int* hit) {
+  return closest_sphere(scene, origin, direction, sphere_kernel, NULL, hit);
+}
+
+// primary_intersection() finds the closest sphere along a ray from the baked
+// origin using the cheaper primary ray kernels.
+
+double primary_intersection (Scene* scene, double *direction, int* hit) {
+  return closest_sphere(scene, scene->baked_origin, direction, NULL, sphere_primary_kernel,
+                        hit);
+}
+
+// sphere_occluded() is the any-hit counterpart of sphere_intersection(),
+// used for shadow rays.  It reports whether any sphere lies on the ray
+// closer than max_t, and stops at the first leaf with such a sphere rather
+// than looking for the closest one.  The slot of the sphere is stored in
+// occluder.
+
+bool sphere_occluded (Scene* scene, double* origin, double* direction, double max_t, int* occluder) {
+  if (scene->bvh == NULL) {
+    return false;
+  }
+
+  double inv_direction[3] = {1 / direction[0], 1 / direction[1], 1 / direction[2]};
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+
+  stack[top++] = 0;
+
+  while (top > 0) {
+    BVHNode* node = &scene->bvh[stack[--top]];
+
+    counters.nodes_visited += 1;
+    if (hit_box(node, origin, inv_direction, max_t) == INFINITY) {
+      continue;
+    }
+    if (node->count > 0) {
+      counters.sphere_tests += node->count;
+      if (sphere_kernel(scene, origin, direction, node->first, node->first + node->count,
+                        max_t, occluder) < max_t) {
+        return true;
+      }
+      continue;
+    }
+
+    stack[top++] = node->first + 1;
+    stack[top++] = node->first;
+  }
+
+  return false;
+}
+
+// plane_occluded() reports whether any plane lies on the ray closer than
+// max_t.  The index of the plane is stored in occluder.
+
+bool plane_occluded (Scene* scene, double* origin, double* direction, double max_t, int* occluder) {
+  for (int i = 0; i < scene->num_planes; i++) {
+    counters.plane_tests += 1;
+    double a = scene->plane_nx[i] * direction[0] + scene->plane_ny[i] * direction[1] +
+               scene->plane_nz[i] * direction[2];
+    double d = scene->plane_d[i] - (scene->plane_nx[i] * origin[0] +
+               scene->plane_ny[i] * origin[1] + scene->plane_nz[i] * origin[2]);
+    double t = d / a;
+
+    if (t > 0 && t < max_t) {
+      *occluder = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// SphereHit is everything shading needs to know about the sphere a ray hit,
+// copied out of the scene so it stays valid once the brick holding the
+// sphere has been evicted.  id tells the spheres of a scene apart; it is the
+// sphere's slot, counted across all bricks in a streamed scene.
+
+typedef struct {
+  double t;
+  long id;
+  double center[3];
+  double r2;
+  double diffuse[3];
+  double specular[3];
+} SphereHit;
+
+// sphere_hit() copies the sphere in slot of scene into hit.
+
+void sphere_hit (Scene* scene, int slot, double t, SphereHit* hit) {
+  hit->t = t;
+  hit->id = slot;
+  hit->center[0] = scene->sphere_cx[slot];
+  hit->center[1] = scene->sphere_cy[slot];
+  hit->center[2] = scene->sphere_cz[slot];
+  hit->r2 = scene->sphere_r2[slot];
+  memcpy(hit->diffuse, &scene->sphere_color[slot * 3], sizeof(double) * 3);
+  memcpy(hit->specular, &scene->sphere_specular[slot * 3], sizeof(double) * 3);
+}
+
+// Scenes whose spheres do not fit in memory are streamed in by
+// stream_scene() and split on disk into bricks: spatially compact groups of
+// spheres small enough to load and build a BVH for within the memory
+// budget.  Each brick is stored in the brick file with its own BVH, and a
+// small top-level tree over the bricks' boxes decides which bricks a ray
+// has to visit.  Bricks are read in on demand and the least recently used
+// unpinned ones are evicted whenever the resident bricks would exceed the
+// budget.
+//
+// While streaming, each sphere is spilled as BRICK_RECORD doubles: center,
+// radius, diffuse and specular color.  Building a brick needs about
+// BRICK_BUILD_BYTES per sphere at its peak, and a loaded brick needs at
+// most BRICK_RESIDENT_BYTES per sphere.
+
+#define BRICK_RECORD 10
+#define BRICK_BUILD_BYTES 512
+#define BRICK_RESIDENT_BYTES 256
+
+typedef struct {
+  double min[3];
+  double max[3];
+  int num_spheres;
+  int slots;
+  int nodes;
+  long first_slot;
+  uint64_t offset;
+  size_t size;
+
+  // Access to these is guarded by the store's lock.
+  Scene* resident;
+  int pins;
+  uint64_t last_used;
+} Brick;
+
+typedef struct BrickStore {
+  FILE* file;
+  Arena bricks;
+  BVHNode* tree;
+  int num_threads;
+  long spheres_per_brick;
+
+  pthread_mutex_t lock;
+  size_t budget;
+  size_t resident_size;
+  size_t peak_size;
+  uint64_t clock;
+  long loads;
+} BrickStore;
+
+// brick_sections() lists the arrays of a brick in the order they are
+// stored in the brick file.
+
+void brick_sections (Scene* brick, SceneSection* sections) {
+  size_t slots = (size_t)brick->sphere_slots * sizeof(double);
+
+  sections[0] = (SceneSection){(void**)&brick->sphere_cx, slots};
+  sections[1] = (SceneSection){(void**)&brick->sphere_cy, slots};
+  sections[2] = (SceneSection){(void**)&brick->sphere_cz, slots};
+  sections[3] = (SceneSection){(void**)&brick->sphere_r2, slots};
+  sections[4] = (SceneSection){(void**)&brick->sphere_color, slots * 3};
+  sections[5] = (SceneSection){(void**)&brick->sphere_specular, slots * 3};
+  sections[6] = (SceneSection){(void**)&brick->bvh, (size_t)brick->bvh_nodes * sizeof(BVHNode)};
+}
+
+// make_brick() reads count sphere records from records, builds a BVH over
+// them and appends the result to the brick file.
+
+void make_brick (BrickStore* store, FILE* records, long count) {
+  Scene brick;
+  double record[BRICK_RECORD];
+
+  memset(&brick, 0, sizeof(brick));
+  brick.num_spheres = count;
+  brick.sphere_slots = pad_count(count);
+  brick.sphere_cx = alloc_doubles(brick.sphere_slots);
+  brick.sphere_cy = alloc_doubles(brick.sphere_slots);
+  brick.sphere_cz = alloc_doubles(brick.sphere_slots);
+  brick.sphere_r2 = alloc_doubles(brick.sphere_slots);
+  brick.sphere_color = alloc_doubles((size_t)count * 3);
+  brick.sphere_specular = alloc_doubles((size_t)count * 3);
+
+  rewind(records);
+  for (long i = 0; i < count; i++) {
+    if (fread(record, sizeof(record), 1, records) != 1) {
+      fprintf(stderr, "Error: Unable to read back spilled spheres.\n");
+      exit(1);
+    }
+    brick.sphere_cx[i] = record[0];
+    brick.sphere_cy[i] = record[1];
+    brick.sphere_cz[i] = record[2];
+    brick.sphere_r2[i] = sqr(record[3]);
+    memcpy(&brick.sphere_color[i * 3], &record[4], sizeof(double) * 3);
+    memcpy(&brick.sphere_specular[i * 3], &record[7], sizeof(double) * 3);
+  }
+
+  build_bvh(&brick, store->num_threads);
+
+  SceneSection sections[7];
+  Brick* entry = arena_push(&store->bricks);
+  memset(entry, 0, sizeof(*entry));
+  memcpy(entry->min, brick.bvh[0].min, sizeof(entry->min));
+  memcpy(entry->max, brick.bvh[0].max, sizeof(entry->max));
+  entry->num_spheres = count;
+  entry->slots = brick.sphere_slots;
+  entry->nodes = brick.bvh_nodes;
+  entry->first_slot = store->bricks.count > 1 ? entry[-1].first_slot + entry[-1].slots : 0;
+  entry->offset = ftello(store->file);
+
+  brick_sections(&brick, sections);
+  for (int i = 0; i < 7; i++) {
+    if (fwrite(*sections[i].pointer, 1, sections[i].size, store->file) != sections[i].size) {
+      fprintf(stderr, "Error: Unable to write a brick.\n");
+      exit(1);
+    }
+    entry->size += sections[i].size;
+  }
+
+  free_scene(&brick);
+}
+
+// split_bricks() turns count sphere records into bricks.  If they are too
+// many for one brick, they are split at the middle of their centers'
+// bounds along the widest axis into two new spill files, and each half is
+// split in turn.  records is closed when it is no longer needed.
+
+void split_bricks (BrickStore* store, FILE* records, long count, double* min, double* max) {
+  if (count <= store->spheres_per_brick) {
+    make_brick(store, records, count);
+    fclose(records);
+    return;
+  }
+
+  int axis = 0;
+  for (int k = 1; k < 3; k++) {
+    if (max[k] - min[k] > max[axis] - min[axis]) {
+      axis = k;
+    }
+  }
+  double split = (min[axis] + max[axis]) / 2;
+
+  // Spheres whose centers cannot be split apart, because they all share
+  // one or the middle rounds to the lowest, are split by their order.
+  bool by_order = split <= min[axis];
+
+  FILE* side[2] = {tmpfile(), tmpfile()};
+  long side_count[2] = {0, 0};
+  double side_min[2][3], side_max[2][3];
+  double record[BRICK_RECORD];
+
+  if (side[0] == NULL || side[1] == NULL) {
+    fprintf(stderr, "Error: Unable to create a temporary file for bricks.\n");
+    exit(1);
+  }
+  for (int k = 0; k < 3; k++) {
+    side_min[0][k] = side_min[1][k] = INFINITY;
+    side_max[0][k] = side_max[1][k] = -INFINITY;
+  }
+
+  rewind(records);
+  for (long i = 0; i < count; i++) {
+    if (fread(record, sizeof(record), 1, records) != 1) {
+      fprintf(stderr, "Error: Unable to read back spilled spheres.\n");
+      exit(1);
+    }
+    int s = by_order ? i >= count / 2 : record[axis] >= split;
+    if (fwrite(record, sizeof(record), 1, side[s]) != 1) {
+      fprintf(stderr, "Error: Unable to spill spheres to disk.\n");
+      exit(1);
+    }
+    side_count[s] += 1;
+    for (int k = 0; k < 3; k++) {
+      side_min[s][k] = record[k] < side_min[s][k] ? record[k] : side_min[s][k];
+      side_max[s][k] = record[k] > side_max[s][k] ? record[k] : side_max[s][k];
+    }
+  }
+  fclose(records);
+
+  split_bricks(store, side[0], side_count[0], side_min[0], side_max[0]);
+  split_bricks(store, side[1], side_count[1], side_min[1], side_max[1]);
+}
+
+int brick_sort_axis;
+
+int compare_bricks (const void* a, const void* b) {
+  const Brick* x = *(const Brick**)a;
+  const Brick* y = *(const Brick**)b;
+  double cx = x->min[brick_sort_axis] + x->max[brick_sort_axis];
+  double cy = y->min[brick_sort_axis] + y->max[brick_sort_axis];
+  return (cx > cy) - (cx < cy);
+}
+
+// build_brick_tree() builds the top-level tree over bricks[start, end) into
+// node, splitting at the median of the bricks' centers along the widest
+// axis.  Leaves hold a single brick.
+
+void build_brick_tree (BrickStore* store, Brick** bricks, int start, int end, int node,
+                       int* next_node) {
+  BVHNode* n = &store->tree[node];
+  Brick* all = store->bricks.data;
+
+  for (int k = 0; k < 3; k++) {
+    n->min[k] = INFINITY;
+    n->max[k] = -INFINITY;
+  }
+  for (int i = start; i < end; i++) {
+    grow_box(n->min, n->max, bricks[i]->min, bricks[i]->max);
+  }
+
+  if (end - start == 1) {
+    n->first = bricks[start] - all;
+    n->count = 1;
+    return;
+  }
+
+  int axis = 0;
+  for (int k = 1; k < 3; k++) {
+    if (n->max[k] - n->min[k] > n->max[axis] - n->min[axis]) {
+      axis = k;
+    }
+  }
+  brick_sort_axis = axis;
+  qsort(&bricks[start], end - start, sizeof(Brick*), compare_bricks);
+
+  int left = *next_node;
+  *next_node += 2;
+  n->first = left;
+  n->count = 0;
+
+  int mid = (start + end) / 2;
+  build_brick_tree(store, bricks, start, mid, left, next_node);
+  build_brick_tree(store, bricks, mid, end, left + 1, next_node);
+}
+
+// build_bricks() splits the count spilled sphere records into bricks that
+// fit in budget bytes, writes them to a temporary brick file, and returns
+// the store they can be paged in from.  min and max bound the spheres'
+// centers.
+
+BrickStore* build_bricks (FILE* records, long count, double* min, double* max, size_t budget,
+                          int num_threads) {
+  BrickStore* store = malloc(sizeof(BrickStore));
+
+  // A brick has to be small enough to build in the budget, and every
+  // render thread needs to be able to hold one while another is loaded.
+  long build_limit = budget / BRICK_BUILD_BYTES;
+  long resident_limit = budget / BRICK_RESIDENT_BYTES / (num_threads + 1);
+
+  store->spheres_per_brick = build_limit < resident_limit ? build_limit : resident_limit;
+  store->num_threads = num_threads;
+  store->budget = budget;
+  store->resident_size = store->peak_size = 0;
+  store->clock = 0;
+  store->loads = 0;
+  store->tree = NULL;
+  store->file = tmpfile();
+  arena_init(&store->bricks, sizeof(Brick));
+  pthread_mutex_init(&store->lock, NULL);
+
+  if (store->file == NULL) {
+    fprintf(stderr, "Error: Unable to create the brick file.\n");
+    exit(1);
+  }
+  if (store->spheres_per_brick < SIMD_PAD) {
+    fprintf(stderr, "Error: A memory budget of %zu bytes is too small for %d threads.\n",
+            budget, num_threads);
+    exit(1);
+  }
+
+  if (count == 0) {
+    fclose(records);
+    return store;
+  }
+
+  split_bricks(store, records, count, min, max);
+  fflush(store->file);
+
+  int num_bricks = store->bricks.count;
+  Brick** order = malloc(sizeof(Brick*) * num_bricks);
+  for (int i = 0; i < num_bricks; i++) {
+    order[i] = &((Brick*)store->bricks.data)[i];
+  }
+  int next_node = 1;
+  store->tree = aligned_alloc(64, sizeof(BVHNode) * 2 * num_bricks);
+  build_brick_tree(store, order, 0, num_bricks, 0, &next_node);
+  free(order);
+
+  return store;
+}
+
+// load_brick() reads a brick back from the brick file.
+
+Scene* load_brick (BrickStore* store, Brick* entry) {
+  Scene* brick = malloc(sizeof(Scene));
+  SceneSection sections[7];
+  off_t offset = entry->offset;
+
+  memset(brick, 0, sizeof(*brick));
+  brick->num_spheres = entry->num_spheres;
+  brick->sphere_slots = entry->slots;
+  brick->bvh_nodes = entry->nodes;
+
+  brick_sections(brick, sections);
+  for (int i = 0; i < 7; i++) {
+    *sections[i].pointer = alloc_doubles(sections[i].size / sizeof(double));
+    if (pread(fileno(store->file), *sections[i].pointer, sections[i].size, offset) !=
+        (ssize_t)sections[i].size) {
+      fprintf(stderr, "Error: Unable to read a brick.\n");
+      exit(1);
+    }
+    offset += sections[i].size;
+  }
+  return brick;
+}
+
+// acquire_brick() returns brick index, loading it first if it is not
+// resident, and pins it until release_brick() is called.  Bricks are loaded
+// while holding the store's lock, which keeps eviction simple at the cost
+// of serializing loads.
+
+Scene* acquire_brick (BrickStore* store, int index) {
+  Brick* bricks = store->bricks.data;
+  Brick* entry = &bricks[index];
+
+  pthread_mutex_lock(&store->lock);
+  if (entry->resident == NULL) {
+    while (store->resident_size + entry->size > store->budget) {
+      Brick* victim = NULL;
+      for (size_t i = 0; i < store->bricks.count; i++) {
+        if (bricks[i].resident != NULL && bricks[i].pins == 0 &&
+            (victim == NULL || bricks[i].last_used < victim->last_used)) {
+          victim = &bricks[i];
+        }
+      }
+      if (victim == NULL) {
+        break;
+      }
+      free_scene(victim->resident);
+      free(victim->resident);
+      victim->resident = NULL;
+      store->resident_size -= victim->size;
+    }
+
+    entry->resident = load_brick(store, entry);
+    store->resident_size += entry->size;
+    if (store->resident_size > store->peak_size) {
+      store->peak_size = store->resident_size;
+    }
+    store->loads += 1;
+  }
+  entry->pins += 1;
+  entry->last_used = ++store->clock;
+  pthread_mutex_unlock(&store->lock);
+
+  return entry->resident;
+}
+
+void release_brick (BrickStore* store, int index) {
+  pthread_mutex_lock(&store->lock);
+  ((Brick*)store->bricks.data)[index].pins -= 1;
+  pthread_mutex_unlock(&store->lock);
+}
+
+// bricks_closest() finds the closest sphere along a ray with a normalized
+// direction across all bricks, visiting them front to back through the
+// top-level tree.  It copies the sphere into hit and returns true if there
+// is one.
+
+bool bricks_closest (BrickStore* store, double* origin, double* direction, SphereHit* hit) {
+  double best_t = INFINITY;
+  bool found = false;
+
+  if (store->tree == NULL) {
+    return false;
+  }
+
+  double inv_direction[3] = {1 / direction[0], 1 / direction[1], 1 / direction[2]};
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+
+  stack[top++] = 0;
+
+  while (top > 0) {
+    BVHNode* node = &store->tree[stack[--top]];
+
+    counters.nodes_visited += 1;
+    if (hit_box(node, origin, inv_direction, best_t) == INFINITY) {
+      continue;
+    }
+
+    if (node->count > 0) {
+      Scene* brick = acquire_brick(store, node->first);
+      int slot = -1;
+      double t = closest_sphere(brick, origin, direction, sphere_kernel, NULL, &slot);
+      if (t < best_t) {
+        best_t = t;
+        sphere_hit(brick, slot, t, hit);
+        hit->id += ((Brick*)store->bricks.data)[node->first].first_slot;
+        found = true;
+      }
+      release_brick(store, node->first);
+      continue;
+    }
+
+    // Push the farther child first so the nearer one is visited first.
+    BVHNode* left = &store->tree[node->first];
+    double t_left = hit_box(left, origin, inv_direction, best_t);
+    double t_right = hit_box(left + 1, origin, inv_direction, best_t);
+    if (t_left <= t_right) {
+      stack[top++] = node->first + 1;
+      stack[top++] = node->first;
+    }
+    else {
+      stack[top++] = node->first;
+      stack[top++] = node->first + 1;
+    }
+  }
+
+  return found;
+}
+
+// bricks_occluded() reports whether any sphere in any brick lies on the
+// ray closer than max_t.
+
+bool bricks_occluded (BrickStore* store, double* origin, double* direction, double max_t) {
+  if (store->tree == NULL) {
+    return false;
+  }
+
+  double inv_direction[3] = {1 / direction[0], 1 / direction[1], 1 / direction[2]};
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+
+  stack[top++] = 0;
+
+  while (top > 0) {
+    BVHNode* node = &store->tree[stack[--top]];
+
+    counters.nodes_visited += 1;
+    if (hit_box(node, origin, inv_direction, max_t) == INFINITY) {
+      continue;
+    }
+
+    if (node->count > 0) {
+      int hit;
+      Scene* brick = acquire_brick(store, node->first);
+      bool blocked = sphere_occluded(brick, origin, direction, max_t, &hit);
+      release_brick(store, node->first);
+      if (blocked) {
+        return true;
+      }
+      continue;
+    }
+
+    stack[top++] = node->first + 1;
+    stack[top++] = node->first;
+  }
+
+  return false;
+}
+
+void free_bricks (BrickStore* store) {
+  Brick* bricks = store->bricks.data;
+
+  for (size_t i = 0; i < store->bricks.count; i++) {
+    if (bricks[i].resident != NULL) {
+      free_scene(bricks[i].resident);
+      free(bricks[i].resident);
+    }
+  }
+  pthread_mutex_destroy(&store->lock);
+  fclose(store->file);
+  free(store->bricks.data);
+  free(store->tree);
+  free(store);
+}
+
+// StreamedScene collects a scene as stream_scene() parses it: every object
+// but the spheres is kept, and the spheres are spilled to a temporary file.
+
+typedef struct {
+  Arena objects;
+  FILE* spheres;
+  long num_spheres;
+  double min[3];
+  double max[3];
+} StreamedScene;
+
+void stream_object (Object* object, void* context) {
+  StreamedScene* streamed = context;
+
+  if (object->type != SPHERE) {
+    *(Object*)arena_push(&streamed->objects) = *object;
+    return;
+  }
+
+  double record[BRICK_RECORD];
+  memcpy(&record[0], object->position, sizeof(double) * 3);
+  record[3] = object->sphere.radius;
+  memcpy(&record[4], object->sphere.diffuseGiven ? object->sphere.diffuseColor : object->color,
+         sizeof(double) * 3);
+  for (int k = 0; k < 3; k++) {
+    record[7 + k] = object->sphere.specularGiven ? object->sphere.specularColor[k] : 0;
+    streamed->min[k] = record[k] < streamed->min[k] ? record[k] : streamed->min[k];
+    streamed->max[k] = record[k] > streamed->max[k] ? record[k] : streamed->max[k];
+  }
+
+  if (fwrite(record, sizeof(record), 1, streamed->spheres) != 1) {
+    fprintf(stderr, "Error: Unable to spill spheres to disk.\n");
+    exit(1);
+  }
+  streamed->num_spheres += 1;
+}
+
+// stream_scene() parses filename through a sliding window, spilling its
+// spheres to disk as it goes so they never all have to be in memory.
+
+void stream_scene (char* filename, StreamedScene* streamed) {
+  JsonFile* json = open_json_stream(filename);
+
+  arena_init(&streamed->objects, sizeof(Object));
+  streamed->spheres = tmpfile();
+  streamed->num_spheres = 0;
+  for (int k = 0; k < 3; k++) {
+    streamed->min[k] = INFINITY;
+    streamed->max[k] = -INFINITY;
+  }
+  if (streamed->spheres == NULL) {
+    fprintf(stderr, "Error: Unable to create a temporary file for spheres.\n");
+    exit(1);
+  }
+
+  parse_scene(json, stream_object, streamed);
+  close_json(json);
+}
+
+// Shadow rays toward the same light from neighbouring pixels are usually
+// blocked by the same object, so each tile remembers the last occluder it
+// found for every light and tries it first.  A cache entry is NO_OCCLUDER,
+// a sphere slot, or PLANE_OCCLUDER(i) for plane i.
+
+#define NO_OCCLUDER -1
+#define PLANE_OCCLUDER(i) (-2 - (i))
+
+// occluded() reports whether anything blocks the shadow ray from origin
+// along direction before max_t, checking the cached occluder first.
+
+bool occluded (Scene* scene, double* origin, double* direction, double max_t, int* cache) {
+  int hit;
+
+  counters.shadow_rays += 1;
+  if (*cache >= 0) {
+    counters.sphere_tests += 1;
+    if (sphere_intersection_scalar(scene, origin, direction, *cache, *cache + 1, max_t, &hit) < max_t) {
+      return true;
+    }
+  }
+  else if (*cache != NO_OCCLUDER) {
+    int plane = -2 - *cache;
+    counters.plane_tests += 1;
+    double a = scene->plane_nx[plane] * direction[0] + scene->plane_ny[plane] * direction[1] +
+               scene->plane_nz[plane] * direction[2];
+    double d = scene->plane_d[plane] - (scene->plane_nx[plane] * origin[0] +
+               scene->plane_ny[plane] * origin[1] + scene->plane_nz[plane] * origin[2]);
+    double t = d / a;
+    if (t > 0 && t < max_t) {
+      return true;
+    }
+  }
+
+  // Sphere slots are only meaningful within a brick, so streamed scenes
+  // cache plane occluders only.
+  if (scene->bricks != NULL) {
+    if (bricks_occluded(scene->bricks, origin, direction, max_t)) {
+      return true;
+    }
+  }
+  else if (sphere_occluded(scene, origin, direction, max_t, &hit)) {
+    *cache = hit;
+    return true;
+  }
+  if (plane_occluded(scene, origin, direction, max_t, &hit)) {
+    *cache = PLANE_OCCLUDER(hit);
+    return true;
+  }
+  return false;
+}
+
+// A GBuffer keeps the closest sphere each pixel's primary ray hits: its slot,
+// or -1 for none, and the distance to it.  Finding those is most of the work
+// of a render, and they only depend on the spheres, the camera and the image
+// size, so when only colors or lights change between renders they can be
+// read back instead of traced again.  Planes are not in the BVH and cost a
+// few tests per ray, so they are still intersected as usual.  The hits are
+// either being recorded or, if valid, replayed.
+//
+// The shadow tests of each pixel's primary ray are kept the same way, one
+// bit per light, and replayed if shadows_valid.  They also depend on the
+// planes and on where the lights are, but not on their colors or falloff,
+// so recoloring objects or lights skips the shadow rays too.
+
+typedef struct {
+  uint64_t key;
+  bool valid;
+  int32_t* sphere;
+  double* t;
+
+  uint64_t shadow_key;
+  bool shadows_valid;
+  uint64_t* shadows;
+
+  void* mapping;
+  size_t mapping_size;
+} GBuffer;
+
+// The image is split into square tiles of TILE_SIZE pixels on a side.  Tiles
+// are the unit of work handed to the render workers.
+
+#define TILE_SIZE 16
+
+// Progressive renders start with one pixel in every PROGRESSIVE_STRIDE on
+// each axis and halve the stride each pass.  It has to divide TILE_SIZE.
+
+#define PROGRESSIVE_STRIDE 8
+
+typedef struct RenderJob {
+  Scene* scene;
+  int width;
+  int height;
+  int tiles_x;
+  int tiles_y;
+  bool packets;
+  uint8_t* framebuffer;
+
+  // Only tiles [first_tile, first_tile + tile_count) are rendered, or all
+  // of them if tile_count is 0.  Tiles are numbered in row-major order.
+  int first_tile;
+  int tile_count;
+
+  // The number of tests spent on each pixel, or NULL when no heatmap was
+  // asked for, and the work of all threads once the render is done.
+  float* cost;
+  Counters counters;
+
+  // The primary hits, if they are being recorded or replayed.
+  GBuffer* gbuffer;
+
+  // Adaptive anti-aliasing is on when aa_samples is more than 1.  The first
+  // pass renders one sample per pixel and keeps its clamped colors and the
+  // ids of the objects hit; the second refines the pixels on edges.
+  int pass;
+  int aa_samples;
+  double aa_threshold;
+  float* base_color;
+  long* object;
+
+  // A progressive render traces the pixels whose coordinates are multiples
+  // of stride, skipping those done at done_stride by the pass before, and
+  // fills the block of stride pixels on a side below and right of each.
+  // preview is called with preview_context after every pass but the last.
+  bool progressive;
+  int stride;
+  int done_stride;
+  void (*preview) (struct RenderJob* job, void* context);
+  void* preview_context;
+
+  // If finished is set, it is called with finished_context for every tile
+  // once its pixels are final, on the thread that rendered it.
+  void (*finished) (struct RenderJob* job, int tile, void* context);
+  void* finished_context;
+
+  // With --numa-replicate, a copy of the scene for each NUMA node, which the
+  // workers on that node read instead of scene.
+  Scene* replicas;
+} RenderJob;
+
+// Each worker owns a deque of tile indices.  The owner takes tiles from the
+// front of its deque; idle workers steal from the back of someone else's.
+// Tiles are large enough that a mutex per deque is not a bottleneck.
+
+typedef struct {
+  int* tiles;
+  int head;
+  int tail;
+  pthread_mutex_t lock;
+} TileDeque;
+
+typedef struct Worker {
+  RenderJob* job;
+  int id;
+  int num_workers;
+  struct Worker* workers;
+  TileDeque deque;
+  unsigned int rng;
+  int tiles_rendered;
+  int tiles_stolen;
+  double busy_time;
+  double finish_time;
+  Counters counters;
+  pthread_t thread;
+
+  // With --numa, the CPU the worker is pinned to, or else -1, and on the
+  // first pass of a render the barrier it waits at once it has touched the
+  // framebuffer of its own tiles.
+  int cpu;
+  pthread_barrier_t* touched;
+} Worker;
+
+// Specular highlights use a fixed Phong exponent.  Shadow rays start this
+// far off the surface along its normal so they do not hit it again.
+
+#define SHININESS 20
+#define SHADOW_EPSILON 1e-6
+
+double dot (double* a, double* b) {
+  return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+// While the G-buffer's shadows are recorded or replayed, shade() reads the
+// shadow tests of the ray being shaded from the calling thread's
+// shadow_record, or writes them into it: bit i of mask is set if light i is
+// blocked.  Only the first GBUFFER_MAX_LIGHTS lights fit; the shadow rays
+// of any others are always traced.
+
+#define GBUFFER_MAX_LIGHTS 64
+
+typedef struct {
+  uint64_t mask;
+  bool replay;
+} ShadowRecord;
+
+__thread ShadowRecord* shadow_record;
+
+// shade() computes the Phong illumination at point on a surface with the
+// given normal, seen along direction.  Lights blocked by other objects
+// contribute nothing.  occluders holds the per-light occluder cache.
+
+void shade (Scene* scene, double* point, double* normal, double* direction,
+            double* diffuse, double* specular, int* occluders, double* color) {
+  color[0] = color[1] = color[2] = 0;
+
+  for (int i = 0; i < scene->num_lights; i++) {
+    Light* light = &scene->lights[i];
+    double to_light[3];
+
+    for (int k = 0; k < 3; k++) {
+      to_light[k] = light->position[k] - point[k];
+    }
+    double distance = sqrt(dot(to_light, to_light));
+    for (int k = 0; k < 3; k++) {
+      to_light[k] /= distance;
+    }
+
+    double n_dot_l = dot(normal, to_light);
+    if (n_dot_l <= 0) {
+      continue;
+    }
+
+    double f_ang = 1;
+    if (light->spot) {
+      double cos_alpha = -dot(light->direction, to_light);
+      if (cos_alpha < light->cos_theta) {
+        continue;
+      }
+      f_ang = pow(cos_alpha, light->angular_a0);
+    }
+
+    bool blocked;
+    if (shadow_record != NULL && shadow_record->replay && i < GBUFFER_MAX_LIGHTS) {
+      blocked = shadow_record->mask >> i & 1;
+    }
+    else {
+      double shadow_origin[3];
+      for (int k = 0; k < 3; k++) {
+        shadow_origin[k] = point[k] + normal[k] * SHADOW_EPSILON;
+      }
+      blocked = occluded(scene, shadow_origin, to_light, distance, &occluders[i]);
+      if (shadow_record != NULL && blocked && i < GBUFFER_MAX_LIGHTS) {
+        shadow_record->mask |= 1ull << i;
+      }
+    }
+    if (blocked) {
+      continue;
+    }
+
+    double f_rad = 1 / (light->radial[2] * sqr(distance) + light->radial[1] * distance +
+                        light->radial[0]);
+
+    // The reflection of the light about the normal, compared against the
+    // direction back toward the viewer.
+    double reflected[3];
+    for (int k = 0; k < 3; k++) {
+      reflected[k] = 2 * n_dot_l * normal[k] - to_light[k];
+    }
+    double r_dot_v = -dot(reflected, direction);
+    double highlight = r_dot_v > 0 ? pow(r_dot_v, SHININESS) : 0;
+
+    for (int k = 0; k < 3; k++) {
+      color[k] += f_rad * f_ang * light->color[k] *
+                  (diffuse[k] * n_dot_l + specular[k] * highlight);
+    }
+  }
+}
+
+// Primary rays report which object they hit, for finding silhouettes: a
+// sphere's id, PLANE_ID(i) for plane i, or NO_OBJECT.
+
+#define NO_OBJECT -1
+#define PLANE_ID(i) (-2 - (long)(i))
+
+// shade_hit() finishes a primary ray along the normalized direction whose
+// closest sphere, if it hit one, has already been found.  It tests the
+// planes and stores the color and the id of the closest object.  Rays that
+// hit nothing are black.  Scenes without lights are drawn with flat colors.
+
+void shade_hit (Scene* scene, double* direction, SphereHit* hit, int* occluders, double* color,
+                long* object) {
+  double* origin = scene->baked_origin;
+  int plane = -1;
+  double plane_t = plane_primary(scene, direction, &plane);
+
+  counters.rays += 1;
+  counters.plane_tests += scene->num_planes;
+  double* diffuse;
+  double* specular;
+  double normal[3];
+  double t;
+
+  if (hit == NULL && plane < 0) {
+    color[0] = color[1] = color[2] = 0;
+    *object = NO_OBJECT;
+    return;
+  }
+
+  if (plane < 0 || (hit != NULL && hit->t <= plane_t)) {
+    diffuse = hit->diffuse;
+    specular = hit->specular;
+    t = hit->t;
+    *object = hit->id;
+  }
+  else {
+    diffuse = &scene->plane_color[plane * 3];
+    specular = &scene->plane_specular[plane * 3];
+    t = plane_t;
+    hit = NULL;
+    *object = PLANE_ID(plane);
+  }
+
+  if (scene->num_lights == 0) {
+    color[0] = diffuse[0];
+    color[1] = diffuse[1];
+    color[2] = diffuse[2];
+    return;
+  }
+
+  double point[3];
+  for (int k = 0; k < 3; k++) {
+    point[k] = origin[k] + t * direction[k];
+  }
+
+  if (hit != NULL) {
+    double r = sqrt(hit->r2);
+    normal[0] = (point[0] - hit->center[0]) / r;
+    normal[1] = (point[1] - hit->center[1]) / r;
+    normal[2] = (point[2] - hit->center[2]) / r;
+  }
+  else {
+    normal[0] = scene->plane_nx[plane];
+    normal[1] = scene->plane_ny[plane];
+    normal[2] = scene->plane_nz[plane];
+  }
+
+  // Light the side of the surface the ray arrived on.
+  if (dot(normal, direction) > 0) {
+    normal[0] = -normal[0];
+    normal[1] = -normal[1];
+    normal[2] = -normal[2];
+  }
+
+  shade(scene, point, normal, direction, diffuse, specular, occluders, color);
+}
+
+// shade_ray() is shade_hit() for a sphere given by its slot in the scene,
+// or -1 for none.
+
+void shade_ray (Scene* scene, double* direction, int sphere, double sphere_t, int* occluders,
+                double* color, long* object) {
+  SphereHit hit;
+
+  if (sphere < 0) {
+    shade_hit(scene, direction, NULL, occluders, color, object);
+    return;
+  }
+  sphere_hit(scene, sphere, sphere_t, &hit);
+  shade_hit(scene, direction, &hit, occluders, color, object);
+}
+
+// shoot_bricks() casts a single primary ray through a streamed scene.
+
+void shoot_bricks (Scene* scene, double* direction, int* occluders, double* color,
+                   long* object) {
+  SphereHit hit;
+  bool found = bricks_closest(scene->bricks, scene->baked_origin, direction, &hit);
+
+  shade_hit(scene, direction, found ? &hit : NULL, occluders, color, object);
+}
+
+// shoot() casts a single primary ray from the baked camera origin along the
+// normalized direction and stores the color it sees and the object it hit.
+
+void shoot (Scene* scene, double* direction, int* occluders, double* color, long* object) {
+  int sphere = -1;
+  double sphere_t = primary_intersection(scene, direction, &sphere);
+
+  shade_ray(scene, direction, sphere, sphere_t, occluders, color, object);
+}
+
+// Primary rays are traced in square packets of PACKET_SIZE x PACKET_SIZE
+// pixels.  The rays of a packet share an origin and point in nearly the same
+// direction, so they walk the BVH together: a node is skipped for the whole
+// packet at once if interval arithmetic over the packet's directions shows
+// that no ray in it can reach the node's box.
+
+#define PACKET_SIZE 4
+#define PACKET_RAYS (PACKET_SIZE * PACKET_SIZE)
+
+typedef struct {
+  int count;
+  double direction[PACKET_RAYS][3];
+  double t[PACKET_RAYS];
+  int sphere[PACKET_RAYS];
+
+  // The range of 1/direction over the packet on each axis, valid only for
+  // the axes where every ray's direction has the same sign.
+  double inv_min[3];
+  double inv_max[3];
+  bool coherent[3];
+  double mean[3];
+} RayPacket;
+
+// packet_hits_box() returns false only if no ray of the packet can enter
+// the node's box in front of the origin and before max_t.
+
+bool packet_hits_box (BVHNode* node, double* origin, RayPacket* packet, double max_t) {
+  double t_near = 0;
+  double t_far = max_t;
+
+  for (int k = 0; k < 3; k++) {
+    if (!packet->coherent[k]) {
+      continue;
+    }
+
+    bool positive = packet->inv_min[k] > 0;
+    double near = (positive ? node->min[k] : node->max[k]) - origin[k];
+    double far = (positive ? node->max[k] : node->min[k]) - origin[k];
+
+    // The entry and exit distances are linear in 1/direction, so their
+    // extremes over the packet are at the ends of its range.
+    double t0a = near * packet->inv_min[k], t0b = near * packet->inv_max[k];
+    double t1a = far * packet->inv_min[k], t1b = far * packet->inv_max[k];
+    double t0 = t0a < t0b ? t0a : t0b;
+    double t1 = t1a > t1b ? t1a : t1b;
+
+    if (t0 > t_near) {
+      t_near = t0;
+    }
+    if (t1 < t_far) {
+      t_far = t1;
+    }
+  }
+
+  return t_near <= t_far;
+}
+
+// packet_intersection() finds the closest sphere for every ray of a packet
+// from the baked origin.
+
+void packet_intersection (Scene* scene, RayPacket* packet) {
+  double* origin = scene->baked_origin;
+
+  for (int r = 0; r < packet->count; r++) {
+    packet->t[r] = INFINITY;
+    packet->sphere[r] = -1;
+  }
+  if (scene->bvh == NULL) {
+    return;
+  }
+
+  for (int k = 0; k < 3; k++) {
+    double lo = INFINITY, hi = -INFINITY;
+    int positive = 0, negative = 0;
+
+    packet->mean[k] = 0;
+    for (int r = 0; r < packet->count; r++) {
+      double d = packet->direction[r][k];
+      double inv = 1 / d;
+      positive += d > 0;
+      negative += d < 0;
+      lo = inv < lo ? inv : lo;
+      hi = inv > hi ? inv : hi;
+      packet->mean[k] += d;
+    }
+    packet->coherent[k] = positive == packet->count || negative == packet->count;
+    packet->inv_min[k] = lo;
+    packet->inv_max[k] = hi;
+  }
+
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+  double max_t = INFINITY;
+
+  stack[top++] = 0;
+
+  while (top > 0) {
+    BVHNode* node = &scene->bvh[stack[--top]];
+
+    counters.nodes_visited += 1;
+    if (!packet_hits_box(node, origin, packet, max_t)) {
+      continue;
+    }
+
+    if (node->count > 0) {
+      counters.sphere_tests += (long)node->count * packet->count;
+      max_t = 0;
+      for (int r = 0; r < packet->count; r++) {
+        packet->t[r] = sphere_primary_kernel(scene, packet->direction[r], node->first,
+                                             node->first + node->count, packet->t[r],
+                                             &packet->sphere[r]);
+        if (packet->t[r] > max_t) {
+          max_t = packet->t[r];
+        }
+      }
+      continue;
+    }
+
+    // Push the farther child first, judging by the packet's mean direction.
+    BVHNode* left = &scene->bvh[node->first];
+    BVHNode* right = left + 1;
+    double left_distance = 0, right_distance = 0;
+    for (int k = 0; k < 3; k++) {
+      left_distance += (left->min[k] + left->max[k] - 2 * origin[k]) * packet->mean[k];
+      right_distance += (right->min[k] + right->max[k] - 2 * origin[k]) * packet->mean[k];
+    }
+
+    if (left_distance <= right_distance) {
+      stack[top++] = node->first + 1;
+      stack[top++] = node->first;
+    }
+    else {
+      stack[top++] = node->first;
+      stack[top++] = node->first + 1;
+    }
+  }
+}
+
+// clamp_color() converts a color channel in the range [0, 1] to a byte.
+
+int clamp_color (double v) {
+  if (v < 0) {
+    return 0;
+  }
+  if (v > 1) {
+    return 255;
+  }
+  return (int)(v * 255);
+}
+
+// trace_packet() finds and shades what every ray of packet hits, storing
+// the colors and the ids of the objects hit.  If cost is not NULL the work
+// spent on each ray is stored in it too; the BVH walk of a packet is shared
+// by its rays, so each is charged an equal part of it.  Without a heatmap
+// the work is not sampled per ray at all.  If shadows is not NULL each
+// ray's shadow tests are replayed from it or recorded into it, as the job's
+// G-buffer says.
+
+void trace_packet (RenderJob* job, RayPacket* packet, int* occluders, double (*color)[3],
+                   long* object, float* cost, uint64_t* shadows) {
+  Scene* scene = job->scene;
+  long packet_start = cost != NULL ? work_done() : 0;
+
+  // Streamed scenes trace each ray on its own below, and when the first
+  // pass replays a G-buffer render_tile() has filled in the closest spheres.
+  bool replayed = job->pass == 0 && job->gbuffer != NULL && job->gbuffer->valid;
+  if (scene->bricks == NULL && !replayed) {
+    if (job->packets) {
+      packet_intersection(scene, packet);
+    }
+    else {
+      for (int r = 0; r < packet->count; r++) {
+        packet->sphere[r] = -1;
+        packet->t[r] = primary_intersection(scene, packet->direction[r], &packet->sphere[r]);
+      }
+    }
+  }
+
+  float packet_cost = cost != NULL ? (float)(work_done() - packet_start) / packet->count : 0;
+
+  for (int r = 0; r < packet->count; r++) {
+    long ray_start = cost != NULL ? work_done() : 0;
+    ShadowRecord record;
+    if (shadows != NULL) {
+      record.replay = job->gbuffer->shadows_valid;
+      record.mask = record.replay ? shadows[r] : 0;
+      shadow_record = &record;
+    }
+    if (scene->bricks != NULL) {
+      shoot_bricks(scene, packet->direction[r], occluders, color[r], &object[r]);
+    }
+    else {
+      shade_ray(scene, packet->direction[r], packet->sphere[r], packet->t[r], occluders,
+                color[r], &object[r]);
+    }
+    if (shadows != NULL) {
+      shadows[r] = record.mask;
+      shadow_record = NULL;
+    }
+    if (cost != NULL) {
+      cost[r] = packet_cost + (work_done() - ray_start);
+    }
+  }
+}
+
+// pixel_direction() stores the normalized direction of the ray through the
+// point (u, v) within pixel (x, y), where (0.5, 0.5) is the pixel's center.
+
+void pixel_direction (RenderJob* job, int x, int y, double u, double v, double* direction) {
+  Scene* scene = job->scene;
+
+  direction[0] = -scene->view_width / 2 + scene->view_width / job->width * (x + u);
+  direction[1] = scene->view_height / 2 - scene->view_height / job->height * (y + v);
+  direction[2] = 1;
+  normalize(direction);
+}
+
+double clamp_unit (double v) {
+  return v < 0 ? 0 : (v > 1 ? 1 : v);
+}
+
+// A tile keeps one occluder cache entry per light.  For up to
+// STACK_OCCLUDERS lights they live on the stack; scenes with more lights get
+// them from the heap.
+
+#define STACK_OCCLUDERS 64
+
+// start_occluders() returns an empty occluder cache for the lights of scene,
+// in local if it fits.  The cache is given back with end_occluders().
+
+int* start_occluders (Scene* scene, int* local) {
+  int* occluders = local;
+
+  if (scene->num_lights + 1 > STACK_OCCLUDERS) {
+    occluders = malloc(sizeof(int) * (scene->num_lights + 1));
+    if (occluders == NULL) {
+      fprintf(stderr, "Error: Out of memory for the shadow caches of %d lights.\n",
+              scene->num_lights);
+      exit(1);
+    }
+  }
+  for (int i = 0; i < scene->num_lights; i++) {
+    occluders[i] = NO_OCCLUDER;
+  }
+  return occluders;
+}
+
+void end_occluders (int* occluders, int* local) {
+  if (occluders != local) {
+    free(occluders);
+  }
+}
+
+// render_tile() casts one ray through the center of every pixel in a tile
+// and writes the results into the shared framebuffer.  Tiles never overlap,
+// so workers do not need to synchronize their writes.  With anti-aliasing
+// on, the colors and object ids are also kept for refine_tile().  In a
+// progressive pass only the pixels on the pass's stride are traced.  With a
+// G-buffer the closest spheres are recorded into it or replayed from it.
+
+void render_tile (RenderJob* job, int tile) {
+  int x0 = (tile % job->tiles_x) * TILE_SIZE;
+  int y0 = (tile / job->tiles_x) * TILE_SIZE;
+  int x1 = x0 + TILE_SIZE < job->width ? x0 + TILE_SIZE : job->width;
+  int y1 = y0 + TILE_SIZE < job->height ? y0 + TILE_SIZE : job->height;
+
+  Scene* scene = job->scene;
+  int local_occluders[STACK_OCCLUDERS];
+  int* occluders = start_occluders(scene, local_occluders);
+
+  int stride = job->stride;
+  int done = job->done_stride;
+  int step = PACKET_SIZE * stride;
+  GBuffer* gbuffer = job->gbuffer;
+
+  for (int py = y0; py < y1; py += step) {
+    for (int px = x0; px < x1; px += step) {
+      RayPacket packet;
+      double color[PACKET_RAYS][3];
+      long object[PACKET_RAYS];
+      float cost[PACKET_RAYS];
+      int pixel_x[PACKET_RAYS], pixel_y[PACKET_RAYS];
+      uint64_t shadows[PACKET_RAYS];
+
+      packet.count = 0;
+      for (int y = py; y < py + step && y < y1; y += stride) {
+        for (int x = px; x < px + step && x < x1; x += stride) {
+          if (done > 0 && x % done == 0 && y % done == 0) {
+            continue;
+          }
+          pixel_x[packet.count] = x;
+          pixel_y[packet.count] = y;
+          if (gbuffer != NULL) {
+            size_t index = (size_t)y * job->width + x;
+            if (gbuffer->valid) {
+              packet.sphere[packet.count] = gbuffer->sphere[index];
+              packet.t[packet.count] = gbuffer->t[index];
+            }
+            if (gbuffer->shadows_valid) {
+              shadows[packet.count] = gbuffer->shadows[index];
+            }
+          }
+          pixel_direction(job, x, y, 0.5, 0.5, packet.direction[packet.count++]);
+        }
+      }
+      if (packet.count == 0) {
+        continue;
+      }
+
+      trace_packet(job, &packet, occluders, color, object, job->cost != NULL ? cost : NULL,
+                   gbuffer != NULL && gbuffer->shadows != NULL ? shadows : NULL);
+
+      for (int r = 0; r < packet.count; r++) {
+        int x = pixel_x[r], y = pixel_y[r];
+        size_t index = (size_t)y * job->width + x;
+
+        if (gbuffer != NULL && !gbuffer->valid) {
+          gbuffer->sphere[index] = packet.sphere[r];
+          gbuffer->t[index] = packet.t[r];
+        }
+        if (gbuffer != NULL && gbuffer->shadows != NULL && !gbuffer->shadows_valid) {
+          gbuffer->shadows[index] = shadows[r];
+        }
+
+        if (job->cost != NULL) {
+          job->cost[index] = cost[r];
+        }
+        if (job->aa_samples > 1) {
+          for (int k = 0; k < 3; k++) {
+            job->base_color[index * 3 + k] = clamp_unit(color[r][k]);
+          }
+          job->object[index] = object[r];
+        }
+
+        uint8_t* pixel = &job->framebuffer[index * 3];
+        pixel[0] = clamp_color(color[r][0]);
+        pixel[1] = clamp_color(color[r][1]);
+        pixel[2] = clamp_color(color[r][2]);
+
+        // Stand in for the pixels later passes will fill in.
+        for (int fy = y; fy < y + stride && fy < job->height; fy++) {
+          for (int fx = x; fx < x + stride && fx < job->width; fx++) {
+            memcpy(&job->framebuffer[((size_t)fy * job->width + fx) * 3], pixel, 3);
+          }
+        }
+      }
+    }
+  }
+  end_occluders(occluders, local_occluders);
+}
+
+// sample_offset() returns where in pixel (x, y) its i-th extra sample goes.
+// The samples follow the R2 low-discrepancy sequence, shifted by a hash of
+// the pixel so neighbouring pixels do not share a pattern.  The pattern only
+// depends on the pixel, so images do not change with the thread count.
+
+void sample_offset (int x, int y, int i, double* u, double* v) {
+  uint32_t h = (uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u;
+  h ^= h >> 13;
+  h *= 0x5bd1e995u;
+  h ^= h >> 15;
+
+  double shift_u = (h & 0xffff) / 65536.0;
+  double shift_v = (h >> 16) / 65536.0;
+  *u = fmod(shift_u + i * 0.7548776662466927, 1);
+  *v = fmod(shift_v + i * 0.5698402909980532, 1);
+}
+
+// needs_samples() reports whether a pixel differs from one of its four
+// neighbours by more than the threshold in any color channel or hit a
+// different object, judging by the first pass.
+
+bool needs_samples (RenderJob* job, int x, int y) {
+  static const int dx[4] = {-1, 1, 0, 0};
+  static const int dy[4] = {0, 0, -1, 1};
+  size_t index = (size_t)y * job->width + x;
+
+  for (int i = 0; i < 4; i++) {
+    int nx = x + dx[i], ny = y + dy[i];
+    if (nx < 0 || ny < 0 || nx >= job->width || ny >= job->height) {
+      continue;
+    }
+    size_t neighbour = (size_t)ny * job->width + nx;
+    if (job->object[neighbour] != job->object[index]) {
+      return true;
+    }
+    for (int k = 0; k < 3; k++) {
+      if (fabs(job->base_color[neighbour * 3 + k] - job->base_color[index * 3 + k]) >
+          job->aa_threshold) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// AA_BATCH samples are added to a pixel at a time.  A pixel stops getting
+// more once a batch agrees with what it has so far, or once it has
+// aa_samples samples.
+
+#define AA_BATCH 4
+
+// refine_tile() is the second pass of adaptive anti-aliasing.  It adds
+// samples to the pixels of a tile that lie on an edge found by the first
+// pass, and writes their averaged colors into the framebuffer.
+
+void refine_tile (RenderJob* job, int tile) {
+  int x0 = (tile % job->tiles_x) * TILE_SIZE;
+  int y0 = (tile / job->tiles_x) * TILE_SIZE;
+  int x1 = x0 + TILE_SIZE < job->width ? x0 + TILE_SIZE : job->width;
+  int y1 = y0 + TILE_SIZE < job->height ? y0 + TILE_SIZE : job->height;
+
+  Scene* scene = job->scene;
+  int local_occluders[STACK_OCCLUDERS];
+  int* occluders = start_occluders(scene, local_occluders);
+
+  for (int y = y0; y < y1; y++) {
+    for (int x = x0; x < x1; x++) {
+      if (!needs_samples(job, x, y)) {
+        continue;
+      }
+
+      size_t index = (size_t)y * job->width + x;
+      double sum[3], low[3], high[3];
+      int samples = 1;
+
+      for (int k = 0; k < 3; k++) {
+        sum[k] = low[k] = high[k] = job->base_color[index * 3 + k];
+      }
+
+      while (samples < job->aa_samples) {
+        RayPacket packet;
+        double color[AA_BATCH][3];
+        long object[AA_BATCH];
+        float cost[AA_BATCH];
+        bool varied = false;
+
+        packet.count = job->aa_samples - samples < AA_BATCH ? job->aa_samples - samples : AA_BATCH;
+        for (int r = 0; r < packet.count; r++) {
+          double u, v;
+          sample_offset(x, y, samples + r, &u, &v);
+          pixel_direction(job, x, y, u, v, packet.direction[r]);
+        }
+
+        trace_packet(job, &packet, occluders, color, object, job->cost != NULL ? cost : NULL,
+                     NULL);
+
+        for (int r = 0; r < packet.count; r++) {
+          varied |= object[r] != job->object[index];
+          for (int k = 0; k < 3; k++) {
+            double c = clamp_unit(color[r][k]);
+            sum[k] += c;
+            low[k] = c < low[k] ? c : low[k];
+            high[k] = c > high[k] ? c : high[k];
+          }
+          if (job->cost != NULL) {
+            job->cost[index] += cost[r];
+          }
+        }
+        samples += packet.count;
+
+        for (int k = 0; k < 3; k++) {
+          varied |= high[k] - low[k] > job->aa_threshold;
+        }
+        if (!varied) {
+          break;
+        }
+      }
+
+      uint8_t* pixel = &job->framebuffer[index * 3];
+      pixel[0] = clamp_color(sum[0] / samples);
+      pixel[1] = clamp_color(sum[1] / samples);
+      pixel[2] = clamp_color(sum[2] / samples);
+      counters.refined_pixels += 1;
+      counters.extra_samples += samples - 1;
+    }
+  }
+  end_occluders(occluders, local_occluders);
+}
+
+// now_seconds() returns a monotonic timestamp in seconds.
+
+double now_seconds (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// take_tile() pops a tile from the front of the worker's own deque.  It
+// returns -1 if the deque is empty.
+
+int take_tile (TileDeque* deque) {
+  int tile = -1;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->head < deque->tail) {
+    tile = deque->tiles[deque->head++];
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return tile;
+}
+
+// steal_tile() takes a tile from the back of another worker's deque, the end
+// farthest from where its owner is working.
+
+int steal_tile (TileDeque* deque) {
+  int tile = -1;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->head < deque->tail) {
+    tile = deque->tiles[--deque->tail];
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return tile;
+}
+
+// find_work() looks for a tile to steal, starting from a random victim.  No
+// new tiles are ever added once rendering starts, so if every deque is empty
+// the render is finished.
+
+int find_work (Worker* worker) {
+  worker->rng = worker->rng * 1103515245 + 12345;
+  int start = (worker->rng >> 16) % worker->num_workers;
+
+  for (int i = 0; i < worker->num_workers; i++) {
+    int victim = (start + i) % worker->num_workers;
+    if (victim == worker->id) {
+      continue;
+    }
+    int tile = steal_tile(&worker->workers[victim].deque);
+    if (tile >= 0) {
+      worker->tiles_stolen += 1;
+      return tile;
+    }
+  }
+  return -1;
+}
+
+// With --numa the render workers are pinned to CPUs, spread evenly over the
+// NUMA nodes, and the workers on each node get neighbouring ranges of tiles.
+// Memory is placed by first touch, on the node of the thread that first
+// writes a page, so before the first pass of a render every worker writes
+// the framebuffer of its own tiles, and a scene replicated with
+// --numa-replicate is copied by a thread on each node.  The nodes and their
+// CPUs are read from sysfs, keeping only CPUs the process may run on; if
+// sysfs has no NUMA information every CPU is taken to be on one node.
+// NumaLayout lists the CPUs grouped by node: node n has node_count[n] CPUs
+// from cpus[node_first[n]] on.
+
+typedef struct {
+  int num_nodes;
+  int num_cpus;
+  int cpus[CPU_SETSIZE];
+  int node_first[CPU_SETSIZE];
+  int node_count[CPU_SETSIZE];
+} NumaLayout;
+
+NumaLayout* numa;
+
+// read_cpu_list() reads a sysfs list of CPUs or nodes like "0-3,8-11" into
+// set.  It returns false if the file cannot be read.
+
+bool read_cpu_list (char* path, cpu_set_t* set) {
+  char text[4096];
+  FILE* file = fopen(path, "r");
+
+  CPU_ZERO(set);
+  if (file == NULL) {
+    return false;
+  }
+  bool read = fgets(text, sizeof(text), file) != NULL;
+  fclose(file);
+
+  char* p = text;
+  while (read && isdigit((unsigned char)*p)) {
+    long first = strtol(p, &p, 10);
+    long last = first;
+    if (*p == '-') {
+      last = strtol(p + 1, &p, 10);
+    }
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, set);
+    }
+    if (*p != ',') {
+      break;
+    }
+    p += 1;
+  }
+  return read;
+}
+
+// add_numa_node() adds a node with the CPUs in set to the layout, unless
+// the set is empty.
+
+void add_numa_node (cpu_set_t* set) {
+  int first = numa->num_cpus;
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, set)) {
+      numa->cpus[numa->num_cpus++] = cpu;
+    }
+  }
+  if (numa->num_cpus > first) {
+    numa->node_first[numa->num_nodes] = first;
+    numa->node_count[numa->num_nodes] = numa->num_cpus - first;
+    numa->num_nodes += 1;
+  }
+}
+
+// load_numa() finds the NUMA nodes and sets numa to their layout.
+
+void load_numa (void) {
+  cpu_set_t allowed;
+  cpu_set_t nodes;
+
+  numa = malloc(sizeof(NumaLayout));
+  numa->num_nodes = 0;
+  numa->num_cpus = 0;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    fprintf(stderr, "Error: Unable to get the CPUs raycast may run on.\n");
+    exit(1);
+  }
+
+  if (read_cpu_list("/sys/devices/system/node/online", &nodes)) {
+    for (int node = 0; node < CPU_SETSIZE; node++) {
+      char path[64];
+      cpu_set_t cpus;
+
+      if (!CPU_ISSET(node, &nodes)) {
+        continue;
+      }
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+      read_cpu_list(path, &cpus);
+      CPU_AND(&cpus, &cpus, &allowed);
+      add_numa_node(&cpus);
+    }
+  }
+  if (numa->num_cpus == 0) {
+    add_numa_node(&allowed);
+  }
+}
+
+// numa_cpu() returns the CPU for worker out of num_workers, and stores the
+// index of its node in node.  Each node gets a contiguous run of workers,
+// as close to an equal share as there can be.
+
+int numa_cpu (int worker, int num_workers, int* node) {
+  int n = (int)((long)numa->num_nodes * worker / num_workers);
+  int first_worker = (int)(((long)num_workers * n + numa->num_nodes - 1) / numa->num_nodes);
+
+  *node = n;
+  return numa->cpus[numa->node_first[n] + (worker - first_worker) % numa->node_count[n]];
+}
+
+void pin_thread (int cpu) {
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// touch_tiles() zeroes the framebuffer of the tiles a worker starts out
+// with, so their pages are placed on the worker's node.  The anti-aliasing
+// buffers and the parts of the G-buffer being recorded are touched the
+// same way; a replayed G-buffer is only read.  Each worker only writes its
+// own tiles, so workers that are already rendering are never disturbed.
+
+void touch_tiles (Worker* worker) {
+  RenderJob* job = worker->job;
+  GBuffer* gbuffer = job->gbuffer;
+
+  for (int i = worker->deque.head; i < worker->deque.tail; i++) {
+    int tile = worker->deque.tiles[i];
+    int x = (tile % job->tiles_x) * TILE_SIZE;
+    int y = (tile / job->tiles_x) * TILE_SIZE;
+    int w = job->width - x < TILE_SIZE ? job->width - x : TILE_SIZE;
+    int h = job->height - y < TILE_SIZE ? job->height - y : TILE_SIZE;
+
+    for (int row = y; row < y + h; row++) {
+      size_t first = (size_t)row * job->width + x;
+
+      memset(job->framebuffer + first * 3, 0, (size_t)w * 3);
+      if (job->base_color != NULL) {
+        memset(job->base_color + first * 3, 0, sizeof(float) * 3 * w);
+        memset(job->object + first, 0, sizeof(long) * w);
+      }
+      if (gbuffer != NULL && !gbuffer->valid) {
+        memset(gbuffer->sphere + first, 0, sizeof(int32_t) * w);
+        memset(gbuffer->t + first, 0, sizeof(double) * w);
+      }
+      if (gbuffer != NULL && !gbuffer->shadows_valid) {
+        memset(gbuffer->shadows + first, 0, sizeof(uint64_t) * w);
+      }
+    }
+  }
+}
+
+typedef struct {
+  Scene* scene;
+  Scene* replica;
+  int cpu;
+  pthread_t thread;
+} ReplicaTask;
+
+// copy_replica() copies every array of a scene from a thread pinned to a
+// CPU of the replica's node.
+
+void* copy_replica (void* arg) {
+  ReplicaTask* task = arg;
+  SceneSection sections[RSCN_SECTIONS];
+
+  pin_thread(task->cpu);
+  *task->replica = *task->scene;
+  task->replica->sphere_index = NULL;
+  task->replica->mapping = NULL;
+  task->replica->mapping_size = 0;
+  scene_sections(task->replica, sections);
+  for (int i = 0; i < RSCN_SECTIONS; i++) {
+    void* copy = aligned_alloc(64, (sections[i].size + 63) / 64 * 64 + 64);
+    if (copy == NULL) {
+      fprintf(stderr, "Error: Out of memory while replicating the scene.\n");
+      exit(1);
+    }
+    memcpy(copy, *sections[i].pointer, sections[i].size);
+    *sections[i].pointer = copy;
+  }
+  return NULL;
+}
+
+// replicate_scene() returns a copy of a baked scene for every NUMA node,
+// each in memory on its node.  The copies are made on all nodes at once.
+
+Scene* replicate_scene (Scene* scene) {
+  Scene* replicas = malloc(sizeof(Scene) * numa->num_nodes);
+  ReplicaTask* tasks = malloc(sizeof(ReplicaTask) * numa->num_nodes);
+
+  for (int n = 0; n < numa->num_nodes; n++) {
+    tasks[n] = (ReplicaTask){.scene = scene, .replica = &replicas[n],
+                             .cpu = numa->cpus[numa->node_first[n]]};
+    if (pthread_create(&tasks[n].thread, NULL, copy_replica, &tasks[n]) != 0) {
+      fprintf(stderr, "Error: Unable to create replication thread.\n");
+      exit(1);
+    }
+  }
+  for (int n = 0; n < numa->num_nodes; n++) {
+    pthread_join(tasks[n].thread, NULL);
+  }
+  free(tasks);
+  return replicas;
+}
+
+void free_replicas (Scene* replicas) {
+  SceneSection sections[RSCN_SECTIONS];
+
+  for (int n = 0; n < numa->num_nodes; n++) {
+    scene_sections(&replicas[n], sections);
+    for (int i = 0; i < RSCN_SECTIONS; i++) {
+      free(*sections[i].pointer);
+    }
+  }
+  free(replicas);
+}
+
+void* render_worker (void* arg) {
+  Worker* worker = arg;
+
+  counters = (Counters){0};
+  if (worker->cpu >= 0) {
+    pin_thread(worker->cpu);
+  }
+  if (worker->touched != NULL) {
+    touch_tiles(worker);
+    pthread_barrier_wait(worker->touched);
+  }
+  while (1) {
+    int tile = take_tile(&worker->deque);
+    if (tile < 0) {
+      tile = find_work(worker);
+    }
+    if (tile < 0) {
+      break;
+    }
+
+    double start = now_seconds();
+    RenderJob* job = worker->job;
+    if (job->pass == 0) {
+      render_tile(job, tile);
+    }
+    else {
+      refine_tile(job, tile);
+    }
+    if (job->finished != NULL && (job->pass == 1 || (job->aa_samples <= 1 && job->stride == 1))) {
+      job->finished(job, tile, job->finished_context);
+    }
+    worker->busy_time += now_seconds() - start;
+    worker->tiles_rendered += 1;
+  }
+
+  worker->finish_time = now_seconds();
+  worker->counters = counters;
+  return NULL;
+}
+
+// render_pass() runs one pass over the tiles of the image in the job on
+// num_threads workers.  Each worker starts with an equal, contiguous range
+// of tiles and steals from the others once its own range runs out.  The
+// work counters of all threads are added to job->counters.  If stats is set
+// the per-thread busy and idle times are reported on stderr.  Each pixel is
+// computed from the scene and its own position alone, never from which
+// thread traced it or when, so the image is the same for every thread
+// count; "make test-perf" checks this.
+
+void render_pass (RenderJob* job, int num_threads, bool stats) {
+  int num_tiles;
+
+  job->tiles_x = (job->width + TILE_SIZE - 1) / TILE_SIZE;
+  job->tiles_y = (job->height + TILE_SIZE - 1) / TILE_SIZE;
+  num_tiles = job->tile_count > 0 ? job->tile_count : job->tiles_x * job->tiles_y;
+
+  if (num_threads > num_tiles) {
+    num_threads = num_tiles;
+  }
+
+  Worker* workers = calloc(num_threads, sizeof(Worker));
+  int* tiles = malloc(sizeof(int) * num_tiles);
+
+  for (int i = 0; i < num_tiles; i++) {
+    tiles[i] = job->first_tile + i;
+  }
+
+  // The calling thread runs worker 0, so with --numa it is pinned like the
+  // other workers; its own CPUs are saved here and given back once the pass
+  // is over, so whatever it does next is not stuck on worker 0's CPU.
+  // With replicas, the workers on each node read their node's copy of the
+  // scene through a copy of the job.
+  cpu_set_t caller;
+  pthread_barrier_t touched;
+  bool first_touch = numa != NULL && job->pass == 0 && job->done_stride == 0;
+  RenderJob* node_jobs = NULL;
+  if (numa != NULL) {
+    pthread_getaffinity_np(pthread_self(), sizeof(caller), &caller);
+  }
+  if (first_touch) {
+    pthread_barrier_init(&touched, NULL, num_threads);
+  }
+  if (job->replicas != NULL) {
+    node_jobs = malloc(sizeof(RenderJob) * numa->num_nodes);
+    for (int n = 0; n < numa->num_nodes; n++) {
+      node_jobs[n] = *job;
+      node_jobs[n].scene = &job->replicas[n];
+    }
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    int node = 0;
+    workers[i].cpu = numa != NULL ? numa_cpu(i, num_threads, &node) : -1;
+    workers[i].touched = first_touch ? &touched : NULL;
+    workers[i].job = node_jobs != NULL ? &node_jobs[node] : job;
+    workers[i].id = i;
+    workers[i].num_workers = num_threads;
+    workers[i].workers = workers;
+    workers[i].rng = 2654435761u * (i + 1);
+    workers[i].deque.tiles = tiles;
+    workers[i].deque.head = (int)((long)num_tiles * i / num_threads);
+    workers[i].deque.tail = (int)((long)num_tiles * (i + 1) / num_threads);
+    pthread_mutex_init(&workers[i].deque.lock, NULL);
+  }
+
+  double start = now_seconds();
+
+  // The calling thread acts as worker 0.
+  for (int i = 1; i < num_threads; i++) {
+    if (pthread_create(&workers[i].thread, NULL, render_worker, &workers[i]) != 0) {
+      fprintf(stderr, "Error: Unable to create render thread.\n");
+      exit(1);
+    }
+  }
+  render_worker(&workers[0]);
+  for (int i = 1; i < num_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  double end = now_seconds();
+
+  if (numa != NULL) {
+    pthread_setaffinity_np(pthread_self(), sizeof(caller), &caller);
+  }
+  if (first_touch) {
+    pthread_barrier_destroy(&touched);
+  }
+  free(node_jobs);
+
+  Counters* total = &job->counters;
+  for (int i = 0; i < num_threads; i++) {
+    total->rays += workers[i].counters.rays;
+    total->shadow_rays += workers[i].counters.shadow_rays;
+    total->sphere_tests += workers[i].counters.sphere_tests;
+    total->plane_tests += workers[i].counters.plane_tests;
+    total->nodes_visited += workers[i].counters.nodes_visited;
+    total->refined_pixels += workers[i].counters.refined_pixels;
+    total->extra_samples += workers[i].counters.extra_samples;
+  }
+
+  if (stats) {
+    char label[32] = "Refine";
+    if (job->pass == 0) {
+      snprintf(label, sizeof(label), job->progressive ? "Render 1/%d" : "Render", job->stride);
+    }
+    fprintf(stderr, "%s: %.3f ms on %d threads, %d tiles, %s kernels\n",
+            label, (end - start) * 1e3, num_threads, num_tiles, kernel_name);
+    for (int i = 0; i < num_threads; i++) {
+      Worker* worker = &workers[i];
+      fprintf(stderr, "  thread %d: busy %.3f ms, idle %.3f ms, %d tiles (%d stolen)",
+              i, worker->busy_time * 1e3, (end - start - worker->busy_time) * 1e3,
+              worker->tiles_rendered, worker->tiles_stolen);
+      if (worker->cpu >= 0) {
+        fprintf(stderr, ", cpu %d", worker->cpu);
+      }
+      fprintf(stderr, "\n");
+    }
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    pthread_mutex_destroy(&workers[i].deque.lock);
+  }
+  free(tiles);
+  free(workers);
+}
+
+// render() renders the image on num_threads workers: one ray per pixel,
+// and then with anti-aliasing on, a second pass that adds samples to the
+// pixels on edges.  The second pass has to wait for the whole first pass,
+// since a pixel's neighbours may lie in other tiles.  A progressive render
+// first traces every PROGRESSIVE_STRIDE-th pixel and halves the stride on
+// each following pass, calling job->preview after every pass but the last
+// so a coarse image is available early.  Every pixel is still traced once,
+// so the final image is the same.  The work done is left in job->counters
+// and reported on stderr if stats is set.
+
+void render (RenderJob* job, int num_threads, bool stats) {
+  Counters* total = &job->counters;
+
+  *total = (Counters){0};
+  job->pass = 0;
+  job->done_stride = 0;
+  for (int stride = job->progressive ? PROGRESSIVE_STRIDE : 1; stride >= 1; stride /= 2) {
+    job->stride = stride;
+    render_pass(job, num_threads, stats);
+    job->done_stride = stride;
+    if (job->preview != NULL && (stride > 1 || job->aa_samples > 1)) {
+      job->preview(job, job->preview_context);
+    }
+  }
+  if (job->aa_samples > 1) {
+    job->pass = 1;
+    render_pass(job, num_threads, stats);
+  }
+
+  if (stats) {
+    fprintf(stderr, "Work: %ld rays, %ld shadow rays, %ld sphere tests, %ld plane tests, "
+            "%ld BVH nodes visited\n", total->rays, total->shadow_rays, total->sphere_tests,
+            total->plane_tests, total->nodes_visited);
+    if (total->rays > 0) {
+      fprintf(stderr, "  per ray: %.2f shadow rays, %.2f sphere tests, %.2f plane tests, "
+              "%.2f BVH nodes\n", (double)total->shadow_rays / total->rays,
+              (double)total->sphere_tests / total->rays, (double)total->plane_tests / total->rays,
+              (double)total->nodes_visited / total->rays);
+    }
+    if (job->aa_samples > 1) {
+      fprintf(stderr, "Anti-aliasing: %ld of %ld pixels refined with %ld extra samples\n",
+              total->refined_pixels, (long)job->width * job->height, total->extra_samples);
+    }
+  }
+}
+
+// write_p3() writes the framebuffer out as an ASCII (P3) ppm file.  It is
+// slow and only meant for debugging.  A filename of "-" means stdout.
+
+void write_p3 (char* filename, uint8_t* framebuffer, int width, int height) {
+  bool to_stdout = strcmp(filename, "-") == 0;
+  FILE* output = to_stdout ? stdout : fopen(filename, "w");
+
+  if (output == NULL) {
+    fprintf(stderr, "Error: Unable to open output file \"%s\".\n", filename);
+    exit(1);
+  }
+
+  fprintf(output, "P3 %d %d 255\n", width, height);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      uint8_t* pixel = &framebuffer[((size_t)y * width + x) * 3];
+      fprintf(output, "%d %d %d\n", pixel[0], pixel[1], pixel[2]);
+    }
+    fprintf(output, "\n");
+  }
+
+  if (to_stdout) {
+    fflush(output);
+  }
+  else {
+    fclose(output);
+  }
+}
+
+// write_all() writes count buffers out to fd.  writev() may write less than
+// asked for, so it keeps going until all of them have been written.  It
+// returns false if the write fails.
+
+bool write_all (int fd, struct iovec* iov, int count) {
+  int first = 0;
+
+  while (first < count) {
+    ssize_t written = writev(fd, &iov[first], count - first);
+    if (written < 0) {
+      return false;
+    }
+    while (first < count && (size_t)written >= iov[first].iov_len) {
+      written -= iov[first].iov_len;
+      first += 1;
+    }
+    if (first < count) {
+      iov[first].iov_base = (char*)iov[first].iov_base + written;
+      iov[first].iov_len -= written;
+    }
+  }
+  return true;
+}
+
+// read_all() reads exactly size bytes from fd into data.  It returns false
+// if the read fails or the other end hangs up first.
+
+bool read_all (int fd, void* data, size_t size) {
+  char* next = data;
+
+  while (size > 0) {
+    ssize_t got = read(fd, next, size);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    next += got;
+    size -= got;
+  }
+  return true;
+}
+
+// write_p6() writes the framebuffer out as a binary (P6) ppm file.  The
+// header and the pixels go out together in a single writev() call.  A
+// filename of "-" means stdout, which is left open for further frames.
+
+void write_p6 (char* filename, uint8_t* framebuffer, int width, int height) {
+  char header[64];
+  int header_length = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+  bool to_stdout = strcmp(filename, "-") == 0;
+  int fd = to_stdout ? STDOUT_FILENO : open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (fd < 0) {
+    fprintf(stderr, "Error: Unable to open output file \"%s\".\n", filename);
+    exit(1);
+  }
+
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = header_length;
+  iov[1].iov_base = framebuffer;
+  iov[1].iov_len = (size_t)width * height * 3;
+  if (!write_all(fd, iov, 2)) {
+    fprintf(stderr, "Error: Unable to write output file \"%s\".\n", filename);
+    exit(1);
+  }
+
+  if (!to_stdout) {
+    close(fd);
+  }
+}
+
+// Images at least this large are rendered straight into a memory-mapped
+// output file rather than into a separate framebuffer.
+
+#define MMAP_THRESHOLD ((size_t)256 << 20)
+
+typedef struct {
+  int fd;
+  void* map;
+  size_t length;
+} MappedFile;
+
+// map_p6() creates a P6 ppm file of its final size, maps it into memory and
+// writes the header.  It returns a pointer to the first pixel, which can be
+// used as the render framebuffer.  The pixels reach the file through the page
+// cache, so no copy of the image is ever made.
+
+uint8_t* map_p6 (char* filename, int width, int height, MappedFile* file) {
+  char header[64];
+  int header_length = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+
+  file->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (file->fd < 0) {
+    fprintf(stderr, "Error: Unable to open output file \"%s\".\n", filename);
+    exit(1);
+  }
+
+  // Reserve the disk space up front so running out of space is reported
+  // here instead of as a SIGBUS in the middle of the render.
+  file->length = header_length + (size_t)width * height * 3;
+  if (posix_fallocate(file->fd, 0, file->length) != 0) {
+    fprintf(stderr, "Error: Unable to allocate %zu bytes for output file \"%s\".\n",
+            file->length, filename);
+    exit(1);
+  }
+
+  file->map = mmap(NULL, file->length, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+  if (file->map == MAP_FAILED) {
+    fprintf(stderr, "Error: Unable to map output file \"%s\".\n", filename);
+    exit(1);
+  }
+
+  memcpy(file->map, header, header_length);
+  return (uint8_t*)file->map + header_length;
+}
+
+// unmap_p6() releases an image created by map_p6().
+
+void unmap_p6 (MappedFile* file) {
+  munmap(file->map, file->length);
+  close(file->fd);
+}
+
+// A PNG is written a band of TILE_SIZE rows at a time.  Each band is
+// filtered and deflated on its own, by whichever render thread finishes
+// its last tile, so the image is compressed while the rest of it is still
+// being rendered.  Every band but the last ends with a sync flush and no
+// final block, so the bands joined together are the single zlib stream
+// that a PNG's IDAT chunks hold, and their checksums are joined with
+// adler32_combine().  Each band is written out as an IDAT chunk as soon as
+// it and every band above it are compressed, so only bands waiting on an
+// earlier one are held in memory.
+
+#define PNG_LEVEL 6
+
+typedef struct {
+  uint8_t* data;
+  size_t size;
+  size_t length;
+  uLong adler;
+  bool ready;
+} PngBand;
+
+typedef struct {
+  char* filename;
+  int fd;
+  uint8_t* framebuffer;
+  int width;
+  int height;
+  int tiles_x;
+  int num_bands;
+  int* tiles_left;
+  PngBand* bands;
+
+  pthread_mutex_t lock;
+  int next_band;
+  uLong adler;
+  bool failed;
+} PngWriter;
+
+// is_png() reports whether an output filename asks for a PNG.
+
+bool is_png (char* filename) {
+  size_t length = strlen(filename);
+
+  return length >= 4 && strcasecmp(filename + length - 4, ".png") == 0;
+}
+
+void put_u32 (uint8_t* p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+// write_png_chunk() writes a PNG chunk of the given type whose data is the
+// count buffers in data, one after another.
+
+bool write_png_chunk (int fd, const char* type, struct iovec* data, int count) {
+  uint8_t head[8], tail[4];
+  struct iovec iov[count + 2];
+  size_t length = 0;
+  uLong crc = crc32(0, (const Bytef*)type, 4);
+
+  for (int i = 0; i < count; i++) {
+    length += data[i].iov_len;
+    crc = crc32(crc, data[i].iov_base, data[i].iov_len);
+    iov[i + 1] = data[i];
+  }
+  put_u32(head, length);
+  memcpy(head + 4, type, 4);
+  put_u32(tail, crc);
+
+  iov[0].iov_base = head;
+  iov[0].iov_len = sizeof(head);
+  iov[count + 1].iov_base = tail;
+  iov[count + 1].iov_len = sizeof(tail);
+  return write_all(fd, iov, count + 2);
+}
+
+// start_png() creates filename and writes the start of a PNG of the width
+// by height image in framebuffer.  It returns false if the file cannot be
+// written.
+
+bool start_png (PngWriter* png, char* filename, uint8_t* framebuffer, int width, int height) {
+  static const uint8_t signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+  uint8_t header[13];
+
+  png->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (png->fd < 0) {
+    return false;
+  }
+  png->filename = filename;
+  png->framebuffer = framebuffer;
+  png->width = width;
+  png->height = height;
+  png->tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+  png->num_bands = (height + TILE_SIZE - 1) / TILE_SIZE;
+  png->tiles_left = malloc(sizeof(int) * png->num_bands);
+  png->bands = calloc(png->num_bands, sizeof(PngBand));
+  if (png->tiles_left == NULL || png->bands == NULL) {
+    fprintf(stderr, "Error: Unable to allocate a %dx%d PNG encoder.\n", width, height);
+    exit(1);
+  }
+  for (int i = 0; i < png->num_bands; i++) {
+    png->tiles_left[i] = png->tiles_x;
+  }
+  pthread_mutex_init(&png->lock, NULL);
+  png->next_band = 0;
+  png->adler = adler32(0, NULL, 0);
+  png->failed = false;
+
+  // 8 bit RGB, deflated, with per-row filters and no interlacing.
+  put_u32(header, width);
+  put_u32(header + 4, height);
+  header[8] = 8;
+  header[9] = 2;
+  header[10] = header[11] = header[12] = 0;
+
+  struct iovec iov[2] = {{(void*)signature, sizeof(signature)}, {header, sizeof(header)}};
+  png->failed = !write_all(png->fd, iov, 1) || !write_png_chunk(png->fd, "IHDR", &iov[1], 1);
+  return true;
+}
+
+// png_predict() is what PNG filter type filter predicts a byte to be from
+// the byte to its left, a, the one above it, b, and the one above and to
+// the left, c.
+
+int png_predict (int filter, int a, int b, int c) {
+  if (filter == 1) {
+    return a;
+  }
+  if (filter == 2) {
+    return b;
+  }
+  if (filter == 3) {
+    return (a + b) / 2;
+  }
+  if (filter == 4) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+  }
+  return 0;
+}
+
+// filter_row() stores the PNG filter byte and the filtered bytes of row y
+// in out.  It picks the filter leaving the smallest sum of absolute values,
+// the usual guess at what deflates best.  The row above is only used if up
+// is set, since at the top of a band it belongs to another band that may
+// not be finished yet.
+
+void filter_row (PngWriter* png, int y, bool up, uint8_t* out) {
+  size_t length = (size_t)png->width * 3;
+  uint8_t* row = &png->framebuffer[(size_t)y * length];
+  uint8_t* above = row - length;
+  long best_sum = -1;
+  int best = 0;
+
+  for (int filter = 0; filter < (up ? 5 : 2); filter++) {
+    long sum = 0;
+    for (size_t i = 0; i < length; i++) {
+      int a = i >= 3 ? row[i - 3] : 0;
+      int b = up ? above[i] : 0;
+      int c = up && i >= 3 ? above[i - 3] : 0;
+      sum += abs((int8_t)(row[i] - png_predict(filter, a, b, c)));
+    }
+    if (best_sum < 0 || sum < best_sum) {
+      best_sum = sum;
+      best = filter;
+    }
+  }
+
+  out[0] = best;
+  for (size_t i = 0; i < length; i++) {
+    int a = i >= 3 ? row[i - 3] : 0;
+    int b = up ? above[i] : 0;
+    int c = up && i >= 3 ? above[i - 3] : 0;
+    out[i + 1] = row[i] - png_predict(best, a, b, c);
+  }
+}
+
+// write_bands() writes out, in order, the compressed bands that are ready
+// and have every band above them written.  The first one starts the zlib
+// stream and the last one ends it with the checksum.  png->lock is held.
+
+void write_bands (PngWriter* png) {
+  static const uint8_t zlib_header[2] = {0x78, 0x9c};
+
+  while (png->next_band < png->num_bands && png->bands[png->next_band].ready) {
+    PngBand* band = &png->bands[png->next_band];
+    uint8_t trailer[4];
+    struct iovec iov[3];
+    int count = 0;
+
+    png->adler = adler32_combine(png->adler, band->adler, band->length);
+    if (png->next_band == 0) {
+      iov[count++] = (struct iovec){(void*)zlib_header, sizeof(zlib_header)};
+    }
+    iov[count++] = (struct iovec){band->data, band->size};
+    if (png->next_band == png->num_bands - 1) {
+      put_u32(trailer, png->adler);
+      iov[count++] = (struct iovec){trailer, sizeof(trailer)};
+    }
+    if (!png->failed && !write_png_chunk(png->fd, "IDAT", iov, count)) {
+      png->failed = true;
+    }
+    free(band->data);
+    band->data = NULL;
+    png->next_band += 1;
+  }
+}
+
+// compress_band() filters and deflates band of the image and writes out
+// whichever bands that lets through.
+
+void compress_band (PngWriter* png, int band) {
+  int y0 = band * TILE_SIZE;
+  int y1 = y0 + TILE_SIZE < png->height ? y0 + TILE_SIZE : png->height;
+  size_t row = (size_t)png->width * 3 + 1;
+  size_t length = row * (y1 - y0);
+  uint8_t* filtered = malloc(length);
+
+  if (filtered == NULL) {
+    fprintf(stderr, "Error: Unable to allocate %zu bytes to compress \"%s\".\n", length,
+            png->filename);
+    exit(1);
+  }
+  for (int y = y0; y < y1; y++) {
+    filter_row(png, y, y > y0, filtered + (y - y0) * row);
+  }
+
+  // Raw deflate, since the bands share a single zlib header and trailer.
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, PNG_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    fprintf(stderr, "Error: Unable to start compressing \"%s\".\n", png->filename);
+    exit(1);
+  }
+  size_t capacity = deflateBound(&stream, length) + 16;
+  uint8_t* data = malloc(capacity);
+  if (data == NULL) {
+    fprintf(stderr, "Error: Unable to allocate %zu bytes to compress \"%s\".\n", capacity,
+            png->filename);
+    exit(1);
+  }
+  stream.next_in = filtered;
+  stream.avail_in = length;
+  stream.next_out = data;
+  stream.avail_out = capacity;
+  deflate(&stream, band == png->num_bands - 1 ? Z_FINISH : Z_SYNC_FLUSH);
+  size_t size = capacity - stream.avail_out;
+  deflateEnd(&stream);
+
+  uLong adler = adler32(adler32(0, NULL, 0), filtered, length);
+  free(filtered);
+
+  pthread_mutex_lock(&png->lock);
+  png->bands[band] = (PngBand){data, size, length, adler, true};
+  write_bands(png);
+  pthread_mutex_unlock(&png->lock);
+}
+
+// png_tile_finished() is the tile callback of a render written as a PNG.
+// The thread that finishes the last tile of a band compresses the band.
+
+void png_tile_finished (RenderJob* job, int tile, void* context) {
+  PngWriter* png = context;
+  int band = tile / png->tiles_x;
+
+  (void)job;
+  if (__atomic_sub_fetch(&png->tiles_left[band], 1, __ATOMIC_ACQ_REL) == 0) {
+    compress_band(png, band);
+  }
+}
+
+// finish_png() compresses whatever bands are left, ends the PNG and closes
+// it.  It returns false if the file could not be written.
+
+bool finish_png (PngWriter* png) {
+  for (int band = 0; band < png->num_bands; band++) {
+    if (png->tiles_left[band] > 0) {
+      png->tiles_left[band] = 0;
+      compress_band(png, band);
+    }
+  }
+
+  bool written = !png->failed && write_png_chunk(png->fd, "IEND", NULL, 0);
+  if (close(png->fd) != 0) {
+    written = false;
+  }
+  pthread_mutex_destroy(&png->lock);
+  free(png->tiles_left);
+  free(png->bands);
+  return written;
+}
+
+// save_png() writes the width by height image in framebuffer to filename as
+// a PNG, compressing it on the calling thread.  It returns false if the file
+// could not be written.
+
+bool save_png (char* filename, uint8_t* framebuffer, int width, int height) {
+  PngWriter png;
+
+  return start_png(&png, filename, framebuffer, width, height) && finish_png(&png);
+}
+
+// write_png() is save_png() for the final image, which exits if the file
+// could not be written.
+
+void write_png (char* filename, uint8_t* framebuffer, int width, int height) {
+  if (!save_png(filename, framebuffer, width, height)) {
+    fprintf(stderr, "Error: Unable to write output file \"%s\".\n", filename);
+    exit(1);
+  }
+}
+
+// A G-buffer file starts with a GBufferHeader, padded to GBUFFER_ALIGN
+// bytes, followed by the sphere slot of every pixel and then, starting on
+// the next multiple of 8 bytes, the distance and the shadow mask of every
+// pixel.  The keys are hashes of everything the hits and the shadows depend
+// on, so a file left over from another scene, camera or image size is
+// never replayed.
+
+#define GBUFFER_MAGIC "RGBF"
+#define GBUFFER_VERSION 1
+#define GBUFFER_ALIGN 64
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint64_t key;
+  uint64_t shadow_key;
+  int32_t width;
+  int32_t height;
+} GBufferHeader;
+
+// hash_bytes() mixes size bytes of data into the FNV-1a hash h, a 64-bit
+// word at a time.
+
+uint64_t hash_bytes (uint64_t h, void* data, size_t size) {
+  uint8_t* bytes = data;
+  size_t i = 0;
+
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, 8);
+    h = (h ^ word) * 0x100000001b3ull;
+  }
+  for (; i < size; i++) {
+    h = (h ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+// gbuffer_key() hashes what the primary sphere hits of a render depend on:
+// the spheres in slot order, which also captures the BVH layout, the camera
+// and the image size.
+
+uint64_t gbuffer_key (Scene* scene, int width, int height) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  size_t slots = (size_t)scene->sphere_slots * sizeof(double);
+
+  h = hash_bytes(h, &width, sizeof(width));
+  h = hash_bytes(h, &height, sizeof(height));
+  h = hash_bytes(h, &scene->view_width, sizeof(double));
+  h = hash_bytes(h, &scene->view_height, sizeof(double));
+  h = hash_bytes(h, scene->baked_origin, sizeof(double) * 3);
+  h = hash_bytes(h, &scene->sphere_slots, sizeof(int));
+  h = hash_bytes(h, scene->sphere_cx, slots);
+  h = hash_bytes(h, scene->sphere_cy, slots);
+  h = hash_bytes(h, scene->sphere_cz, slots);
+  h = hash_bytes(h, scene->sphere_r2, slots);
+  return h;
+}
+
+// shadow_key() extends key, the hash of the hits, with what the shadow
+// tests depend on as well: the planes, and the position and cone of every
+// light.  Light colors and falloff are left out on purpose.
+
+uint64_t shadow_key (Scene* scene, uint64_t key) {
+  size_t planes = (size_t)scene->num_planes * sizeof(double);
+  uint64_t h = key;
+
+  h = hash_bytes(h, &scene->num_planes, sizeof(int));
+  h = hash_bytes(h, scene->plane_nx, planes);
+  h = hash_bytes(h, scene->plane_ny, planes);
+  h = hash_bytes(h, scene->plane_nz, planes);
+  h = hash_bytes(h, scene->plane_d, planes);
+  h = hash_bytes(h, &scene->num_lights, sizeof(int));
+  for (int i = 0; i < scene->num_lights; i++) {
+    Light* light = &scene->lights[i];
+    h = hash_bytes(h, light->position, sizeof(double) * 3);
+    h = hash_bytes(h, &light->spot, sizeof(bool));
+    if (light->spot) {
+      h = hash_bytes(h, light->direction, sizeof(double) * 3);
+      h = hash_bytes(h, &light->cos_theta, sizeof(double));
+    }
+  }
+  return h;
+}
+
+// gbuffer_layout() computes where the distances and the shadow masks start
+// in a G-buffer file for a width by height image, and the size of the file.
+
+void gbuffer_layout (int width, int height, size_t* t_offset, size_t* shadow_offset,
+                     size_t* size) {
+  size_t pixels = (size_t)width * height;
+
+  *t_offset = (GBUFFER_ALIGN + pixels * sizeof(int32_t) + 7) / 8 * 8;
+  *shadow_offset = *t_offset + pixels * sizeof(double);
+  *size = *shadow_offset + pixels * sizeof(uint64_t);
+}
+
+// check_gbuffer_hits() reports whether every one of the pixels hits ends
+// at a sphere slot of scene or at nothing, so a corrupt cache file is traced
+// again instead of being replayed.
+
+bool check_gbuffer_hits (int32_t* hits, size_t pixels, Scene* scene) {
+  for (size_t i = 0; i < pixels; i++) {
+    if (hits[i] < -1 || hits[i] >= scene->sphere_slots) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// open_gbuffer() sets gbuffer up for a width by height render of scene.  If
+// filename holds the hits of an identical render they are mapped in and
+// replayed, and so are its shadows if the lights have not moved either.
+// Whatever cannot be replayed gets an array to record into.
+
+void open_gbuffer (char* filename, GBuffer* gbuffer, Scene* scene, int width, int height) {
+  size_t pixels = (size_t)width * height;
+  size_t t_offset, shadow_offset, size;
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+
+  gbuffer_layout(width, height, &t_offset, &shadow_offset, &size);
+  gbuffer->key = gbuffer_key(scene, width, height);
+  gbuffer->shadow_key = shadow_key(scene, gbuffer->key);
+  gbuffer->valid = false;
+  gbuffer->shadows_valid = false;
+  gbuffer->mapping = NULL;
+
+  if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size == size) {
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    GBufferHeader* header = map;
+
+    if (map != MAP_FAILED) {
+      if (memcmp(header->magic, GBUFFER_MAGIC, 4) == 0 && header->version == GBUFFER_VERSION &&
+          header->key == gbuffer->key && header->width == width && header->height == height &&
+          check_gbuffer_hits((int32_t*)((char*)map + GBUFFER_ALIGN), pixels, scene)) {
+        gbuffer->valid = true;
+        gbuffer->mapping = map;
+        gbuffer->mapping_size = size;
+        gbuffer->sphere = (int32_t*)((char*)map + GBUFFER_ALIGN);
+        gbuffer->t = (double*)((char*)map + t_offset);
+        if (header->shadow_key == gbuffer->shadow_key) {
+          gbuffer->shadows_valid = true;
+          gbuffer->shadows = (uint64_t*)((char*)map + shadow_offset);
+        }
+      }
+      else {
+        munmap(map, size);
+      }
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  if (!gbuffer->valid) {
+    gbuffer->sphere = malloc(sizeof(int32_t) * pixels);
+    gbuffer->t = malloc(sizeof(double) * pixels);
+  }
+  if (!gbuffer->shadows_valid) {
+    gbuffer->shadows = malloc(sizeof(uint64_t) * pixels);
+  }
+  if (gbuffer->sphere == NULL || gbuffer->t == NULL || gbuffer->shadows == NULL) {
+    fprintf(stderr, "Error: Unable to allocate a %dx%d G-buffer.\n", width, height);
+    exit(1);
+  }
+}
+
+// close_gbuffer() writes whatever was recorded out to filename, through a
+// temporary file so a reader never maps a half-written one, and frees the
+// G-buffer.
+
+void close_gbuffer (char* filename, GBuffer* gbuffer, int width, int height) {
+  size_t pixels = (size_t)width * height;
+  size_t t_offset, shadow_offset, size;
+
+  gbuffer_layout(width, height, &t_offset, &shadow_offset, &size);
+
+  if (!gbuffer->shadows_valid) {
+    char header[GBUFFER_ALIGN];
+    static const char zeros[8];
+    GBufferHeader* fields = (GBufferHeader*)header;
+
+    memset(header, 0, sizeof(header));
+    memcpy(fields->magic, GBUFFER_MAGIC, 4);
+    fields->version = GBUFFER_VERSION;
+    fields->key = gbuffer->key;
+    fields->shadow_key = gbuffer->shadow_key;
+    fields->width = width;
+    fields->height = height;
+
+    struct iovec iov[5];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = gbuffer->sphere;
+    iov[1].iov_len = pixels * sizeof(int32_t);
+    iov[2].iov_base = (void*)zeros;
+    iov[2].iov_len = t_offset - GBUFFER_ALIGN - iov[1].iov_len;
+    iov[3].iov_base = gbuffer->t;
+    iov[3].iov_len = pixels * sizeof(double);
+    iov[4].iov_base = gbuffer->shadows;
+    iov[4].iov_len = pixels * sizeof(uint64_t);
+
+    size_t length = strlen(filename) + 5;
+    char temporary[length];
+    snprintf(temporary, length, "%s.tmp", filename);
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || !write_all(fd, iov, 5) || close(fd) != 0 || rename(temporary, filename) != 0) {
+      fprintf(stderr, "Error: Unable to write G-buffer \"%s\".\n", filename);
+      exit(1);
+    }
+    free(gbuffer->shadows);
+  }
+
+  if (!gbuffer->valid) {
+    free(gbuffer->sphere);
+    free(gbuffer->t);
+  }
+  if (gbuffer->mapping != NULL) {
+    munmap(gbuffer->mapping, gbuffer->mapping_size);
+  }
+}
+
+#ifdef RAYCAST_OPENCL
+
+// gpu_kernel_source is the OpenCL program run by trace_on_gpu().  For each
+// pixel it finds what the primary ray hits, the same way closest_sphere()
+// and plane_primary() do, and which of the lights shade() would test are
+// blocked, the same way occluded() does, and stores both in G-buffer form.
+
+const char* gpu_kernel_source =
+  "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n"
+  "#pragma OPENCL FP_CONTRACT OFF\n"
+  "\n"
+  "typedef struct {\n"
+  "  double min[3];\n"
+  "  double max[3];\n"
+  "  int first;\n"
+  "  int count;\n"
+  "  int pad[2];\n"
+  "} BVHNode;\n"
+  "\n"
+  "double hit_box (__global const BVHNode* node, double* origin, double* inv_direction,\n"
+  "                double max_t) {\n"
+  "  double t_near = 0;\n"
+  "  double t_far = max_t;\n"
+  "\n"
+  "  for (int k = 0; k < 3; k++) {\n"
+  "    double t0 = (node->min[k] - origin[k]) * inv_direction[k];\n"
+  "    double t1 = (node->max[k] - origin[k]) * inv_direction[k];\n"
+  "    if (t0 > t1) {\n"
+  "      double swap = t0;\n"
+  "      t0 = t1;\n"
+  "      t1 = swap;\n"
+  "    }\n"
+  "    if (t0 > t_near) {\n"
+  "      t_near = t0;\n"
+  "    }\n"
+  "    if (t1 < t_far) {\n"
+  "      t_far = t1;\n"
+  "    }\n"
+  "  }\n"
+  "  return t_near <= t_far ? t_near : INFINITY;\n"
+  "}\n"
+  "\n"
+  "double dot3 (double* a, double* b) {\n"
+  "  return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];\n"
+  "}\n"
+  "\n"
+  "__kernel void trace (__global const BVHNode* bvh, int bvh_nodes,\n"
+  "                     __global const double* sphere_ox, __global const double* sphere_oy,\n"
+  "                     __global const double* sphere_oz, __global const double* sphere_c,\n"
+  "                     __global const double* sphere_cx, __global const double* sphere_cy,\n"
+  "                     __global const double* sphere_cz, __global const double* sphere_r2,\n"
+  "                     __global const double* planes, int num_planes,\n"
+  "                     __global const double* lights, int num_lights,\n"
+  "                     __global const double* camera, int width, int height, long first,\n"
+  "                     __global int* sphere_out, __global double* t_out,\n"
+  "                     __global ulong* shadows_out) {\n"
+  "  long index = get_global_id(0);\n"
+  "  long pixel = first + index;\n"
+  "  if (pixel >= (long)width * height) {\n"
+  "    return;\n"
+  "  }\n"
+  "  int x = pixel % width;\n"
+  "  int y = pixel / width;\n"
+  "\n"
+  "  double origin[3] = {camera[0], camera[1], camera[2]};\n"
+  "  double view_width = camera[3];\n"
+  "  double view_height = camera[4];\n"
+  "  double direction[3];\n"
+  "  direction[0] = -view_width / 2 + view_width / width * (x + 0.5);\n"
+  "  direction[1] = view_height / 2 - view_height / height * (y + 0.5);\n"
+  "  direction[2] = 1;\n"
+  "  double len = sqrt(direction[0]*direction[0] + direction[1]*direction[1] +\n"
+  "                    direction[2]*direction[2]);\n"
+  "  direction[0] /= len;\n"
+  "  direction[1] /= len;\n"
+  "  direction[2] /= len;\n"
+  "\n"
+  "  double inv_direction[3] = {1 / direction[0], 1 / direction[1], 1 / direction[2]};\n"
+  "  int stack[BVH_STACK_SIZE];\n"
+  "  int top = 0;\n"
+  "\n"
+  "  // The closest sphere, walking the BVH front to back like closest_sphere().\n"
+  "  int sphere = -1;\n"
+  "  double best_t = INFINITY;\n"
+  "  if (bvh_nodes > 0 && hit_box(&bvh[0], origin, inv_direction, best_t) != INFINITY) {\n"
+  "    stack[top++] = 0;\n"
+  "  }\n"
+  "  while (top > 0) {\n"
+  "    __global const BVHNode* node = &bvh[stack[--top]];\n"
+  "\n"
+  "    if (node->count > 0) {\n"
+  "      for (int i = node->first; i < node->first + node->count; i++) {\n"
+  "        double b = direction[0]*sphere_ox[i] + direction[1]*sphere_oy[i] +\n"
+  "                   direction[2]*sphere_oz[i];\n"
+  "        double det = b*b - sphere_c[i];\n"
+  "        if (det < 0) {\n"
+  "          continue;\n"
+  "        }\n"
+  "        det = sqrt(det);\n"
+  "        double t = -b - det;\n"
+  "        if (t <= 0) {\n"
+  "          t = -b + det;\n"
+  "        }\n"
+  "        if (t > 0 && t < best_t) {\n"
+  "          best_t = t;\n"
+  "          sphere = i;\n"
+  "        }\n"
+  "      }\n"
+  "      continue;\n"
+  "    }\n"
+  "\n"
+  "    int left = node->first;\n"
+  "    double t_left = hit_box(&bvh[left], origin, inv_direction, best_t);\n"
+  "    double t_right = hit_box(&bvh[left + 1], origin, inv_direction, best_t);\n"
+  "    if (t_left <= t_right) {\n"
+  "      if (t_right < best_t) {\n"
+  "        stack[top++] = left + 1;\n"
+  "      }\n"
+  "      if (t_left < best_t) {\n"
+  "        stack[top++] = left;\n"
+  "      }\n"
+  "    }\n"
+  "    else {\n"
+  "      if (t_left < best_t) {\n"
+  "        stack[top++] = left;\n"
+  "      }\n"
+  "      if (t_right < best_t) {\n"
+  "        stack[top++] = left + 1;\n"
+  "      }\n"
+  "    }\n"
+  "  }\n"
+  "  sphere_out[index] = sphere;\n"
+  "  t_out[index] = best_t;\n"
+  "\n"
+  "  // The closest plane, like plane_primary().  Each plane is stored as its\n"
+  "  // normal, d and the baked d - dot(normal, origin).\n"
+  "  int plane = -1;\n"
+  "  double plane_t = INFINITY;\n"
+  "  for (int i = 0; i < num_planes; i++) {\n"
+  "    __global const double* p = &planes[i * 5];\n"
+  "    double a = p[0] * direction[0] + p[1] * direction[1] + p[2] * direction[2];\n"
+  "    double t = p[4] / a;\n"
+  "    if (t > 0 && t < plane_t) {\n"
+  "      plane_t = t;\n"
+  "      plane = i;\n"
+  "    }\n"
+  "  }\n"
+  "\n"
+  "  ulong mask = 0;\n"
+  "  if ((sphere < 0 && plane < 0) || num_lights == 0) {\n"
+  "    shadows_out[index] = mask;\n"
+  "    return;\n"
+  "  }\n"
+  "\n"
+  "  // The surface point and normal, as shade_hit() finds them.\n"
+  "  double t = plane < 0 || (sphere >= 0 && best_t <= plane_t) ? best_t : plane_t;\n"
+  "  double point[3], normal[3];\n"
+  "  for (int k = 0; k < 3; k++) {\n"
+  "    point[k] = origin[k] + t * direction[k];\n"
+  "  }\n"
+  "  if (plane < 0 || (sphere >= 0 && best_t <= plane_t)) {\n"
+  "    double r = sqrt(sphere_r2[sphere]);\n"
+  "    normal[0] = (point[0] - sphere_cx[sphere]) / r;\n"
+  "    normal[1] = (point[1] - sphere_cy[sphere]) / r;\n"
+  "    normal[2] = (point[2] - sphere_cz[sphere]) / r;\n"
+  "  }\n"
+  "  else {\n"
+  "    normal[0] = planes[plane * 5];\n"
+  "    normal[1] = planes[plane * 5 + 1];\n"
+  "    normal[2] = planes[plane * 5 + 2];\n"
+  "  }\n"
+  "  if (dot3(normal, direction) > 0) {\n"
+  "    normal[0] = -normal[0];\n"
+  "    normal[1] = -normal[1];\n"
+  "    normal[2] = -normal[2];\n"
+  "  }\n"
+  "\n"
+  "  // The shadow ray toward each light that shade() would test.  Each light\n"
+  "  // is stored as its position, spot direction, cos_theta and whether it is\n"
+  "  // a spot light.\n"
+  "  for (int l = 0; l < num_lights; l++) {\n"
+  "    __global const double* light = &lights[l * 8];\n"
+  "    double to_light[3];\n"
+  "    for (int k = 0; k < 3; k++) {\n"
+  "      to_light[k] = light[k] - point[k];\n"
+  "    }\n"
+  "    double distance = sqrt(dot3(to_light, to_light));\n"
+  "    for (int k = 0; k < 3; k++) {\n"
+  "      to_light[k] /= distance;\n"
+  "    }\n"
+  "    if (dot3(normal, to_light) <= 0) {\n"
+  "      continue;\n"
+  "    }\n"
+  "    if (light[7] != 0) {\n"
+  "      double cos_alpha = -(light[3]*to_light[0] + light[4]*to_light[1] + light[5]*to_light[2]);\n"
+  "      if (cos_alpha < light[6]) {\n"
+  "        continue;\n"
+  "      }\n"
+  "    }\n"
+  "\n"
+  "    double shadow_origin[3], inv_light[3];\n"
+  "    for (int k = 0; k < 3; k++) {\n"
+  "      shadow_origin[k] = point[k] + normal[k] * SHADOW_EPSILON;\n"
+  "      inv_light[k] = 1 / to_light[k];\n"
+  "    }\n"
+  "\n"
+  "    // Any sphere in the way, like sphere_occluded(), then any plane.\n"
+  "    bool blocked = false;\n"
+  "    top = 0;\n"
+  "    if (bvh_nodes > 0) {\n"
+  "      stack[top++] = 0;\n"
+  "    }\n"
+  "    while (top > 0 && !blocked) {\n"
+  "      __global const BVHNode* node = &bvh[stack[--top]];\n"
+  "\n"
+  "      if (hit_box(node, shadow_origin, inv_light, distance) == INFINITY) {\n"
+  "        continue;\n"
+  "      }\n"
+  "      if (node->count == 0) {\n"
+  "        stack[top++] = node->first + 1;\n"
+  "        stack[top++] = node->first;\n"
+  "        continue;\n"
+  "      }\n"
+  "      for (int i = node->first; i < node->first + node->count && !blocked; i++) {\n"
+  "        double ox = shadow_origin[0] - sphere_cx[i];\n"
+  "        double oy = shadow_origin[1] - sphere_cy[i];\n"
+  "        double oz = shadow_origin[2] - sphere_cz[i];\n"
+  "        double b = to_light[0]*ox + to_light[1]*oy + to_light[2]*oz;\n"
+  "        double c = ox*ox + oy*oy + oz*oz - sphere_r2[i];\n"
+  "        double det = b*b - c;\n"
+  "        if (det < 0) {\n"
+  "          continue;\n"
+  "        }\n"
+  "        det = sqrt(det);\n"
+  "        double t = -b - det;\n"
+  "        if (t <= 0) {\n"
+  "          t = -b + det;\n"
+  "        }\n"
+  "        blocked = t > 0 && t < distance;\n"
+  "      }\n"
+  "    }\n"
+  "    for (int i = 0; i < num_planes && !blocked; i++) {\n"
+  "      __global const double* p = &planes[i * 5];\n"
+  "      double a = p[0] * to_light[0] + p[1] * to_light[1] + p[2] * to_light[2];\n"
+  "      double d = p[3] - (p[0] * shadow_origin[0] + p[1] * shadow_origin[1] +\n"
+  "                         p[2] * shadow_origin[2]);\n"
+  "      double t = d / a;\n"
+  "      blocked = t > 0 && t < distance;\n"
+  "    }\n"
+  "    if (blocked) {\n"
+  "      mask |= (ulong)1 << l;\n"
+  "    }\n"
+  "  }\n"
+  "  shadows_out[index] = mask;\n"
+  "}\n";
+
+#define GPU_BAND_PIXELS (1 << 20)
+
+// gpu_buffer() creates a read-only device buffer holding a copy of the
+// size bytes at data.  OpenCL has no empty buffers, so an empty array gets
+// a buffer of one unused double.
+
+cl_mem gpu_buffer (cl_context context, void* data, size_t size, cl_int* status) {
+  static double unused;
+
+  if (size == 0) {
+    data = &unused;
+    size = sizeof(unused);
+  }
+  return clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, size, data, status);
+}
+
+// find_gpu() finds the first GPU, on any OpenCL platform, that does double
+// precision arithmetic, which the kernel needs to find the same hits as the
+// CPU.  Its name is stored in name.
+
+bool find_gpu (cl_device_id* device, char* name, size_t size) {
+  cl_platform_id platforms[16];
+  cl_uint num_platforms = 0;
+
+  if (clGetPlatformIDs(16, platforms, &num_platforms) != CL_SUCCESS) {
+    return false;
+  }
+  for (cl_uint p = 0; p < num_platforms && p < 16; p++) {
+    cl_device_id devices[16];
+    cl_uint num_devices = 0;
+
+    if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_GPU, 16, devices, &num_devices) != CL_SUCCESS) {
+      continue;
+    }
+    for (cl_uint d = 0; d < num_devices && d < 16; d++) {
+      cl_device_fp_config fp64 = 0;
+      clGetDeviceInfo(devices[d], CL_DEVICE_DOUBLE_FP_CONFIG, sizeof(fp64), &fp64, NULL);
+      if (fp64 != 0) {
+        *device = devices[d];
+        clGetDeviceInfo(devices[d], CL_DEVICE_NAME, size, name, NULL);
+        name[size - 1] = 0;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// run_gpu_trace() uploads scene to device, runs the trace kernel on every
+// pixel and reads the hits and shadow masks back into hits.  It returns
+// the first OpenCL error, or CL_SUCCESS.
+
+cl_int run_gpu_trace (cl_device_id device, Scene* scene, int width, int height, GBuffer* hits) {
+  cl_int status;
+  cl_context context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+  if (status != CL_SUCCESS) {
+    return status;
+  }
+  cl_command_queue queue = clCreateCommandQueue(context, device, 0, &status);
+  cl_program program = NULL;
+  cl_kernel kernel = NULL;
+
+  if (status == CL_SUCCESS) {
+    char flags[128];
+    snprintf(flags, sizeof(flags), "-DBVH_STACK_SIZE=%d -DSHADOW_EPSILON=%.17g",
+             BVH_STACK_SIZE, SHADOW_EPSILON);
+    program = clCreateProgramWithSource(context, 1, &gpu_kernel_source, NULL, &status);
+    if (status == CL_SUCCESS) {
+      status = clBuildProgram(program, 1, &device, flags, NULL, NULL);
+    }
+    if (status == CL_SUCCESS) {
+      kernel = clCreateKernel(program, "trace", &status);
+    }
+  }
+
+  // Planes and lights go over as a few doubles each, rather than as the
+  // scene's separate arrays and Light structs.
+  int num_lights = scene->num_lights < GBUFFER_MAX_LIGHTS ? scene->num_lights : GBUFFER_MAX_LIGHTS;
+  double* planes = malloc(sizeof(double) * ((size_t)scene->num_planes * 5 + 1));
+  double* lights = malloc(sizeof(double) * ((size_t)num_lights * 8 + 1));
+  if (planes == NULL || lights == NULL) {
+    fprintf(stderr, "Error: Unable to allocate the GPU scene.\n");
+    exit(1);
+  }
+  double camera[5] = {scene->baked_origin[0], scene->baked_origin[1], scene->baked_origin[2],
+                      scene->view_width, scene->view_height};
+
+  for (int i = 0; i < scene->num_planes; i++) {
+    planes[i * 5] = scene->plane_nx[i];
+    planes[i * 5 + 1] = scene->plane_ny[i];
+    planes[i * 5 + 2] = scene->plane_nz[i];
+    planes[i * 5 + 3] = scene->plane_d[i];
+    planes[i * 5 + 4] = scene->plane_num[i];
+  }
+  for (int i = 0; i < num_lights; i++) {
+    Light* light = &scene->lights[i];
+    memcpy(&lights[i * 8], light->position, sizeof(double) * 3);
+    memcpy(&lights[i * 8 + 3], light->direction, sizeof(double) * 3);
+    lights[i * 8 + 6] = light->cos_theta;
+    lights[i * 8 + 7] = light->spot;
+  }
+
+  size_t slots = (size_t)scene->sphere_slots * sizeof(double);
+  double* inputs[8] = {scene->sphere_ox, scene->sphere_oy, scene->sphere_oz, scene->sphere_c,
+                       scene->sphere_cx, scene->sphere_cy, scene->sphere_cz, scene->sphere_r2};
+  cl_mem buffers[15] = {NULL};
+  int num_buffers = 0;
+
+  if (status == CL_SUCCESS) {
+    size_t size = scene->bvh != NULL ? sizeof(BVHNode) * scene->bvh_nodes : 0;
+    buffers[num_buffers++] = gpu_buffer(context, scene->bvh, size, &status);
+  }
+  for (int i = 0; i < 8 && status == CL_SUCCESS; i++) {
+    buffers[num_buffers++] = gpu_buffer(context, inputs[i], slots, &status);
+  }
+  if (status == CL_SUCCESS) {
+    buffers[num_buffers++] = gpu_buffer(context, planes, sizeof(double) * scene->num_planes * 5,
+                                        &status);
+  }
+  if (status == CL_SUCCESS) {
+    buffers[num_buffers++] = gpu_buffer(context, lights, sizeof(double) * num_lights * 8,
+                                        &status);
+  }
+  if (status == CL_SUCCESS) {
+    buffers[num_buffers++] = gpu_buffer(context, camera, sizeof(camera), &status);
+  }
+
+  size_t pixels = (size_t)width * height;
+  size_t band = pixels < GPU_BAND_PIXELS ? pixels : GPU_BAND_PIXELS;
+  size_t output_size[3] = {sizeof(int32_t), sizeof(double), sizeof(uint64_t)};
+  for (int i = 0; i < 3 && status == CL_SUCCESS; i++) {
+    buffers[num_buffers++] = clCreateBuffer(context, CL_MEM_WRITE_ONLY, band * output_size[i],
+                                            NULL, &status);
+  }
+
+  // The buffers above, and the scalars, in the order the kernel takes them.
+  static const int buffer_args[15] = {0, 2, 3, 4, 5, 6, 7, 8, 9, 10, 12, 14, 18, 19, 20};
+  static const int int_args[5] = {1, 11, 13, 15, 16};
+  cl_int ints[5] = {scene->bvh != NULL ? scene->bvh_nodes : 0, scene->num_planes, num_lights,
+                    width, height};
+  for (int i = 0; i < 15 && status == CL_SUCCESS; i++) {
+    status = clSetKernelArg(kernel, buffer_args[i], sizeof(cl_mem), &buffers[i]);
+  }
+  for (int i = 0; i < 5 && status == CL_SUCCESS; i++) {
+    status = clSetKernelArg(kernel, int_args[i], sizeof(cl_int), &ints[i]);
+  }
+
+  // The image goes through in bands of pixels, so the output buffers stay
+  // small and no single launch runs long enough to trip a display watchdog.
+  void* outputs[3] = {hits->sphere, hits->t, hits->shadows};
+  for (size_t first = 0; first < pixels && status == CL_SUCCESS; first += band) {
+    size_t count = pixels - first < band ? pixels - first : band;
+    cl_long offset = first;
+
+    status = clSetKernelArg(kernel, 17, sizeof(cl_long), &offset);
+    if (status == CL_SUCCESS) {
+      status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &count, NULL, 0, NULL, NULL);
+    }
+    for (int i = 0; i < 3 && status == CL_SUCCESS; i++) {
+      status = clEnqueueReadBuffer(queue, buffers[12 + i], CL_TRUE, 0, count * output_size[i],
+                                   (char*)outputs[i] + first * output_size[i], 0, NULL, NULL);
+    }
+  }
+
+  for (int i = 0; i < num_buffers; i++) {
+    clReleaseMemObject(buffers[i]);
+  }
+  free(planes);
+  free(lights);
+  if (kernel != NULL) {
+    clReleaseKernel(kernel);
+  }
+  if (program != NULL) {
+    clReleaseProgram(program);
+  }
+  if (queue != NULL) {
+    clReleaseCommandQueue(queue);
+  }
+  clReleaseContext(context);
+  return status;
+}
+
+#endif
+
+// trace_on_gpu() traces the primary ray of every pixel of a width by height
+// render of scene, and the shadow rays from where it lands, on a GPU, and
+// stores the results in hits as a valid G-buffer for the render to replay.
+// It returns false, after a warning, if there is no usable GPU, so the
+// render falls back to tracing on the CPU.  The per-pixel work the CPU has
+// left is shading and the tests against planes.
+
+bool trace_on_gpu (Scene* scene, int width, int height, GBuffer* hits, bool stats) {
+#ifdef RAYCAST_OPENCL
+  size_t pixels = (size_t)width * height;
+  cl_device_id device;
+  char name[256];
+
+  if (scene->bricks != NULL) {
+    fprintf(stderr, "Warning: Streamed scenes cannot be traced on the GPU; using the CPU.\n");
+    return false;
+  }
+  if (!find_gpu(&device, name, sizeof(name))) {
+    fprintf(stderr, "Warning: No OpenCL GPU with double precision found; using the CPU.\n");
+    return false;
+  }
+
+  double start = now_seconds();
+  memset(hits, 0, sizeof(GBuffer));
+  hits->sphere = malloc(sizeof(int32_t) * pixels);
+  hits->t = malloc(sizeof(double) * pixels);
+  hits->shadows = malloc(sizeof(uint64_t) * pixels);
+  if (hits->sphere == NULL || hits->t == NULL || hits->shadows == NULL) {
+    fprintf(stderr, "Error: Unable to allocate a %dx%d G-buffer.\n", width, height);
+    exit(1);
+  }
+
+  cl_int status = run_gpu_trace(device, scene, width, height, hits);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Warning: OpenCL error %d on \"%s\"; using the CPU.\n", status, name);
+    free(hits->sphere);
+    free(hits->t);
+    free(hits->shadows);
+    return false;
+  }
+  hits->valid = true;
+  hits->shadows_valid = true;
+
+  if (stats) {
+    fprintf(stderr, "GPU: %.3f ms tracing primary and shadow rays on \"%s\"\n",
+            (now_seconds() - start) * 1e3, name);
+  }
+  return true;
+#else
+  (void)scene;
+  (void)width;
+  (void)height;
+  (void)hits;
+  (void)stats;
+  fprintf(stderr, "Warning: raycast was built without OpenCL (make OPENCL=1); using the CPU.\n");
+  return false;
+#endif
+}
+
+// write_heatmap() writes the per-pixel cost of a render as a P6 ppm.  Costs
+// are scaled to the most expensive pixel and colored from black through
+// blue, red and yellow to white.  It returns the largest cost.
+
+float write_heatmap (char* filename, float* cost, int width, int height) {
+  static const double ramp[5][3] = {{0, 0, 0}, {0, 0, 1}, {1, 0, 0}, {1, 1, 0}, {1, 1, 1}};
+  size_t pixels = (size_t)width * height;
+  uint8_t* image = malloc(pixels * 3);
+  float max_cost = 0;
+
+  if (image == NULL) {
+    fprintf(stderr, "Error: Unable to allocate a %dx%d heatmap.\n", width, height);
+    exit(1);
+  }
+
+  for (size_t i = 0; i < pixels; i++) {
+    if (cost[i] > max_cost) {
+      max_cost = cost[i];
+    }
+  }
+
+  for (size_t i = 0; i < pixels; i++) {
+    double v = max_cost > 0 ? cost[i] / max_cost * 4 : 0;
+    int stop = v >= 4 ? 3 : (int)v;
+    double f = v - stop;
+    for (int k = 0; k < 3; k++) {
+      image[i * 3 + k] = clamp_color(ramp[stop][k] * (1 - f) + ramp[stop + 1][k] * f);
+    }
+  }
+
+  write_p6(filename, image, width, height);
+  free(image);
+  return max_cost;
+}
+
+// Images may be up to MAX_IMAGE_SIZE pixels wide and high.
+
+#define MAX_IMAGE_SIZE 65536
+
+// Options holds everything given on the command line.
+
+typedef struct {
+  int num_threads;
+  bool stats;
+  bool ascii;
+  bool use_mmap;
+  bool packets;
+  bool progressive;
+  bool gpu;
+  bool numa_replicate;
+  int bench_iterations;
+  char* heatmap;
+  char* serve;
+  char* animation;
+  char* gbuffer;
+  char* nodes;
+  int node_port;
+  char* node_address;
+  size_t mem_budget;
+  int aa_samples;
+  double aa_threshold;
+  int width;
+  int height;
+  char* input;
+  char* output;
+} Options;
+
+// The phases of rendering a scene file, timed separately by --stats and
+// --bench.
+
+typedef enum {
+  PHASE_PARSE,
+  PHASE_COMPILE,
+  PHASE_BVH,
+  PHASE_RENDER,
+  PHASE_WRITE,
+  NUM_PHASES
+} Phase;
+
+const char* phase_names[NUM_PHASES] = {"parse", "compile", "bvh_build", "render", "write"};
+
+typedef struct {
+  double phase[NUM_PHASES];
+  long rays;
+  Counters counters;
+} FrameTimes;
+
+// compile_scene_file() reads a JSON scene, compiles it, builds its BVH and
+// bakes it for the camera, and writes the result as a compiled scene.
+
+void compile_scene_file (Options* options) {
+  int num_objects;
+  Object* objects = read_scene(options->input, &num_objects, options->num_threads);
+  Scene scene;
+
+  compile_scene(objects, num_objects, &scene);
+  free(objects);
+  build_bvh(&scene, options->num_threads);
+
+  double camera[3] = {0, 0, 0};
+  bake_scene(&scene, camera);
+  write_compiled_scene(options->output, &scene);
+
+  if (options->stats) {
+    fprintf(stderr, "Compiled %d spheres, %d planes, %d lights and %d BVH nodes\n",
+            scene.num_spheres, scene.num_planes, scene.num_lights, scene.bvh_nodes);
+  }
+  free_scene(&scene);
+}
+
+// SceneCounts counts the objects of each type in a validated scene.
+
+typedef struct {
+  int spheres;
+  int planes;
+  int lights;
+} SceneCounts;
+
+void count_object (Object* object, void* context) {
+  SceneCounts* counts = context;
+
+  if (object->type == SPHERE) {
+    counts->spheres += 1;
+  }
+  else if (object->type == PLANE) {
+    counts->planes += 1;
+  }
+  else if (object->type == LIGHT) {
+    counts->lights += 1;
+  }
+}
+
+// validate_scene() checks a scene file against the rules read_scene() and
+// compile_scene() enforce, and prints every error in it to stderr, one per
+// line, instead of stopping at the first.  The file is streamed through
+// one parsing window and the objects are only counted, so nothing is kept
+// in memory and no render state is set up.  A compiled scene only has its
+// header checked.  It returns the number of errors.
+
+int validate_scene (char* filename) {
+  SceneCounts counts = {0, 0, 0};
+
+  if (is_compiled_scene(filename)) {
+    Scene scene;
+    if (!load_compiled_scene(filename, &scene)) {
+      printf("%s: 1 error\n", filename);
+      return 1;
+    }
+    printf("%s: ok, compiled scene with %d spheres, %d planes and %d lights\n", filename,
+           scene.num_spheres, scene.num_planes, scene.num_lights);
+    free_scene(&scene);
+    return 0;
+  }
+
+  JsonFile* json = open_json_stream(filename);
+  Validation checks;
+  volatile bool listed = false;
+  volatile bool done = false;
+
+  checks.filename = filename;
+  checks.errors = 0;
+  checks.cameras = 0;
+  validation = &checks;
+  while (!done) {
+    if (setjmp(checks.resync) == 0) {
+      if (!listed) {
+        start_list(json);
+        listed = true;
+      }
+      parse_objects(json, NULL, count_object, &counts);
+      done = true;
+    }
+    else if (!listed || !skip_to_object(json)) {
+      done = true;
+    }
+  }
+  if (checks.cameras == 0) {
+    scene_error("Error: The scene does not contain a camera.\n");
+  }
+  validation = NULL;
+  close_json(json);
+
+  if (checks.errors > 0) {
+    printf("%s: %d error%s\n", filename, checks.errors, checks.errors == 1 ? "" : "s");
+  }
+  else {
+    printf("%s: ok, %d spheres, %d planes and %d lights\n", filename,
+           counts.spheres, counts.planes, counts.lights);
+  }
+  return checks.errors;
+}
+
+// write_preview() is the preview callback of a progressive render.  It
+// writes the partly refined image out so it can be looked at while the
+// render goes on.  A file is written beside the output and renamed over
+// it, so readers never see a half-written image; on stdout the frames
+// simply follow each other, in the same format as the final one.
+
+void write_preview (RenderJob* job, void* context) {
+  Options* options = context;
+
+  if (strcmp(options->output, "-") == 0) {
+    if (options->ascii) {
+      write_p3(options->output, job->framebuffer, job->width, job->height);
+    }
+    else {
+      write_p6(options->output, job->framebuffer, job->width, job->height);
+    }
+    return;
+  }
+
+  size_t length = strlen(options->output) + 5;
+  char temporary[length];
+  snprintf(temporary, length, "%s.tmp", options->output);
+  if (is_png(options->output)) {
+    write_png(temporary, job->framebuffer, job->width, job->height);
+  }
+  else if (options->ascii) {
+    write_p3(temporary, job->framebuffer, job->width, job->height);
+  }
+  else {
+    write_p6(temporary, job->framebuffer, job->width, job->height);
+  }
+  if (rename(temporary, options->output) != 0) {
+    fprintf(stderr, "Error: Unable to replace output file \"%s\".\n", options->output);
+    exit(1);
+  }
+}
+
+// sync_preview() is the preview callback for a mapped output, which shows
+// every pixel as soon as it is written.  It only starts pushing the image
+// towards the disk.
+
+void sync_preview (RenderJob* job, void* context) {
+  MappedFile* file = context;
+
+  (void)job;
+  msync(file->map, file->length, MS_ASYNC);
+}
+
+// load_scene() reads the input scene, compiles it and builds its BVH, or
+// maps it in if it is a compiled scene, and bakes it for a camera at the
+// origin.  The time taken by each phase is stored in times.
+
+void load_scene (Options* options, Scene* scene, FrameTimes* times) {
+  double start = now_seconds();
+  int num_objects = 0;
+  double parsed, compiled, built;
+
+  // A compiled scene is already parsed, compiled and built, and is baked
+  // for the camera too unless it has moved.
+  if (is_compiled_scene(options->input)) {
+    if (!load_compiled_scene(options->input, scene)) {
+      exit(1);
+    }
+    parsed = compiled = built = now_seconds();
+  }
+  else if (options->mem_budget > 0) {
+    StreamedScene streamed;
+    stream_scene(options->input, &streamed);
+    num_objects = streamed.objects.count + streamed.num_spheres;
+    parsed = now_seconds();
+
+    compile_scene(streamed.objects.data, streamed.objects.count, scene);
+    free(streamed.objects.data);
+    compiled = now_seconds();
+
+    scene->bricks = build_bricks(streamed.spheres, streamed.num_spheres, streamed.min,
+                                 streamed.max, options->mem_budget, options->num_threads);
+    built = now_seconds();
+  }
+  else {
+    Object* objects = read_scene(options->input, &num_objects, options->num_threads);
+    parsed = now_seconds();
+
+    compile_scene(objects, num_objects, scene);
+    free(objects);
+    compiled = now_seconds();
+
+    build_bvh(scene, options->num_threads);
+    built = now_seconds();
+  }
+
+  double camera[3] = {0, 0, 0};
+  if (scene->plane_num == NULL || memcmp(scene->baked_origin, camera, sizeof(camera)) != 0) {
+    bake_scene(scene, camera);
+  }
+  double baked = now_seconds();
+
+  times->phase[PHASE_PARSE] = parsed - start;
+  times->phase[PHASE_COMPILE] = (compiled - parsed) + (baked - built);
+  times->phase[PHASE_BVH] = built - compiled;
+
+  if (options->stats) {
+    if (scene->mapping != NULL) {
+      fprintf(stderr, "Load: %.3f ms, compiled scene of %zu bytes\n",
+              times->phase[PHASE_PARSE] * 1e3, scene->mapping_size);
+    }
+    else {
+      fprintf(stderr, "Parse: %.3f ms, %d objects\n", times->phase[PHASE_PARSE] * 1e3, num_objects);
+    }
+    fprintf(stderr, "Compile: %.3f ms, %d spheres, %d planes, %d lights\n",
+            times->phase[PHASE_COMPILE] * 1e3, scene->num_spheres, scene->num_planes,
+            scene->num_lights);
+    if (scene->bricks != NULL) {
+      fprintf(stderr, "BVH build: %.3f ms on %d threads, %zu bricks of up to %ld spheres\n",
+              times->phase[PHASE_BVH] * 1e3, options->num_threads, scene->bricks->bricks.count,
+              scene->bricks->spheres_per_brick);
+    }
+    else {
+      fprintf(stderr, "BVH build: %.3f ms on %d threads, %d nodes\n",
+              times->phase[PHASE_BVH] * 1e3, options->num_threads, scene->bvh_nodes);
+    }
+    fprintf(stderr, "Scene ready to render: %.3f ms\n", (baked - start) * 1e3);
+  }
+}
+
+// unload_scene() frees a scene loaded by load_scene().
+
+void unload_scene (Options* options, Scene* scene) {
+  BrickStore* bricks = scene->bricks;
+
+  if (bricks != NULL) {
+    if (options->stats) {
+      fprintf(stderr, "Bricks: %ld loads, at most %.1f MB resident of a %.1f MB budget\n",
+              bricks->loads, bricks->peak_size / 1048576.0, bricks->budget / 1048576.0);
+    }
+    free_bricks(bricks);
+  }
+  free_scene(scene);
+}
+
+// render_scene_file() runs the whole pipeline once: it reads the input
+// scene, compiles it, builds the BVH, renders it and writes the output
+// image.  The time taken by each phase is stored in times.
+
+void render_scene_file (Options* options, FrameTimes* times) {
+  int width = options->width;
+  int height = options->height;
+  bool use_mmap = options->use_mmap;
+  Scene scene;
+
+  load_scene(options, &scene, times);
+
+  RenderJob job;
+  job.scene = &scene;
+  job.width = width;
+  job.height = height;
+  job.packets = options->packets;
+  job.aa_samples = options->aa_samples;
+  job.aa_threshold = options->aa_threshold;
+  job.base_color = NULL;
+  job.object = NULL;
+  job.first_tile = 0;
+  job.tile_count = 0;
+  job.gbuffer = NULL;
+  job.progressive = options->progressive;
+  job.stride = 1;
+  job.done_stride = 0;
+  job.replicas = NULL;
+  if (options->numa_replicate) {
+    double start = now_seconds();
+    job.replicas = replicate_scene(&scene);
+    double replicated = now_seconds() - start;
+    times->phase[PHASE_COMPILE] += replicated;
+    if (options->stats) {
+      fprintf(stderr, "NUMA: replicated the scene on %d nodes in %.3f ms\n", numa->num_nodes,
+              replicated * 1e3);
+    }
+  }
+  if (job.aa_samples > 1) {
+    job.base_color = malloc(sizeof(float) * 3 * width * height);
+    job.object = malloc(sizeof(long) * width * height);
+    if (job.base_color == NULL || job.object == NULL) {
+      fprintf(stderr, "Error: Unable to allocate %dx%d anti-aliasing buffers.\n", width, height);
+      exit(1);
+    }
+  }
+  job.cost = NULL;
+  if (options->heatmap != NULL) {
+    job.cost = malloc(sizeof(float) * width * height);
+    if (job.cost == NULL) {
+      fprintf(stderr, "Error: Unable to allocate a %dx%d heatmap.\n", width, height);
+      exit(1);
+    }
+  }
+
+  bool png = is_png(options->output);
+  if (!options->ascii && !png && strcmp(options->output, "-") != 0 &&
+      (size_t)width * height * 3 >= MMAP_THRESHOLD) {
+    use_mmap = true;
+  }
+
+  MappedFile output;
+  job.preview = NULL;
+  if (use_mmap) {
+    job.framebuffer = map_p6(options->output, width, height, &output);
+    if (options->progressive) {
+      job.preview = sync_preview;
+      job.preview_context = &output;
+    }
+  }
+  else {
+    job.framebuffer = malloc((size_t)width * height * 3);
+    if (options->progressive) {
+      job.preview = write_preview;
+      job.preview_context = options;
+    }
+  }
+  if (job.framebuffer == NULL) {
+    fprintf(stderr, "Error: Unable to allocate a %dx%d framebuffer.\n", width, height);
+    exit(1);
+  }
+
+  // A PNG is compressed band by band as the render finishes them, except
+  // in a progressive render, whose previews keep replacing the file.
+  PngWriter png_writer;
+  job.finished = NULL;
+  if (png && !options->progressive) {
+    if (!start_png(&png_writer, options->output, job.framebuffer, width, height)) {
+      fprintf(stderr, "Error: Unable to open output file \"%s\".\n", options->output);
+      exit(1);
+    }
+    job.finished = png_tile_finished;
+    job.finished_context = &png_writer;
+  }
+
+  GBuffer gbuffer;
+  if (options->gpu && trace_on_gpu(&scene, width, height, &gbuffer, options->stats)) {
+    job.gbuffer = &gbuffer;
+  }
+  if (options->gbuffer != NULL) {
+    open_gbuffer(options->gbuffer, &gbuffer, &scene, width, height);
+    job.gbuffer = &gbuffer;
+    if (options->stats) {
+      fprintf(stderr, "G-buffer: %s hits and %s shadows of \"%s\"\n",
+              gbuffer.valid ? "replaying" : "recording",
+              gbuffer.shadows_valid ? "replaying" : "recording", options->gbuffer);
+    }
+  }
+
+  double render_start = now_seconds();
+  render(&job, options->num_threads, options->stats);
+  double rendered = now_seconds();
+
+  if (options->gbuffer != NULL) {
+    close_gbuffer(options->gbuffer, &gbuffer, width, height);
+  }
+  else if (job.gbuffer != NULL) {
+    free(gbuffer.sphere);
+    free(gbuffer.t);
+    free(gbuffer.shadows);
+  }
+  if (job.replicas != NULL) {
+    free_replicas(job.replicas);
+  }
+
+  if (use_mmap) {
+    unmap_p6(&output);
+  }
+  else {
+    if (job.finished != NULL) {
+      if (!finish_png(&png_writer)) {
+        fprintf(stderr, "Error: Unable to write output file \"%s\".\n", options->output);
+        exit(1);
+      }
+    }
+    else if (png) {
+      write_png(options->output, job.framebuffer, width, height);
+    }
+    else if (options->ascii) {
+      write_p3(options->output, job.framebuffer, width, height);
+    }
+    else {
+      write_p6(options->output, job.framebuffer, width, height);
+    }
+    free(job.framebuffer);
+  }
+  double written = now_seconds();
+
+  if (job.cost != NULL) {
+    float max_cost = write_heatmap(options->heatmap, job.cost, width, height);
+    if (options->stats) {
+      fprintf(stderr, "Heatmap: white is %.0f tests per pixel\n", max_cost);
+    }
+    free(job.cost);
+  }
+
+  times->phase[PHASE_RENDER] = rendered - render_start;
+  times->phase[PHASE_WRITE] = written - rendered;
+  times->rays = (long)width * height;
+  times->counters = job.counters;
+  free(job.base_color);
+  free(job.object);
+
+  unload_scene(options, &scene);
+}
+
+// A render server keeps one scene loaded, with its BVH built, and renders
+// a stream of requests against it, so a camera fly-through pays for loading
+// the scene only once.  Each request is a line
+//
+//     width height output.ppm [x y z]
+//
+// asking for a width by height P6 image seen from a camera at (x, y, z),
+// the origin by default.  Every request is answered, in order, by a line
+// "ok output.ppm render_ms write_ms" or "error message".  Blank lines and
+// lines starting with '#' are skipped, and "quit" stops the server.
+//
+// Finished frames are handed to a writer thread, so writing frame N to disk
+// overlaps rendering frame N+1.  The two alternate between a pair of
+// framebuffers, and a frame is only handed over once the writer is done
+// with the one before it.
+
+#define SERVER_LINE 4096
+
+typedef struct {
+  Options* options;
+  Scene* scene;
+  uint8_t* framebuffer[2];
+  size_t capacity[2];
+  int next;
+  float* base_color;
+  long* object;
+  size_t aa_capacity;
+
+  // The frame handed to the writer thread, guarded by lock.
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  bool pending;
+  bool quit;
+  FILE* reply;
+  uint8_t* frame;
+  int width;
+  int height;
+  char output[SERVER_LINE];
+  double render_time;
+} RenderServer;
+
+// frame_writer() is the writer thread of a render server.  It writes each
+// frame it is handed to its output file and answers its request, if it
+// came with a reply stream.
+
+void* frame_writer (void* context) {
+  RenderServer* server = context;
+
+  pthread_mutex_lock(&server->lock);
+  while (true) {
+    while (!server->pending && !server->quit) {
+      pthread_cond_wait(&server->changed, &server->lock);
+    }
+    if (!server->pending) {
+      break;
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    double start = now_seconds();
+    bool written;
+    if (is_png(server->output)) {
+      written = save_png(server->output, server->frame, server->width, server->height);
+    }
+    else {
+      char header[64];
+      struct iovec iov[2];
+      iov[0].iov_base = header;
+      iov[0].iov_len = snprintf(header, sizeof(header), "P6\n%d %d\n255\n",
+                                server->width, server->height);
+      iov[1].iov_base = server->frame;
+      iov[1].iov_len = (size_t)server->width * server->height * 3;
+
+      int fd = open(server->output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      written = fd >= 0 && write_all(fd, iov, 2);
+      if (fd >= 0 && close(fd) != 0) {
+        written = false;
+      }
+    }
+    if (server->reply == NULL) {
+      if (!written) {
+        fprintf(stderr, "Error: Unable to write output file \"%s\".\n", server->output);
+        exit(1);
+      }
+    }
+    else {
+      if (written) {
+        fprintf(server->reply, "ok %s %.3f %.3f\n", server->output, server->render_time * 1e3,
+                (now_seconds() - start) * 1e3);
+      }
+      else {
+        fprintf(server->reply, "error Unable to write output file \"%s\".\n", server->output);
+      }
+      fflush(server->reply);
+    }
+
+    pthread_mutex_lock(&server->lock);
+    server->pending = false;
+    pthread_cond_broadcast(&server->changed);
+  }
+  pthread_mutex_unlock(&server->lock);
+  return NULL;
+}
+
+// start_server() sets up a render server for scene and starts its writer
+// thread.
+
+void start_server (RenderServer* server, Options* options, Scene* scene) {
+  memset(server, 0, sizeof(*server));
+  server->options = options;
+  server->scene = scene;
+  pthread_mutex_init(&server->lock, NULL);
+  pthread_cond_init(&server->changed, NULL);
+  if (pthread_create(&server->writer, NULL, frame_writer, server) != 0) {
+    fprintf(stderr, "Error: Unable to create writer thread.\n");
+    exit(1);
+  }
+}
+
+// stop_server() lets the writer thread finish the last frame and frees the
+// server.
+
+void stop_server (RenderServer* server) {
+  pthread_mutex_lock(&server->lock);
+  server->quit = true;
+  pthread_cond_broadcast(&server->changed);
+  pthread_mutex_unlock(&server->lock);
+  pthread_join(server->writer, NULL);
+  pthread_mutex_destroy(&server->lock);
+  pthread_cond_destroy(&server->changed);
+
+  free(server->framebuffer[0]);
+  free(server->framebuffer[1]);
+  free(server->base_color);
+  free(server->object);
+}
+
+// wait_for_writer() waits until the writer thread has written the last
+// frame it was handed.
+
+void wait_for_writer (RenderServer* server) {
+  pthread_mutex_lock(&server->lock);
+  while (server->pending) {
+    pthread_cond_wait(&server->changed, &server->lock);
+  }
+  pthread_mutex_unlock(&server->lock);
+}
+
+// server_error() answers a request with an error.  It waits for the writer
+// first so the answers stay in the order of the requests.  Without a reply
+// stream, as when rendering an animation, the error is fatal.
+
+void server_error (RenderServer* server, FILE* reply, char* message) {
+  if (reply == NULL) {
+    fprintf(stderr, "Error: %s\n", message);
+    exit(1);
+  }
+  wait_for_writer(server);
+  fprintf(reply, "error %s\n", message);
+  fflush(reply);
+}
+
+// serve_frame() renders one request and hands the frame to the writer.
+
+void serve_frame (RenderServer* server, FILE* reply, int width, int height, char* output,
+                  double* camera) {
+  Options* options = server->options;
+  Scene* scene = server->scene;
+  int k = server->next;
+  size_t pixels = (size_t)width * height;
+
+  // The writer may still be busy with the other framebuffer, but never
+  // with this one.
+  if (pixels * 3 > server->capacity[k]) {
+    free(server->framebuffer[k]);
+    server->framebuffer[k] = malloc(pixels * 3);
+    server->capacity[k] = server->framebuffer[k] != NULL ? pixels * 3 : 0;
+  }
+  if (options->aa_samples > 1 && pixels > server->aa_capacity) {
+    free(server->base_color);
+    free(server->object);
+    server->base_color = malloc(sizeof(float) * 3 * pixels);
+    server->object = malloc(sizeof(long) * pixels);
+    server->aa_capacity = server->base_color != NULL && server->object != NULL ? pixels : 0;
+  }
+  if (server->capacity[k] == 0 || (options->aa_samples > 1 && server->aa_capacity == 0)) {
+    server_error(server, reply, "Unable to allocate the framebuffer.");
+    return;
+  }
+
+  if (memcmp(scene->baked_origin, camera, sizeof(double) * 3) != 0) {
+    bake_scene(scene, camera);
+  }
+
+  RenderJob job = {0};
+  job.scene = scene;
+  job.width = width;
+  job.height = height;
+  job.packets = options->packets;
+  job.framebuffer = server->framebuffer[k];
+  job.aa_samples = options->aa_samples;
+  job.aa_threshold = options->aa_threshold;
+  job.base_color = server->base_color;
+  job.object = server->object;
+  job.stride = 1;
+
+  double start = now_seconds();
+  render(&job, options->num_threads, options->stats);
+  double rendered = now_seconds();
+
+  wait_for_writer(server);
+  pthread_mutex_lock(&server->lock);
+  server->reply = reply;
+  server->frame = job.framebuffer;
+  server->width = width;
+  server->height = height;
+  strcpy(server->output, output);
+  server->render_time = rendered - start;
+  server->pending = true;
+  pthread_cond_broadcast(&server->changed);
+  pthread_mutex_unlock(&server->lock);
+
+  server->next = 1 - k;
+}
+
+// serve_session() answers the requests read from input until it runs out
+// or a "quit" request comes in, which makes it return true.
+
+bool serve_session (RenderServer* server, FILE* input, FILE* reply) {
+  char line[SERVER_LINE];
+  bool quit = false;
+
+  while (!quit && fgets(line, sizeof(line), input) != NULL) {
+    if (strchr(line, '\n') == NULL && !feof(input)) {
+      int c;
+      while ((c = fgetc(input)) != '\n' && c != EOF) {
+      }
+      server_error(server, reply, "Request is too long.");
+      continue;
+    }
+
+    char word[8];
+    if (sscanf(line, " %7s", word) != 1 || word[0] == '#') {
+      continue;
+    }
+    if (strcmp(word, "quit") == 0) {
+      quit = true;
+      continue;
+    }
+
+    int width, height;
+    char output[SERVER_LINE];
+    double camera[3] = {0, 0, 0};
+    char extra;
+    int fields = sscanf(line, "%d %d %4095s %lf %lf %lf %c", &width, &height, output,
+                        &camera[0], &camera[1], &camera[2], &extra);
+    if (fields != 3 && fields != 6) {
+      server_error(server, reply, "Expected \"width height output.ppm [x y z]\".");
+    }
+    else if (width < 1 || height < 1 || width > MAX_IMAGE_SIZE || height > MAX_IMAGE_SIZE) {
+      server_error(server, reply, "Invalid image size.");
+    }
+    else {
+      serve_frame(server, reply, width, height, output, camera);
+    }
+  }
+
+  wait_for_writer(server);
+  return quit;
+}
+
+// open_server_socket() creates a Unix domain socket listening at path.  A
+// socket left behind by an earlier server is replaced, any other file is
+// not.
+
+int open_server_socket (char* path) {
+  struct sockaddr_un address;
+  struct stat st;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Error: Socket path \"%s\" is too long.\n", path);
+    exit(1);
+  }
+  strcpy(address.sun_path, path);
+
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(listener, 8) != 0) {
+    fprintf(stderr, "Error: Unable to listen on socket \"%s\".\n", path);
+    exit(1);
+  }
+  return listener;
+}
+
+// run_server() loads the scene and serves requests for it, from stdin if
+// options->serve is "-" and otherwise from the clients of a Unix domain
+// socket at that path, one connection at a time, until one sends "quit".
+
+void run_server (Options* options) {
+  Scene scene;
+  FrameTimes times;
+  RenderServer server;
+
+  load_scene(options, &scene, &times);
+
+  start_server(&server, options, &scene);
+
+  if (strcmp(options->serve, "-") == 0) {
+    serve_session(&server, stdin, stdout);
+  }
+  else {
+    // A client that hangs up early must not take the server down with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    int listener = open_server_socket(options->serve);
+    bool quit = false;
+    while (!quit) {
+      int fd = accept(listener, NULL, NULL);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        fprintf(stderr, "Error: Unable to accept a connection on \"%s\".\n", options->serve);
+        exit(1);
+      }
+      FILE* input = fdopen(fd, "r");
+      FILE* reply = fdopen(dup(fd), "w");
+      if (input == NULL || reply == NULL) {
+        fprintf(stderr, "Error: Unable to open a connection on \"%s\".\n", options->serve);
+        exit(1);
+      }
+      quit = serve_session(&server, input, reply);
+      fclose(input);
+      fclose(reply);
+    }
+    close(listener);
+    unlink(options->serve);
+  }
+
+  stop_server(&server);
+  unload_scene(options, &scene);
+}
+
+// An animation file lists the frames of an animation as a JSON array of
+// objects like
+//
+//     {"output": "frame1.ppm", "camera": [0, 0, 0],
+//      "spheres": [{"index": 3, "position": [0, 1, 5]}, ...]}
+//
+// Each entry in "spheres" moves the sphere that is index-th (counting from
+// 0) in the scene file.  Spheres that are not mentioned, and the camera if
+// it is not given, stay where the previous frame left them.  Only the
+// output is required.
+//
+// Between frames the BVH is refit to the moved spheres rather than rebuilt.
+// Once refitting has made it BVH_REBUILD_RATIO times as expensive as when it
+// was built, by bvh_cost(), it is rebuilt from scratch instead.
+
+#define BVH_REBUILD_RATIO 1.5
+
+// parse_moves() parses the "spheres" list of a frame and moves the spheres
+// in it.  slot gives the current slot of every sphere.  It returns the
+// number of spheres moved.
+
+int parse_moves (JsonFile* json, Scene* scene, int* slot) {
+  int moved = 0;
+
+  expect_c(json, '[');
+  skip_ws(json);
+  if (peek_c(json) == ']') {
+    next_c(json);
+    return 0;
+  }
+
+  while (1) {
+    double index = -1;
+    double position[3];
+    bool position_given = false;
+
+    skip_ws(json);
+    expect_c(json, '{');
+    while (1) {
+      skip_ws(json);
+      char* key = next_string(json);
+      skip_ws(json);
+      expect_c(json, ':');
+      skip_ws(json);
+
+      if (strcmp(key, "index") == 0) {
+        index = next_number(json);
+      }
+      else if (strcmp(key, "position") == 0) {
+        next_vector(json, position);
+        position_given = true;
+      }
+      else {
+        fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n", key, line);
+        exit(1);
+      }
+
+      skip_ws(json);
+      int c = next_c(json);
+      if (c == '}') {
+        break;
+      }
+      if (c != ',') {
+        fprintf(stderr, "Error: Unexpected character '%c' on line %d.\n", c, line);
+        exit(1);
+      }
+    }
+
+    if (index < 0 || index >= scene->num_spheres || index != (int)index) {
+      fprintf(stderr, "Error: Sphere index missing or invalid on line %d.\n", line);
+      exit(1);
+    }
+    if (!position_given) {
+      fprintf(stderr, "Error: Sphere position not given on line %d.\n", line);
+      exit(1);
+    }
+
+    int s = slot[(int)index];
+    scene->sphere_cx[s] = position[0];
+    scene->sphere_cy[s] = position[1];
+    scene->sphere_cz[s] = position[2];
+    moved += 1;
+
+    skip_ws(json);
+    int c = next_c(json);
+    if (c == ']') {
+      return moved;
+    }
+    if (c != ',') {
+      fprintf(stderr, "Error: Unexpected character '%c' on line %d.\n", c, line);
+      exit(1);
+    }
+  }
+}
+
+// find_slots() fills in slot with the current slot of every sphere.
+
+void find_slots (Scene* scene, int* slot) {
+  for (int s = 0; s < scene->sphere_slots; s++) {
+    if (scene->sphere_index != NULL && scene->sphere_index[s] >= 0) {
+      slot[scene->sphere_index[s]] = s;
+    }
+  }
+}
+
+// run_animation() loads the scene once and renders every frame of the
+// animation file options->animation, writing each frame out on the writer
+// thread of a RenderServer while the next one renders.
+
+void run_animation (Options* options) {
+  Scene scene;
+  FrameTimes times;
+  RenderServer server;
+
+  if (is_compiled_scene(options->input)) {
+    fprintf(stderr, "Error: --animate needs a JSON scene, not a compiled one.\n");
+    exit(1);
+  }
+  load_scene(options, &scene, &times);
+
+  int* slot = malloc(sizeof(int) * (scene.num_spheres > 0 ? scene.num_spheres : 1));
+  if (slot == NULL) {
+    fprintf(stderr, "Error: Out of memory while loading the animation.\n");
+    exit(1);
+  }
+  find_slots(&scene, slot);
+
+  start_server(&server, options, &scene);
+
+  double start = now_seconds();
+  double built_cost = bvh_cost(&scene);
+  double camera[3] = {0, 0, 0};
+  int frames = 0;
+  int rebuilds = 0;
+  JsonFile* json = open_json(options->animation);
+
+  line = 1;
+  skip_ws(json);
+  expect_c(json, '[');
+  skip_ws(json);
+  if (peek_c(json) == ']') {
+    fprintf(stderr, "Error: The animation has no frames.\n");
+    exit(1);
+  }
+
+  while (1) {
+    char* output = NULL;
+    int moved = 0;
+
+    skip_ws(json);
+    expect_c(json, '{');
+    while (1) {
+      skip_ws(json);
+      char* key = next_string(json);
+      skip_ws(json);
+      expect_c(json, ':');
+      skip_ws(json);
+
+      if (strcmp(key, "output") == 0) {
+        output = next_string(json);
+      }
+      else if (strcmp(key, "camera") == 0) {
+        next_vector(json, camera);
+      }
+      else if (strcmp(key, "spheres") == 0) {
+        moved += parse_moves(json, &scene, slot);
+      }
+      else {
+        fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n", key, line);
+        exit(1);
+      }
+
+      skip_ws(json);
+      int c = next_c(json);
+      if (c == '}') {
+        break;
+      }
+      if (c != ',') {
+        fprintf(stderr, "Error: Unexpected character '%c' on line %d.\n", c, line);
+        exit(1);
+      }
+    }
+    if (output == NULL) {
+      fprintf(stderr, "Error: Frame %d has no output.\n", frames + 1);
+      exit(1);
+    }
+
+    // The writer only reads the framebuffers, so the scene can change
+    // while it is busy.
+    double refit_start = now_seconds();
+    bool rebuilt = false;
+    if (moved > 0) {
+      refit_bvh(&scene);
+      if (bvh_cost(&scene) > built_cost * BVH_REBUILD_RATIO) {
+        rebuild_bvh(&scene, options->num_threads);
+        find_slots(&scene, slot);
+        built_cost = bvh_cost(&scene);
+        rebuilt = true;
+        rebuilds += 1;
+      }
+    }
+    bake_scene(&scene, camera);
+    double refit_end = now_seconds();
+
+    frames += 1;
+    if (options->stats) {
+      fprintf(stderr, "Frame %d: %d spheres moved, BVH %s in %.3f ms, cost %.2f\n", frames,
+              moved, rebuilt ? "rebuilt" : (moved > 0 ? "refit" : "unchanged"), (refit_end - refit_start) * 1e3,
+              bvh_cost(&scene));
+    }
+    serve_frame(&server, NULL, options->width, options->height, output, camera);
+
+    skip_ws(json);
+    int c = next_c(json);
+    if (c == ']') {
+      break;
+    }
+    if (c != ',') {
+      fprintf(stderr, "Error: Unexpected character '%c' on line %d.\n", c, line);
+      exit(1);
+    }
+  }
 
-  double a = (normal[0]*direction[0]) + (normal[1]*direction[1]) + (normal[2]*direction[2]); 
-  
-  double b[3];
+  wait_for_writer(&server);
+  close_json(json);
+  if (options->stats) {
+    fprintf(stderr, "Animation: %d frames in %.3f s, %d BVH rebuilds\n", frames,
+            now_seconds() - start, rebuilds);
+  }
+
+  stop_server(&server);
+  free(slot);
+  unload_scene(options, &scene);
+}
+
+// A render can be spread over several machines.  Each runs raycast --node
+// PORT, and the coordinator, given the nodes with --nodes, compiles the
+// scene, ships the compiled scene to every node and then hands out ranges
+// of tiles, the same unit the render threads share, to whichever node
+// asks for more.  A node that fails or stops answering is dropped and its
+// range handed to another node.
+//
+// Every message is in the native byte order and layout, like a compiled
+// scene, so all the machines have to run the same build.  The coordinator
+// opens with a NodeJob followed by the compiled scene.  Then it sends a
+// TileRange at a time and the node answers with the same TileRange
+// followed by the pixels of its tiles, each tile row by row.  A range of
+// 0 tiles ends the job.
+
+#define NODE_MAGIC "RJOB"
+#define NODE_VERSION 1
+#define NODE_TIMEOUT 300
+#define NODE_REQUESTS_PER_NODE 16
+
+// A node refuses compiled scenes larger than NODE_MAX_SCENE_SIZE bytes, or
+// than the free space for its temporary copy.
+
+#define NODE_MAX_SCENE_SIZE ((uint64_t)64 << 30)
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint64_t scene_size;
+  int32_t width;
+  int32_t height;
+  int32_t packets;
+  int32_t pad;
+} NodeJob;
 
-  for (int i = 0; i <= 2; i++) {
-    b[i] = position[i] - origin[i];
+typedef struct {
+  int32_t first;
+  int32_t count;
+} TileRange;
+
+// copy_tiles() copies count tiles starting at first between a width by
+// height framebuffer and packed, where the tiles are stored one after
+// another, each row by row.  If pack is set the tiles go into packed,
+// otherwise out of it.  It returns the size of the packed tiles.
+
+size_t copy_tiles (uint8_t* framebuffer, int width, int height, int first, int count,
+                   uint8_t* packed, bool pack) {
+  int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+  size_t size = 0;
+
+  for (int tile = first; tile < first + count; tile++) {
+    int x0 = (tile % tiles_x) * TILE_SIZE;
+    int y0 = (tile / tiles_x) * TILE_SIZE;
+    int x1 = x0 + TILE_SIZE < width ? x0 + TILE_SIZE : width;
+    int y1 = y0 + TILE_SIZE < height ? y0 + TILE_SIZE : height;
+    size_t row = (size_t)(x1 - x0) * 3;
+
+    for (int y = y0; y < y1; y++) {
+      uint8_t* pixels = &framebuffer[((size_t)y * width + x0) * 3];
+      if (packed != NULL) {
+        memcpy(pack ? packed + size : pixels, pack ? pixels : packed + size, row);
+      }
+      size += row;
+    }
   }
-  
-  double d = (b[0]*normal[0]) + (b[1]*normal[1]) + (b[2]*normal[2]);
+  return size;
+}
+
+// set_timeout() makes reads and writes on socket fail once they have waited
+// NODE_TIMEOUT seconds, so a node that hangs is treated as lost.
+
+void set_timeout (int fd) {
+  struct timeval timeout = {NODE_TIMEOUT, 0};
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// make_temporary() creates an empty temporary file, in $TMPDIR or /tmp,
+// and stores its name in path, which has room for size bytes.  It returns
+// the open file, or -1 after printing an error.
+
+int make_temporary (char* path, size_t size) {
+  char* directory = getenv("TMPDIR");
+
+  snprintf(path, size, "%s/raycast-XXXXXX", directory != NULL ? directory : "/tmp");
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    fprintf(stderr, "Error: Unable to create a temporary file in \"%s\".\n",
+            directory != NULL ? directory : "/tmp");
+  }
+  return fd;
+}
+
+// receive_scene() reads a compiled scene of size bytes from fd into a
+// temporary file and loads it.  It prints an error and returns false if the
+// scene is too large, the connection fails or the scene cannot be loaded.
+
+bool receive_scene (int fd, size_t size, Scene* scene) {
+  static char buffer[1 << 20];
+  char path[4096];
+  struct statvfs space;
+
+  if (size < sizeof(RscnHeader) || size > NODE_MAX_SCENE_SIZE) {
+    fprintf(stderr, "Error: The coordinator sent a scene of %zu bytes.\n", size);
+    return false;
+  }
+  int file = make_temporary(path, sizeof(path));
+  if (file < 0) {
+    return false;
+  }
+  if (fstatvfs(file, &space) != 0 || size > (uint64_t)space.f_bavail * space.f_frsize) {
+    fprintf(stderr, "Error: No room for a scene of %zu bytes in \"%s\".\n", size, path);
+    close(file);
+    unlink(path);
+    return false;
+  }
+
+  bool received = true;
+  while (size > 0 && received) {
+    size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+    struct iovec iov = {buffer, chunk};
+    received = read_all(fd, buffer, chunk) && write_all(file, &iov, 1);
+    size -= chunk;
+  }
+  close(file);
+
+  if (!received) {
+    fprintf(stderr, "Error: Lost the coordinator while receiving the scene.\n");
+  }
+  bool loaded = received && load_compiled_scene(path, scene);
+  if (loaded) {
+    double camera[3] = {0, 0, 0};
+    if (memcmp(scene->baked_origin, camera, sizeof(camera)) != 0) {
+      bake_scene(scene, camera);
+    }
+  }
+  unlink(path);
+  return loaded;
+}
+
+// serve_node_job() renders one job for the coordinator on fd.  It returns
+// once the coordinator ends the job or the connection fails.
+
+void serve_node_job (Options* options, int fd) {
+  NodeJob header;
+  Scene scene;
+
+  if (!read_all(fd, &header, sizeof(header)) || memcmp(header.magic, NODE_MAGIC, 4) != 0 ||
+      header.version != NODE_VERSION || header.width < 1 || header.height < 1 ||
+      header.width > MAX_IMAGE_SIZE || header.height > MAX_IMAGE_SIZE) {
+    fprintf(stderr, "Error: Unexpected job from the coordinator.\n");
+    return;
+  }
+  if (!receive_scene(fd, header.scene_size, &scene)) {
+    return;
+  }
+
+  // The framebuffer covers the whole image, but only the pages of the tiles
+  // being rendered are ever touched, and they are given back after each
+  // range.  The pixels are packed to be sent back one range at a time, so a
+  // node needs little memory even for a huge image.
+  int width = header.width, height = header.height;
+  int num_tiles = ((width + TILE_SIZE - 1) / TILE_SIZE) * ((height + TILE_SIZE - 1) / TILE_SIZE);
+  size_t size = (size_t)width * height * 3;
+  uint8_t* framebuffer = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (framebuffer == MAP_FAILED) {
+    fprintf(stderr, "Error: Unable to allocate a %dx%d framebuffer.\n", width, height);
+    free_scene(&scene);
+    return;
+  }
+
+  RenderJob job = {0};
+  job.scene = &scene;
+  job.width = width;
+  job.height = height;
+  job.packets = header.packets != 0;
+  job.framebuffer = framebuffer;
+  job.aa_samples = 1;
+  job.stride = 1;
+
+  int tiles = 0;
+  TileRange range;
+  while (read_all(fd, &range, sizeof(range)) && range.count > 0) {
+    if (range.first < 0 || range.count > num_tiles - range.first) {
+      fprintf(stderr, "Error: Tiles %d to %d are not in the image.\n", range.first,
+              range.first + range.count);
+      break;
+    }
+
+    size_t packed_size = copy_tiles(framebuffer, width, height, range.first, range.count,
+                                    NULL, true);
+    uint8_t* packed = malloc(packed_size);
+    if (packed == NULL) {
+      fprintf(stderr, "Error: Unable to allocate %d tiles.\n", range.count);
+      break;
+    }
+
+    job.first_tile = range.first;
+    job.tile_count = range.count;
+    render(&job, options->num_threads, false);
+
+    struct iovec iov[2];
+    iov[0].iov_base = &range;
+    iov[0].iov_len = sizeof(range);
+    iov[1].iov_base = packed;
+    iov[1].iov_len = copy_tiles(framebuffer, width, height, range.first, range.count, packed,
+                                true);
+    bool sent = write_all(fd, iov, 2);
+    free(packed);
+    if (!sent) {
+      break;
+    }
+    tiles += range.count;
+    madvise(framebuffer, size, MADV_DONTNEED);
+  }
+
+  if (options->stats) {
+    fprintf(stderr, "Node: rendered %d tiles of a %dx%d image\n", tiles, width, height);
+  }
+  munmap(framebuffer, size);
+  free_scene(&scene);
+}
+
+// run_node() serves coordinators on TCP port options->node_port of
+// options->node_address, one job at a time, until it is killed.  Nodes do
+// not authenticate coordinators, so the address defaults to loopback.
+
+void run_node (Options* options) {
+  struct sockaddr_in address;
+  struct addrinfo hints;
+  struct addrinfo* found;
+  int one = 1;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo(options->node_address, NULL, &hints, &found) != 0) {
+    fprintf(stderr, "Error: Unable to resolve \"%s\".\n", options->node_address);
+    exit(1);
+  }
+  memcpy(&address, found->ai_addr, sizeof(address));
+  address.sin_port = htons(options->node_port);
+  freeaddrinfo(found);
+
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+      bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 8) != 0) {
+    fprintf(stderr, "Error: Unable to listen on %s:%d.\n", options->node_address,
+            options->node_port);
+    exit(1);
+  }
+
+  while (true) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      fprintf(stderr, "Error: Unable to accept a connection on port %d.\n", options->node_port);
+      exit(1);
+    }
+    set_timeout(fd);
+    serve_node_job(options, fd);
+    close(fd);
+  }
+}
+
+// Coordinator is the state the coordinator's node threads share: the tiles
+// not handed out yet, ranges to hand out again after their node was lost,
+// and the framebuffer the tiles come back into.
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  int next_tile;
+  int num_tiles;
+  int chunk;
+  TileRange* retry;
+  int num_retry;
+  int outstanding;
+
+  NodeJob header;
+  void* scene;
+  uint8_t* framebuffer;
+  int width;
+  int height;
+} Coordinator;
 
-  double t = d/a;
+typedef struct {
+  Coordinator* coordinator;
+  char* address;
+  pthread_t thread;
+  int tiles;
+  bool lost;
+} NodeLink;
+
+// connect_node() opens a TCP connection to address, given as host:port.
+// It returns -1 if that fails.
 
-  if (t < 0) {
+int connect_node (char* address) {
+  char host[256];
+  char* colon = strrchr(address, ':');
+
+  if (colon == NULL || (size_t)(colon - address) >= sizeof(host)) {
+    return -1;
+  }
+  memcpy(host, address, colon - address);
+  host[colon - address] = 0;
+
+  struct addrinfo hints, *found;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, colon + 1, &hints, &found) != 0) {
     return -1;
   }
 
-  return t;
+  int fd = -1;
+  for (struct addrinfo* a = found; a != NULL && fd < 0; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(found);
+  if (fd >= 0) {
+    set_timeout(fd);
+  }
+  return fd;
 }
 
-double sphere_intersection(double *origin, double *direction, double *offset, double radius) {
-  double a = (sqr(direction[0]) + sqr(direction[1]) + sqr(direction[2]));
+// next_range() takes the next range of tiles to render, preferring ranges
+// lost with another node.  While no tiles are left, it waits as long as
+// other nodes still have ranges out, since they might fail.  It returns
+// false once every tile is done.
 
-  double b = 2 * (direction[0]*(origin[0]-offset[0]) + direction[1]*(origin[1]-offset[1]) + 
-             direction[2]*(origin[2]-offset[2]));
-  double c = sqr(origin[0]-offset[0]) + sqr(origin[1]-offset[1]) + sqr(origin[2]-offset[2]) - sqr(radius);
+bool next_range (Coordinator* coordinator, TileRange* range) {
+  bool found = true;
 
-  double det = sqr(b) - 4 * a * c;
- 
-  if (det < 0) {
-   return -1;
+  pthread_mutex_lock(&coordinator->lock);
+  while (coordinator->num_retry == 0 && coordinator->next_tile == coordinator->num_tiles &&
+         coordinator->outstanding > 0) {
+    pthread_cond_wait(&coordinator->changed, &coordinator->lock);
   }
- 
-  det = sqrt(det);
+  if (coordinator->num_retry > 0) {
+    *range = coordinator->retry[--coordinator->num_retry];
+  }
+  else if (coordinator->next_tile < coordinator->num_tiles) {
+    range->first = coordinator->next_tile;
+    range->count = coordinator->num_tiles - range->first;
+    if (range->count > coordinator->chunk) {
+      range->count = coordinator->chunk;
+    }
+    coordinator->next_tile += range->count;
+  }
+  else {
+    found = false;
+  }
+  if (found) {
+    coordinator->outstanding += 1;
+  }
+  pthread_mutex_unlock(&coordinator->lock);
+  return found;
+}
 
-  double t0 = (-b - det) / (2*a);
-  if (t0 > 0) {
-    return t0;
+// finish_range() marks a range handed out by next_range() as done, or puts
+// it back to be handed out again if its node was lost.
+
+void finish_range (Coordinator* coordinator, TileRange* range, bool done) {
+  pthread_mutex_lock(&coordinator->lock);
+  if (!done) {
+    coordinator->retry[coordinator->num_retry++] = *range;
   }
+  coordinator->outstanding -= 1;
+  pthread_cond_broadcast(&coordinator->changed);
+  pthread_mutex_unlock(&coordinator->lock);
+}
 
-  double t1 = (-b + det) / (2*a);
-  if (t1 > 0) {
-    return t1;
+// node_link() drives one node: it sends the job and the scene, then asks
+// for ranges of tiles until none are left or the node is lost.
+
+void* node_link (void* context) {
+  NodeLink* link = context;
+  Coordinator* coordinator = link->coordinator;
+  int fd = connect_node(link->address);
+  uint8_t* packed = NULL;
+
+  if (fd >= 0) {
+    struct iovec iov[2];
+    iov[0].iov_base = &coordinator->header;
+    iov[0].iov_len = sizeof(NodeJob);
+    iov[1].iov_base = coordinator->scene;
+    iov[1].iov_len = coordinator->header.scene_size;
+    link->lost = !write_all(fd, iov, 2);
+  }
+  else {
+    link->lost = true;
   }
 
-  return -1;
+  TileRange range;
+  while (!link->lost && next_range(coordinator, &range)) {
+    TileRange answer;
+    size_t size = copy_tiles(coordinator->framebuffer, coordinator->width, coordinator->height,
+                             range.first, range.count, NULL, false);
+    struct iovec iov = {&range, sizeof(range)};
+
+    packed = realloc(packed, size);
+    link->lost = packed == NULL || !write_all(fd, &iov, 1) ||
+                 !read_all(fd, &answer, sizeof(answer)) || answer.first != range.first ||
+                 answer.count != range.count || !read_all(fd, packed, size);
+    if (!link->lost) {
+      copy_tiles(coordinator->framebuffer, coordinator->width, coordinator->height, range.first,
+                 range.count, packed, false);
+      link->tiles += range.count;
+    }
+    finish_range(coordinator, &range, !link->lost);
+  }
+
+  if (fd >= 0) {
+    if (!link->lost) {
+      TileRange end = {0, 0};
+      struct iovec iov = {&end, sizeof(end)};
+      write_all(fd, &iov, 1);
+    }
+    close(fd);
+  }
+  free(packed);
+  return NULL;
+}
+
+// render_distributed() renders the scene on the nodes listed in
+// options->nodes, separated by commas, and writes the output image.
+// JSON scenes are compiled first, so the nodes never parse anything.
+
+void render_distributed (Options* options) {
+  int width = options->width;
+  int height = options->height;
+  size_t scene_size;
+  void* scene_data;
+
+  double start = now_seconds();
+  char* path = options->input;
+  char temporary[4096];
+  if (!is_compiled_scene(options->input)) {
+    int fd = make_temporary(temporary, sizeof(temporary));
+    if (fd < 0) {
+      exit(1);
+    }
+    close(fd);
+
+    Options compile = *options;
+    compile.output = temporary;
+    compile.stats = false;
+    compile_scene_file(&compile);
+    path = temporary;
+  }
+
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", path);
+    exit(1);
+  }
+  scene_size = st.st_size;
+  scene_data = mmap(NULL, scene_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (path == temporary) {
+    unlink(temporary);
+  }
+  if (scene_data == MAP_FAILED) {
+    fprintf(stderr, "Error: Unable to map \"%s\".\n", path);
+    exit(1);
+  }
+  double compiled = now_seconds();
+
+  bool use_mmap = options->use_mmap ||
+                  (!options->ascii && !is_png(options->output) &&
+                   strcmp(options->output, "-") != 0 &&
+                   (size_t)width * height * 3 >= MMAP_THRESHOLD);
+  MappedFile output;
+  uint8_t* framebuffer;
+  if (use_mmap) {
+    framebuffer = map_p6(options->output, width, height, &output);
+  }
+  else {
+    framebuffer = malloc((size_t)width * height * 3);
+    if (framebuffer == NULL) {
+      fprintf(stderr, "Error: Unable to allocate a %dx%d framebuffer.\n", width, height);
+      exit(1);
+    }
+  }
+
+  int num_nodes = 1;
+  for (char* c = options->nodes; *c != 0; c++) {
+    num_nodes += *c == ',';
+  }
+
+  Coordinator coordinator;
+  memset(&coordinator, 0, sizeof(coordinator));
+  pthread_mutex_init(&coordinator.lock, NULL);
+  pthread_cond_init(&coordinator.changed, NULL);
+  coordinator.num_tiles = ((width + TILE_SIZE - 1) / TILE_SIZE) *
+                          ((height + TILE_SIZE - 1) / TILE_SIZE);
+  coordinator.chunk = coordinator.num_tiles / (num_nodes * NODE_REQUESTS_PER_NODE);
+  if (coordinator.chunk < 1) {
+    coordinator.chunk = 1;
+  }
+  coordinator.retry = malloc(sizeof(TileRange) * coordinator.num_tiles);
+  memcpy(coordinator.header.magic, NODE_MAGIC, 4);
+  coordinator.header.version = NODE_VERSION;
+  coordinator.header.scene_size = scene_size;
+  coordinator.header.width = width;
+  coordinator.header.height = height;
+  coordinator.header.packets = options->packets;
+  coordinator.scene = scene_data;
+  coordinator.framebuffer = framebuffer;
+  coordinator.width = width;
+  coordinator.height = height;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  NodeLink* links = calloc(num_nodes, sizeof(NodeLink));
+  char* addresses = strdup(options->nodes);
+  char* next = addresses;
+  for (int i = 0; i < num_nodes; i++) {
+    links[i].coordinator = &coordinator;
+    links[i].address = strsep(&next, ",");
+    if (pthread_create(&links[i].thread, NULL, node_link, &links[i]) != 0) {
+      fprintf(stderr, "Error: Unable to create node thread.\n");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < num_nodes; i++) {
+    pthread_join(links[i].thread, NULL);
+  }
+  double rendered = now_seconds();
+
+  int left = coordinator.num_tiles - coordinator.next_tile;
+  for (int i = 0; i < coordinator.num_retry; i++) {
+    left += coordinator.retry[i].count;
+  }
+  if (left > 0) {
+    fprintf(stderr, "Error: All render nodes were lost with %d tiles left.\n", left);
+    exit(1);
+  }
+
+  if (options->stats) {
+    fprintf(stderr, "Compile: %.3f ms, %zu byte compiled scene\n", (compiled - start) * 1e3,
+            scene_size);
+    fprintf(stderr, "Render: %.3f ms on %d nodes, %d tiles in ranges of %d\n",
+            (rendered - compiled) * 1e3, num_nodes, coordinator.num_tiles, coordinator.chunk);
+    for (int i = 0; i < num_nodes; i++) {
+      fprintf(stderr, "  node %s: %d tiles%s\n", links[i].address, links[i].tiles,
+              links[i].lost ? ", lost" : "");
+    }
+  }
+
+  if (use_mmap) {
+    unmap_p6(&output);
+  }
+  else {
+    if (is_png(options->output)) {
+      write_png(options->output, framebuffer, width, height);
+    }
+    else if (options->ascii) {
+      write_p3(options->output, framebuffer, width, height);
+    }
+    else {
+      write_p6(options->output, framebuffer, width, height);
+    }
+    free(framebuffer);
+  }
+
+  munmap(scene_data, scene_size);
+  pthread_mutex_destroy(&coordinator.lock);
+  pthread_cond_destroy(&coordinator.changed);
+  free(coordinator.retry);
+  free(links);
+  free(addresses);
+}
+
+int compare_doubles (const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// percentile() returns the p-th percentile of the n sorted values by the
+// nearest-rank method.
+
+double percentile (double* sorted, int n, double p) {
+  int rank = (int)ceil(p / 100 * n);
+  if (rank < 1) {
+    rank = 1;
+  }
+  return sorted[rank - 1];
+}
+
+void print_summary (const char* name, double* values, int n, double scale, bool last) {
+  qsort(values, n, sizeof(double), compare_doubles);
+  printf("    \"%s\": {\"min\": %.6g, \"median\": %.6g, \"p99\": %.6g}%s\n", name,
+         values[0] * scale, percentile(values, n, 50) * scale, percentile(values, n, 99) * scale,
+         last ? "" : ",");
+}
+
+// print_json_string() writes text to stdout as a quoted JSON string,
+// escaping quotes, backslashes and control characters.
+
+void print_json_string (char* text) {
+  putchar('"');
+  for (char* c = text; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      printf("\\%c", *c);
+    }
+    else if ((unsigned char)*c < 0x20) {
+      printf("\\u%04x", (unsigned char)*c);
+    }
+    else {
+      putchar(*c);
+    }
+  }
+  putchar('"');
+}
+
+// print_bench() writes the timings of a --bench run to stdout as JSON.
+// Phase times are in milliseconds.
+
+void print_bench (Options* options, FrameTimes* frames, int n) {
+  double* values = malloc(sizeof(double) * n);
+
+  printf("{\n");
+  printf("  \"scene\": ");
+  print_json_string(options->input);
+  printf(",\n");
+  printf("  \"width\": %d,\n", options->width);
+  printf("  \"height\": %d,\n", options->height);
+  printf("  \"threads\": %d,\n", options->num_threads);
+  printf("  \"kernel\": \"%s\",\n", kernel_name);
+  printf("  \"iterations\": %d,\n", n);
+  printf("  \"rays\": %ld,\n", frames[0].rays);
+  printf("  \"phases_ms\": {\n");
+  for (int p = 0; p < NUM_PHASES; p++) {
+    for (int i = 0; i < n; i++) {
+      values[i] = frames[i].phase[p];
+    }
+    print_summary(phase_names[p], values, n, 1e3, false);
+  }
+  for (int i = 0; i < n; i++) {
+    values[i] = 0;
+    for (int p = 0; p < NUM_PHASES; p++) {
+      values[i] += frames[i].phase[p];
+    }
+  }
+  print_summary("total", values, n, 1e3, true);
+  printf("  },\n");
+  printf("  \"rays_per_sec\": {\n");
+  for (int i = 0; i < n; i++) {
+    values[i] = frames[i].rays / frames[i].phase[PHASE_RENDER];
+  }
+  print_summary("render", values, n, 1, true);
+  printf("  },\n");
+
+  Counters* work = &frames[0].counters;
+  printf("  \"work\": {\"rays\": %ld, \"shadow_rays\": %ld, \"sphere_tests\": %ld, "
+         "\"plane_tests\": %ld, \"bvh_nodes_visited\": %ld, \"refined_pixels\": %ld, "
+         "\"extra_samples\": %ld}\n", work->rays, work->shadow_rays, work->sphere_tests,
+         work->plane_tests, work->nodes_visited, work->refined_pixels, work->extra_samples);
+  printf("}\n");
+
+  free(values);
+}
+
+// parse_int() parses the whole of text as a decimal integer from min to max
+// into value, and returns false if it is anything else.
+
+bool parse_int (char* text, long min, long max, long* value) {
+  char* end;
+
+  errno = 0;
+  *value = strtol(text, &end, 10);
+  return end != text && *end == 0 && errno == 0 && *value >= min && *value <= max;
 }
 
+// parse_size() parses positional arguments width and height into options.
+
+bool parse_size (char* width, char* height, Options* options) {
+  long w, h;
+
+  if (!parse_int(width, 1, MAX_IMAGE_SIZE, &w) || !parse_int(height, 1, MAX_IMAGE_SIZE, &h)) {
+    return false;
+  }
+  options->width = w;
+  options->height = h;
+  return true;
+}
 
 int main(int argc, char** argv) {
-  if (argc < 5) {
-    fprintf(stderr, "Error: Not enough arguements.\n");
-    return -1;
+  Options options;
+  char* positional[4];
+  int num_positional = 0;
+
+  options.num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  options.stats = false;
+  options.ascii = false;
+  options.use_mmap = false;
+  options.packets = true;
+  options.progressive = false;
+  options.gpu = false;
+  options.numa_replicate = false;
+  options.bench_iterations = 0;
+  options.heatmap = NULL;
+  options.serve = NULL;
+  options.animation = NULL;
+  options.gbuffer = NULL;
+  options.nodes = NULL;
+  options.node_port = 0;
+  options.node_address = "127.0.0.1";
+  options.mem_budget = 0;
+  options.aa_samples = 1;
+  options.aa_threshold = 0;
+  int aa_max_samples = 16;
+  bool compile_only = false;
+  char* validate = NULL;
+  bool use_numa = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--threads") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --threads requires a value.\n");
+        return -1;
+      }
+      long threads;
+      if (!parse_int(argv[++i], 1, INT_MAX, &threads)) {
+        fprintf(stderr, "Error: %s is an invalid thread count.\n", argv[i]);
+        return -1;
+      }
+      options.num_threads = threads;
+    }
+    else if (strcmp(argv[i], "--bench") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --bench requires an iteration count.\n");
+        return -1;
+      }
+      long iterations;
+      if (!parse_int(argv[++i], 1, INT_MAX, &iterations)) {
+        fprintf(stderr, "Error: %s is an invalid iteration count.\n", argv[i]);
+        return -1;
+      }
+      options.bench_iterations = iterations;
+    }
+    else if (strcmp(argv[i], "--compile-scene") == 0) {
+      if (i + 2 >= argc) {
+        fprintf(stderr, "Error: --compile-scene requires an input and an output file.\n");
+        return -1;
+      }
+      compile_only = true;
+      options.input = argv[++i];
+      options.output = argv[++i];
+    }
+    else if (strcmp(argv[i], "--validate") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --validate requires an input file.\n");
+        return -1;
+      }
+      validate = argv[++i];
+    }
+    else if (strcmp(argv[i], "--aa") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --aa requires a threshold.\n");
+        return -1;
+      }
+      char* end;
+      options.aa_threshold = strtod(argv[++i], &end);
+      if (*end != 0 || end == argv[i] || !(options.aa_threshold >= 0 && options.aa_threshold <= 1)) {
+        fprintf(stderr, "Error: %s is an invalid anti-aliasing threshold.\n", argv[i]);
+        return -1;
+      }
+      options.aa_samples = aa_max_samples;
+    }
+    else if (strcmp(argv[i], "--aa-samples") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --aa-samples requires a sample count.\n");
+        return -1;
+      }
+      long samples;
+      if (!parse_int(argv[++i], 2, 256, &samples)) {
+        fprintf(stderr, "Error: %s is an invalid sample count.\n", argv[i]);
+        return -1;
+      }
+      aa_max_samples = samples;
+      if (options.aa_samples > 1) {
+        options.aa_samples = aa_max_samples;
+      }
+    }
+    else if (strcmp(argv[i], "--mem-budget") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --mem-budget requires a size in megabytes.\n");
+        return -1;
+      }
+      long megabytes;
+      if (!parse_int(argv[++i], 1, LONG_MAX >> 20, &megabytes)) {
+        fprintf(stderr, "Error: %s is an invalid memory budget.\n", argv[i]);
+        return -1;
+      }
+      options.mem_budget = (size_t)megabytes << 20;
+    }
+    else if (strcmp(argv[i], "--serve") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --serve requires a socket path or -.\n");
+        return -1;
+      }
+      options.serve = argv[++i];
+    }
+    else if (strcmp(argv[i], "--animate") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --animate requires an animation file.\n");
+        return -1;
+      }
+      options.animation = argv[++i];
+    }
+    else if (strcmp(argv[i], "--gbuffer") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --gbuffer requires a cache file.\n");
+        return -1;
+      }
+      options.gbuffer = argv[++i];
+    }
+    else if (strcmp(argv[i], "--device") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --device requires cpu or gpu.\n");
+        return -1;
+      }
+      i += 1;
+      if (strcmp(argv[i], "cpu") != 0 && strcmp(argv[i], "gpu") != 0) {
+        fprintf(stderr, "Error: Unknown device \"%s\".\n", argv[i]);
+        return -1;
+      }
+      options.gpu = strcmp(argv[i], "gpu") == 0;
+    }
+    else if (strcmp(argv[i], "--node") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --node requires a port.\n");
+        return -1;
+      }
+      char* port_text = argv[++i];
+      char* colon = strrchr(port_text, ':');
+      if (colon != NULL) {
+        *colon = 0;
+        options.node_address = port_text;
+        port_text = colon + 1;
+      }
+      long port;
+      if (!parse_int(port_text, 1, 65535, &port)) {
+        fprintf(stderr, "Error: %s is an invalid port.\n", port_text);
+        return -1;
+      }
+      options.node_port = port;
+    }
+    else if (strcmp(argv[i], "--nodes") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --nodes requires a list of host:port addresses.\n");
+        return -1;
+      }
+      options.nodes = argv[++i];
+    }
+    else if (strcmp(argv[i], "--heatmap") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --heatmap requires an output file.\n");
+        return -1;
+      }
+      options.heatmap = argv[++i];
+    }
+    else if (strcmp(argv[i], "--stats") == 0) {
+      options.stats = true;
+    }
+    else if (strcmp(argv[i], "--p3") == 0) {
+      options.ascii = true;
+    }
+    else if (strcmp(argv[i], "--mmap") == 0) {
+      options.use_mmap = true;
+    }
+    else if (strcmp(argv[i], "--no-packets") == 0) {
+      options.packets = false;
+    }
+    else if (strcmp(argv[i], "--progressive") == 0) {
+      options.progressive = true;
+    }
+    else if (strcmp(argv[i], "--numa") == 0) {
+      use_numa = true;
+    }
+    else if (strcmp(argv[i], "--numa-replicate") == 0) {
+      use_numa = true;
+      options.numa_replicate = true;
+    }
+    else if (num_positional < 4) {
+      positional[num_positional++] = argv[i];
+    }
+    else {
+      fprintf(stderr, "Error: Too many arguements.\n");
+      return -1;
+    }
+  }
+
+  if (validate != NULL) {
+    if (num_positional > 0) {
+      fprintf(stderr, "Error: Too many arguements.\n");
+      return -1;
+    }
+    return validate_scene(validate) > 0 ? 1 : 0;
+  }
+
+  if (compile_only) {
+    if (num_positional > 0) {
+      fprintf(stderr, "Error: Too many arguements.\n");
+      return -1;
+    }
+    compile_scene_file(&options);
+    return 0;
   }
-  else if (argc > 5) {
-    fprintf(stderr, "Error: Too many arguements.\n");
+
+  if (options.gpu && (options.node_port > 0 || options.nodes != NULL || options.serve != NULL ||
+                      options.animation != NULL)) {
+    fprintf(stderr, "Error: --device gpu cannot be used with --node, --nodes, --serve or --animate.\n");
     return -1;
   }
 
-  int width = (int)(argv[1][0] - '0');
-  int height = (int)(argv[2][0] - '0');
-  if (width < 1) {
-    fprintf(stderr, "Error: %i is an invalid width. \n", width);
+  if (options.numa_replicate && (options.mem_budget > 0 || options.node_port > 0 ||
+                                 options.nodes != NULL || options.serve != NULL ||
+                                 options.animation != NULL)) {
+    fprintf(stderr, "Error: --numa-replicate cannot be used with --mem-budget, --node, --nodes, --serve or --animate.\n");
     return -1;
   }
-  if (height < 1) {
-    fprintf(stderr, "Error: %i is an invalid height. \n", height);
+  if (use_numa) {
+    load_numa();
+    if (options.stats) {
+      fprintf(stderr, "NUMA: %d nodes, %d CPUs\n", numa->num_nodes, numa->num_cpus);
+    }
+  }
+
+  if (options.node_port > 0) {
+    if (num_positional > 0) {
+      fprintf(stderr, "Error: Too many arguements.\n");
+      return -1;
+    }
+    select_kernels();
+    run_node(&options);
+    return 0;
+  }
+
+  if (options.nodes != NULL &&
+      (options.aa_samples > 1 || options.progressive || options.heatmap != NULL ||
+       options.gbuffer != NULL || options.mem_budget > 0 || options.bench_iterations > 0 ||
+       options.serve != NULL || options.animation != NULL)) {
+    fprintf(stderr, "Error: --nodes cannot be used with --aa, --progressive, --heatmap, --gbuffer, --mem-budget, --bench, --serve or --animate.\n");
     return -1;
   }
 
-  FILE *inputFile = fopen(argv[3], "r");
+  if (options.serve != NULL) {
+    if (num_positional != 1) {
+      fprintf(stderr, "Error: --serve takes only an input scene.\n");
+      return -1;
+    }
+    if (options.ascii || options.use_mmap || options.heatmap != NULL ||
+        options.bench_iterations > 0 || options.progressive || options.animation != NULL ||
+        options.gbuffer != NULL) {
+      fprintf(stderr, "Error: --serve cannot be used with --p3, --mmap, --heatmap, --bench, --progressive, --animate or --gbuffer.\n");
+      return -1;
+    }
+    options.input = positional[0];
+    select_kernels();
+    run_server(&options);
+    return 0;
+  }
+
+  if (options.animation != NULL) {
+    if (num_positional != 3) {
+      fprintf(stderr, "Error: --animate takes a width, a height and an input scene.\n");
+      return -1;
+    }
+    if (options.ascii || options.use_mmap || options.heatmap != NULL ||
+        options.bench_iterations > 0 || options.progressive || options.mem_budget > 0 ||
+        options.gbuffer != NULL) {
+      fprintf(stderr, "Error: --animate cannot be used with --p3, --mmap, --heatmap, --bench, --progressive, --mem-budget or --gbuffer.\n");
+      return -1;
+    }
+    options.input = positional[2];
+    if (!parse_size(positional[0], positional[1], &options)) {
+      fprintf(stderr, "Error: %sx%s is an invalid image size.\n", positional[0], positional[1]);
+      return -1;
+    }
+    select_kernels();
+    run_animation(&options);
+    return 0;
+  }
+
+  if (num_positional < 4) {
+    fprintf(stderr, "Error: Not enough arguements.\n");
+    fprintf(stderr, "Usage: raycast [--threads N] [--stats] [--bench N] [--heatmap out.ppm] [--mem-budget MB] [--aa T] [--aa-samples N] [--progressive] [--gbuffer cache.gbuf] [--device cpu|gpu] [--numa] [--numa-replicate] [--p3] [--mmap] [--no-packets] width height input.json output.ppm\n");
+    fprintf(stderr, "       raycast [--threads N] [--stats] --compile-scene input.json output.rscn\n");
+    fprintf(stderr, "       raycast --validate input.json\n");
+    fprintf(stderr, "       raycast [--threads N] [--stats] [--numa] [--mem-budget MB] [--aa T] [--aa-samples N] [--no-packets] --serve socket|- input.json\n");
+    fprintf(stderr, "       raycast [--threads N] [--stats] [--numa] [--aa T] [--aa-samples N] [--no-packets] --animate frames.json width height input.json\n");
+    fprintf(stderr, "       raycast [--threads N] [--stats] [--numa] --node [address:]port\n");
+    fprintf(stderr, "       raycast [--stats] [--p3] [--mmap] [--no-packets] --nodes host:port,... width height input.json output.ppm\n");
+    return -1;
+  }
 
-  if (inputFile == NULL) {
-    fprintf(stderr, "Error: Unable to open input file.\n");
+  options.input = positional[2];
+  options.output = positional[3];
+  if (!parse_size(positional[0], positional[1], &options)) {
+    fprintf(stderr, "Error: %sx%s is an invalid image size.\n", positional[0], positional[1]);
     return -1;
   }
+  if (options.ascii && options.use_mmap) {
+    fprintf(stderr, "Error: --mmap can only be used for P6 output.\n");
+    return -1;
+  }
+  if (is_png(options.output) && (options.ascii || options.use_mmap)) {
+    fprintf(stderr, "Error: --p3 and --mmap cannot be used for PNG output.\n");
+    return -1;
+  }
+  if (options.gbuffer != NULL && options.mem_budget > 0) {
+    fprintf(stderr, "Error: --gbuffer cannot be used with --mem-budget.\n");
+    return -1;
+  }
+  if (options.gpu && (options.gbuffer != NULL || options.mem_budget > 0)) {
+    fprintf(stderr, "Error: --device gpu cannot be used with --gbuffer or --mem-budget.\n");
+    return -1;
+  }
+  if (strcmp(options.output, "-") == 0 && (options.use_mmap || options.bench_iterations > 0)) {
+    fprintf(stderr, "Error: Output to stdout cannot be used with --mmap or --bench.\n");
+    return -1;
+  }
+
+  if (options.nodes != NULL) {
+    render_distributed(&options);
+    return 0;
+  }
+
+  select_kernels();
+
+  if (options.bench_iterations > 0) {
+    FrameTimes* frames = malloc(sizeof(FrameTimes) * options.bench_iterations);
+    for (int i = 0; i < options.bench_iterations; i++) {
+      render_scene_file(&options, &frames[i]);
+    }
+    print_bench(&options, frames, options.bench_iterations);
+    free(frames);
+    return 0;
+  }
 
-  read_scene(argv[3]);
+  FrameTimes times;
+  render_scene_file(&options, &times);
   return 0;
 }